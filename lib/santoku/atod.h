@@ -0,0 +1,186 @@
+#ifndef TK_ATOD_H
+#define TK_ATOD_H
+
+// Decimal to double conversion over a length-bounded buffer. Numbers whose
+// significand fits in 53 bits and whose power of ten is exactly representable
+// are converted with a single multiplication or division (Clinger's fast
+// path), which rounds correctly. Everything else, which is rare in practice
+// (more than 19 significant digits, large exponents, hexadecimal), is copied
+// out and handed to strtod, so results always match strtod. The copy uses the
+// locale's decimal point, so '.' is accepted whatever LC_NUMERIC is.
+
+#include <float.h>
+#include <locale.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TK_ATOD_MAX_DIGITS 19
+
+static const double tk_atod_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static inline bool tk_atod_isdigit(char c) {
+  return (unsigned char)(c - '0') < 10;
+}
+
+static inline char tk_atod_lower(char c) {
+  return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+static inline bool tk_atod_word(const char *p, const char *end, const char *w, size_t n) {
+  if ((size_t)(end - p) < n)
+    return false;
+  for (size_t i = 0; i < n; i++)
+    if (tk_atod_lower(p[i]) != w[i])
+      return false;
+  return true;
+}
+
+// Parses [s, s + len) with strtod, without reading past the buffer.
+static inline size_t tk_atod_slow(const char *s, size_t len, double *out) {
+  char stack[64];
+  char *buf = len < sizeof(stack) ? stack : malloc(len + 1);
+  if (!buf)
+    return 0;
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  char point = localeconv()->decimal_point[0];
+  if (point != '.') {
+    char *dot = memchr(buf, '.', len);
+    if (dot)
+      *dot = point;
+  }
+  char *e;
+  *out = strtod(buf, &e);
+  size_t n = (size_t)(e - buf);
+  if (buf != stack)
+    free(buf);
+  return n;
+}
+
+// Converts m * 10^exp10 exactly when Clinger's fast path applies, which needs
+// doubles evaluated in double precision: FLT_EVAL_METHOD 16 (AVX512-FP16)
+// only widens _Float16. Returns false when the slow path is needed.
+static inline bool tk_atod_fast(uint64_t m, int ndigits, int exp10, bool neg, double *out) {
+#if FLT_EVAL_METHOD == 0 || FLT_EVAL_METHOD == 16
+  if (m == 0) {
+    *out = neg ? -0.0 : 0.0;
+    return true;
+  }
+  if (ndigits <= TK_ATOD_MAX_DIGITS && m <= (1ULL << 53)) {
+    double d = (double)m;
+    if (exp10 >= -22 && exp10 <= 22) {
+      d = exp10 < 0 ? d / tk_atod_pow10[-exp10] : d * tk_atod_pow10[exp10];
+      *out = neg ? -d : d;
+      return true;
+    }
+    // Shift surplus powers of ten into the significand while it stays exact.
+    if (exp10 > 22 && exp10 <= 22 + 15) {
+      uint64_t mm = m;
+      int k = exp10 - 22;
+      while (k > 0 && mm <= (1ULL << 53) / 10) {
+        mm *= 10;
+        k--;
+      }
+      if (k == 0) {
+        d = (double)mm * 1e22;
+        *out = neg ? -d : d;
+        return true;
+      }
+    }
+  }
+  return false;
+#else
+  (void)m;
+  (void)ndigits;
+  (void)exp10;
+  (void)neg;
+  (void)out;
+  return false;
+#endif
+}
+
+// Parses the number at the start of [s, s + len) into out, accepting what
+// strtod accepts apart from leading whitespace. Returns the number of bytes
+// consumed, or 0 when there is no number.
+static inline size_t tk_atod(const char *s, size_t len, double *out) {
+  const char *p = s, *end = s + len;
+  bool neg = false;
+  if (p < end && (*p == '+' || *p == '-'))
+    neg = *p++ == '-';
+  const char *digits = p;
+  if (end - p >= 2 && p[0] == '0' && tk_atod_lower(p[1]) == 'x') {
+    // Hexadecimal, including "0x" alone, which strtod reads as 0.
+    const char *h = p + 2;
+    while (h < end && (tk_atod_isdigit(*h) || (tk_atod_lower(*h) >= 'a' && tk_atod_lower(*h) <= 'f') ||
+                       *h == '.' || tk_atod_lower(*h) == 'p' || *h == '+' || *h == '-'))
+      h++;
+    return tk_atod_slow(s, (size_t)(h - s), out);
+  }
+  uint64_t m = 0;
+  int ndigits = 0;
+  int exp10 = 0;
+  bool any = false;
+  while (p < end && tk_atod_isdigit(*p)) {
+    any = true;
+    if (ndigits < TK_ATOD_MAX_DIGITS) {
+      m = m * 10 + (uint64_t)(*p - '0');
+      ndigits += m > 0;
+    } else {
+      exp10++;
+      ndigits++;
+    }
+    p++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && tk_atod_isdigit(*p)) {
+      any = true;
+      if (ndigits < TK_ATOD_MAX_DIGITS) {
+        m = m * 10 + (uint64_t)(*p - '0');
+        ndigits += m > 0;
+        exp10--;
+      } else {
+        ndigits++;
+      }
+      p++;
+    }
+  }
+  if (!any) {
+    p = digits;
+    if (tk_atod_word(p, end, "infinity", 8))
+      p += 8;
+    else if (tk_atod_word(p, end, "inf", 3) || tk_atod_word(p, end, "nan", 3))
+      p += 3;
+    else
+      return 0;
+    return tk_atod_slow(s, (size_t)(p - s), out);
+  }
+  if (p < end && tk_atod_lower(*p) == 'e') {
+    const char *e = p + 1;
+    bool eneg = false;
+    if (e < end && (*e == '+' || *e == '-'))
+      eneg = *e++ == '-';
+    if (e < end && tk_atod_isdigit(*e)) {
+      int x = 0;
+      while (e < end && tk_atod_isdigit(*e)) {
+        if (x < 100000)
+          x = x * 10 + (*e - '0');
+        e++;
+      }
+      exp10 += eneg ? -x : x;
+      p = e;
+    }
+  }
+  size_t n = (size_t)(p - s);
+  if (tk_atod_fast(m, ndigits, exp10, neg, out))
+    return n;
+  return tk_atod_slow(s, n, out);
+}
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef TK_DTOA_H
+#define TK_DTOA_H
+
+// Shortest round-trip double formatting using Grisu2 (Florian Loitsch,
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers").
+// Output always parses back to the same double; it is the shortest such
+// string for all but a fraction of a percent of inputs, which get one extra
+// digit.
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define TK_DTOA_BUFSIZE 32
+
+typedef struct {
+  uint64_t f;
+  int e;
+} tk_diyfp_t;
+
+static const uint64_t tk_dtoa_powers_f[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t tk_dtoa_powers_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t tk_dtoa_pow10[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+  100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+  1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+  1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL
+};
+
+// High 64 bits of the product, rounded on the highest dropped bit.
+static inline tk_diyfp_t tk_diyfp_mul (tk_diyfp_t a, tk_diyfp_t b)
+{
+#if defined(__SIZEOF_INT128__)
+  __uint128_t p = (__uint128_t) a.f * b.f;
+  uint64_t h = (uint64_t) (p >> 64);
+  if ((uint64_t) p & (1ULL << 63))
+    h ++;
+#else
+  uint64_t ah = a.f >> 32, al = a.f & 0xffffffffULL;
+  uint64_t bh = b.f >> 32, bl = b.f & 0xffffffffULL;
+  uint64_t hh = ah * bh, hl = ah * bl, lh = al * bh, ll = al * bl;
+  uint64_t mid = (ll >> 32) + (hl & 0xffffffffULL) + (lh & 0xffffffffULL) + (1ULL << 31);
+  uint64_t h = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+#endif
+  return (tk_diyfp_t) { h, a.e + b.e + 64 };
+}
+
+// Shifts the nonzero significand up until its top bit is set.
+static inline tk_diyfp_t tk_diyfp_normalize (tk_diyfp_t x)
+{
+#if defined(__GNUC__)
+  int s = __builtin_clzll(x.f);
+#else
+  int s = 0;
+  while (!(x.f & (1ULL << (63 - s))))
+    s ++;
+#endif
+  return (tk_diyfp_t) { x.f << s, x.e - s };
+}
+
+static inline void tk_dtoa_round (char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+      (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1] --;
+    rest += ten_kappa;
+  }
+}
+
+static inline int tk_dtoa_digits32 (uint32_t n)
+{
+  int d = 1;
+  while (d < 9 && n >= tk_dtoa_pow10[d])
+    d ++;
+  return d;
+}
+
+static inline void tk_dtoa_digitgen (tk_diyfp_t w, tk_diyfp_t mp, uint64_t delta, char *buf, int *len, int *k)
+{
+  int shift = -mp.e;
+  uint64_t one = 1ULL << shift;
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t) (mp.f >> shift);
+  uint64_t p2 = mp.f & (one - 1);
+  int kappa = tk_dtoa_digits32(p1);
+  *len = 0;
+  while (kappa > 0) {
+    uint32_t div = (uint32_t) tk_dtoa_pow10[kappa - 1];
+    uint32_t d = p1 / div;
+    p1 %= div;
+    if (d || *len)
+      buf[(*len) ++] = (char) ('0' + d);
+    kappa --;
+    uint64_t rest = ((uint64_t) p1 << shift) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      tk_dtoa_round(buf, *len, delta, rest, tk_dtoa_pow10[kappa] << shift, wp_w);
+      return;
+    }
+  }
+  while (1) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char) (p2 >> shift);
+    if (d || *len)
+      buf[(*len) ++] = (char) ('0' + d);
+    p2 &= one - 1;
+    kappa --;
+    if (p2 < delta) {
+      *k += kappa;
+      int index = -kappa;
+      tk_dtoa_round(buf, *len, delta, p2, one, wp_w * (index < 20 ? tk_dtoa_pow10[index] : 0));
+      return;
+    }
+  }
+}
+
+// Writes the shortest digits of a finite positive double to buf and the
+// decimal exponent to k, such that value = digits * 10^k.
+static inline int tk_dtoa_grisu2 (double value, char *buf, int *k)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int be = (int) ((bits >> 52) & 0x7FF);
+  uint64_t sig = bits & 0xFFFFFFFFFFFFFULL;
+  tk_diyfp_t v = be
+    ? (tk_diyfp_t) { sig + (1ULL << 52), be - 1075 }
+    : (tk_diyfp_t) { sig, -1074 };
+  tk_diyfp_t pl = { (v.f << 1) + 1, v.e - 1 };
+  while (!(pl.f & (1ULL << 53))) {
+    pl.f <<= 1;
+    pl.e --;
+  }
+  pl.f <<= 10;
+  pl.e -= 10;
+  tk_diyfp_t mi = (v.f == (1ULL << 52))
+    ? (tk_diyfp_t) { (v.f << 2) - 1, v.e - 2 }
+    : (tk_diyfp_t) { (v.f << 1) - 1, v.e - 1 };
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+  double dk = (-61 - pl.e) * 0.30102999566398114 + 347;
+  int ik = (int) dk;
+  if (dk - ik > 0.0)
+    ik ++;
+  unsigned index = (unsigned) ((ik >> 3) + 1);
+  *k = -(-348 + (int) (index << 3));
+  tk_diyfp_t c = { tk_dtoa_powers_f[index], tk_dtoa_powers_e[index] };
+  tk_diyfp_t w = tk_diyfp_mul(tk_diyfp_normalize(v), c);
+  tk_diyfp_t wp = tk_diyfp_mul(pl, c);
+  tk_diyfp_t wm = tk_diyfp_mul(mi, c);
+  wm.f ++;
+  wp.f --;
+  int len;
+  tk_dtoa_digitgen(w, wp, wp.f - wm.f, buf, &len, k);
+  return len;
+}
+
+static inline char *tk_dtoa_exponent (char *p, int e)
+{
+  *p ++ = 'e';
+  *p ++ = e < 0 ? '-' : '+';
+  if (e < 0)
+    e = -e;
+  if (e >= 100) {
+    *p ++ = (char) ('0' + e / 100);
+    e %= 100;
+  }
+  *p ++ = (char) ('0' + e / 10);
+  *p ++ = (char) ('0' + e % 10);
+  return p;
+}
+
+// Formats a double as the shortest string that reads back as the same value,
+// using plain notation for moderate exponents and e-notation otherwise, like
+// %g. nan and inf are written as "nan", "inf" and "-inf". buf must hold
+// TK_DTOA_BUFSIZE bytes; the result is NUL-terminated and its length returned.
+static inline int tk_dtoa (double value, char *buf)
+{
+  char *p = buf;
+  if (isnan(value)) {
+    memcpy(buf, "nan", 4);
+    return 3;
+  }
+  if (signbit(value)) {
+    *p ++ = '-';
+    value = -value;
+  }
+  if (isinf(value)) {
+    memcpy(p, "inf", 4);
+    return (int) (p - buf) + 3;
+  }
+  if (value == 0) {
+    *p ++ = '0';
+    *p = '\0';
+    return (int) (p - buf);
+  }
+  char digits[24];
+  int k;
+  int n = tk_dtoa_grisu2(value, digits, &k);
+  int kk = n + k;
+  if (n <= kk && kk <= 17) {
+    memcpy(p, digits, (size_t) n);
+    p += n;
+    for (int i = n; i < kk; i ++)
+      *p ++ = '0';
+  } else if (0 < kk && kk <= 17) {
+    memcpy(p, digits, (size_t) kk);
+    p += kk;
+    *p ++ = '.';
+    memcpy(p, digits + kk, (size_t) (n - kk));
+    p += n - kk;
+  } else if (-5 < kk && kk <= 0) {
+    *p ++ = '0';
+    *p ++ = '.';
+    for (int i = kk; i < 0; i ++)
+      *p ++ = '0';
+    memcpy(p, digits, (size_t) n);
+    p += n;
+  } else {
+    *p ++ = digits[0];
+    if (n > 1) {
+      *p ++ = '.';
+      memcpy(p, digits + 1, (size_t) (n - 1));
+      p += n - 1;
+    }
+    p = tk_dtoa_exponent(p, kk - 1);
+  }
+  *p = '\0';
+  return (int) (p - buf);
+}
+
+// Formats an integer in plain decimal. buf must hold TK_DTOA_BUFSIZE bytes;
+// the result is NUL-terminated and its length returned.
+static inline int tk_i64toa (int64_t value, char *buf)
+{
+  char tmp[24];
+  char *p = buf;
+  uint64_t u = (uint64_t) value;
+  if (value < 0) {
+    *p ++ = '-';
+    u = 0 - u;
+  }
+  int n = 0;
+  do {
+    tmp[n ++] = (char) ('0' + u % 10);
+    u /= 10;
+  } while (u);
+  while (n)
+    *p ++ = tmp[-- n];
+  *p = '\0';
+  return (int) (p - buf);
+}
+
+#endif
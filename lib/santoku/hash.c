@@ -0,0 +1,172 @@
+#include <santoku/lua/utils.h>
+#include <santoku/wyhash.h>
+
+#define TK_HASHER_MT "santoku_hash_hasher"
+
+// Hashes reach Lua as numbers holding the top 53 bits, which are exact as
+// doubles, or as lowercase hex strings holding all 64 or 128 bits.
+
+typedef struct {
+  tk_wyhash_state_t lo;
+  tk_wyhash_state_t hi;
+  uint64_t seed;
+  int bits;
+} tk_hasher_t;
+
+static inline void push_hash (lua_State *L, uint64_t h)
+{
+  lua_pushnumber(L, (lua_Number) (h >> 11));
+}
+
+static inline void hex_u64 (char *out, uint64_t h)
+{
+  for (int i = 15; i >= 0; i--) {
+    out[i] = "0123456789abcdef"[h & 15];
+    h >>= 4;
+  }
+}
+
+// Pushes the digest in the format for bits: 0 for a number, 64 or 128 for hex.
+static inline void push_digest (lua_State *L, int bits, uint64_t lo, uint64_t hi)
+{
+  char buf[32];
+  if (bits == 0) {
+    push_hash(L, lo);
+  } else if (bits == 64) {
+    hex_u64(buf, lo);
+    lua_pushlstring(L, buf, 16);
+  } else {
+    hex_u64(buf, hi);
+    hex_u64(buf + 16, lo);
+    lua_pushlstring(L, buf, 32);
+  }
+}
+
+static inline uint64_t opt_seed (lua_State *L, int i)
+{
+  return (uint64_t) luaL_optinteger(L, i, 0);
+}
+
+static inline int opt_bits (lua_State *L, int i)
+{
+  lua_Integer bits = luaL_optinteger(L, i, 0);
+  if (bits != 0 && bits != 64 && bits != 128)
+    luaL_error(L, "bits must be 64 or 128");
+  return (int) bits;
+}
+
+static inline int hash_string (lua_State *L)
+{
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  uint64_t seed = opt_seed(L, 2);
+  int bits = opt_bits(L, 3);
+  uint64_t lo = tk_wyhash(s, len, seed);
+  uint64_t hi = bits == 128 ? tk_wyhash(s, len, seed ^ TK_WYHASH_SEED2) : 0;
+  push_digest(L, bits, lo, hi);
+  return 1;
+}
+
+static inline int hash_integer (lua_State *L)
+{
+  int64_t n = (int64_t) luaL_checkinteger(L, 1);
+  push_hash(L, tk_wyhash64((uint64_t) n, opt_seed(L, 2)));
+  return 1;
+}
+
+static inline int hash_double (lua_State *L)
+{
+  double x = luaL_checknumber(L, 1);
+  push_hash(L, tk_wyhash_double(x, opt_seed(L, 2)));
+  return 1;
+}
+
+// Maps s to a bucket in 1..n, using the high bits of the hash so that the
+// distribution stays even for any n (Lemire's multiply-shift reduction).
+static inline int hash_bucket (lua_State *L)
+{
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  if (n < 1)
+    return luaL_error(L, "bucket count must be positive");
+  uint64_t a = tk_wyhash(s, len, opt_seed(L, 3)), b = (uint64_t) n;
+  tk_wymum(&a, &b);
+  lua_pushinteger(L, (lua_Integer) b + 1);
+  return 1;
+}
+
+static inline tk_hasher_t *peek_hasher (lua_State *L, int i)
+{
+  return (tk_hasher_t *) luaL_checkudata(L, i, TK_HASHER_MT);
+}
+
+static inline int tk_hasher_gc (lua_State *L)
+{
+  (void) L;
+  return 0;
+}
+
+static inline void hasher_reset (tk_hasher_t *H)
+{
+  tk_wyhash_init(&H->lo, H->seed);
+  if (H->bits == 128)
+    tk_wyhash_init(&H->hi, H->seed ^ TK_WYHASH_SEED2);
+}
+
+static inline int hasher_update (lua_State *L)
+{
+  tk_hasher_t *H = peek_hasher(L, 1);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  tk_wyhash_update(&H->lo, s, len);
+  if (H->bits == 128)
+    tk_wyhash_update(&H->hi, s, len);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static inline int hasher_finish (lua_State *L)
+{
+  tk_hasher_t *H = peek_hasher(L, 1);
+  uint64_t lo = tk_wyhash_final(&H->lo);
+  uint64_t hi = H->bits == 128 ? tk_wyhash_final(&H->hi) : 0;
+  hasher_reset(H);
+  push_digest(L, H->bits, lo, hi);
+  return 1;
+}
+
+static luaL_Reg hasher_fns[] =
+{
+  { "update", hasher_update },
+  { "finish", hasher_finish },
+  { NULL, NULL }
+};
+
+static inline int hasher (lua_State *L)
+{
+  uint64_t seed = opt_seed(L, 1);
+  int bits = opt_bits(L, 2);
+  tk_hasher_t *H = tk_lua_newuserdata(L, tk_hasher_t, TK_HASHER_MT, hasher_fns, tk_hasher_gc);
+  H->seed = seed;
+  H->bits = bits;
+  hasher_reset(H);
+  return 1;
+}
+
+static luaL_Reg fns[] =
+{
+  { "string", hash_string },
+  { "integer", hash_integer },
+  { "double", hash_double },
+  { "bucket", hash_bucket },
+  { "hasher", hasher },
+  { NULL, NULL }
+};
+
+int luaopen_santoku_hash (lua_State *L)
+{
+  lua_newtable(L);
+  tk_lua_register(L, fns, 0);
+  return 1;
+}
@@ -937,17 +937,157 @@ static inline const void *tk_lua_fcheckustring (lua_State *L, int i, char *name,
   return r;
 }
 
+// Codec vector paths are compiled for SSSE3 and AVX2 via target attributes
+// and picked at runtime, so builds don't need -m flags.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TK_LUA_SIMD 1
+#include <immintrin.h>
+
+static inline int tk_lua_simd_level (void)
+{
+  static int level = -1;
+  if (level < 0) {
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+  }
+  return level;
+}
+#endif
+
 static const char tk_lua_hex[] = "0123456789ABCDEF";
 
-static inline void tk_lua_to_hex_buf (const char *data, size_t size0, char *out, size_t *out_size)
+// The two hex digits of every byte value, so encoding is one 16-bit copy per
+// byte.
+static const char tk_lua_hex_pairs[513] =
+  "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+  "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+  "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+  "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+  "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+  "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+  "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+  "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+// Nibble value of each hex digit in either case, 0xFF for anything else.
+static const unsigned char tk_lua_hex_dec[256] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+#ifdef TK_LUA_SIMD
+// Encoding splits each byte into nibbles and maps them through pshufb.
+// Decoding checks each character against the digit and letter ranges,
+// converts it to its nibble, and joins pairs with a multiply-add.
+#define TK_LUA_HEX_SIMD_FNS(tgt, sfx, vec, srli_16, set1_8, shuffle, vand, vor, vsub, cmpgt, movemask, ones) \
+  __attribute__((target(tgt))) static inline void tk_lua_hex_enc_nibbles_##sfx (vec v, vec lut, vec *hi, vec *lo) \
+  { \
+    *hi = shuffle(lut, vand(srli_16(v, 4), set1_8(0x0F))); \
+    *lo = shuffle(lut, vand(v, set1_8(0x0F))); \
+  } \
+  __attribute__((target(tgt))) static inline bool tk_lua_hex_dec_nibbles_##sfx (vec *v) \
+  { \
+    vec c = *v; \
+    vec lower = vor(c, set1_8(0x20)); \
+    vec isd = vand(cmpgt(c, set1_8('0' - 1)), cmpgt(set1_8('9' + 1), c)); \
+    vec isl = vand(cmpgt(lower, set1_8('a' - 1)), cmpgt(set1_8('f' + 1), lower)); \
+    if ((uint32_t) movemask(vor(isd, isl)) != ones) \
+      return false; \
+    *v = vor(vand(isd, vsub(c, set1_8('0'))), vand(isl, vsub(lower, set1_8('a' - 10)))); \
+    return true; \
+  }
+
+TK_LUA_HEX_SIMD_FNS("ssse3", ssse3, __m128i, _mm_srli_epi16, _mm_set1_epi8, _mm_shuffle_epi8, _mm_and_si128,
+  _mm_or_si128, _mm_sub_epi8, _mm_cmpgt_epi8, _mm_movemask_epi8, 0xFFFFu)
+
+TK_LUA_HEX_SIMD_FNS("avx2", avx2, __m256i, _mm256_srli_epi16, _mm256_set1_epi8, _mm256_shuffle_epi8,
+  _mm256_and_si256, _mm256_or_si256, _mm256_sub_epi8, _mm256_cmpgt_epi8, _mm256_movemask_epi8, 0xFFFFFFFFu)
+
+// Each returns how many input bytes it consumed, leaving the rest to the
+// scalar loop. Decoders stop early at a block with an invalid character.
+
+__attribute__((target("ssse3"))) static inline size_t tk_lua_hex_enc_ssse3 (const unsigned char *src, size_t len, char *out)
 {
-  size_t size1 = size0 * 2;
-  for (size_t i = 0; i < size0; ++i) {
-    unsigned char byte = (unsigned char) data[i];
-    out[i * 2] = tk_lua_hex[byte >> 4];
-    out[i * 2 + 1] = tk_lua_hex[byte & 0x0F];
+  const __m128i lut = _mm_loadu_si128((const __m128i *) tk_lua_hex);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16, out += 32) {
+    __m128i hi, lo;
+    tk_lua_hex_enc_nibbles_ssse3(_mm_loadu_si128((const __m128i *) (src + i)), lut, &hi, &lo);
+    _mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi8(hi, lo));
   }
-  *out_size = size1;
+  return i;
+}
+
+__attribute__((target("avx2"))) static inline size_t tk_lua_hex_enc_avx2 (const unsigned char *src, size_t len, char *out)
+{
+  const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) tk_lua_hex));
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32, out += 64) {
+    __m256i v = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i *) (src + i)), 0xD8);
+    __m256i hi, lo;
+    tk_lua_hex_enc_nibbles_avx2(v, lut, &hi, &lo);
+    _mm256_storeu_si256((__m256i *) out, _mm256_unpacklo_epi8(hi, lo));
+    _mm256_storeu_si256((__m256i *) (out + 32), _mm256_unpackhi_epi8(hi, lo));
+  }
+  return i + tk_lua_hex_enc_ssse3(src + i, len - i, out);
+}
+
+__attribute__((target("ssse3"))) static inline size_t tk_lua_hex_dec_ssse3 (const unsigned char *src, size_t len, char *out)
+{
+  const __m128i w = _mm_set1_epi16(0x0110);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32, out += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src + i + 16));
+    if (!tk_lua_hex_dec_nibbles_ssse3(&a) || !tk_lua_hex_dec_nibbles_ssse3(&b))
+      break;
+    _mm_storeu_si128((__m128i *) out, _mm_packus_epi16(_mm_maddubs_epi16(a, w), _mm_maddubs_epi16(b, w)));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static inline size_t tk_lua_hex_dec_avx2 (const unsigned char *src, size_t len, char *out)
+{
+  const __m256i w = _mm256_set1_epi16(0x0110);
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64, out += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (src + i + 32));
+    if (!tk_lua_hex_dec_nibbles_avx2(&a) || !tk_lua_hex_dec_nibbles_avx2(&b))
+      break;
+    __m256i v = _mm256_packus_epi16(_mm256_maddubs_epi16(a, w), _mm256_maddubs_epi16(b, w));
+    _mm256_storeu_si256((__m256i *) out, _mm256_permute4x64_epi64(v, 0xD8));
+  }
+  return i + tk_lua_hex_dec_ssse3(src + i, len - i, out);
+}
+#endif
+
+static inline void tk_lua_to_hex_buf (const char *data, size_t size0, char *out, size_t *out_size)
+{
+  const unsigned char *s = (const unsigned char *) data;
+  size_t i = 0;
+#ifdef TK_LUA_SIMD
+  int level = tk_lua_simd_level();
+  if (level > 0)
+    i = level > 1 ? tk_lua_hex_enc_avx2(s, size0, out) : tk_lua_hex_enc_ssse3(s, size0, out);
+#endif
+  for (; i < size0; ++i)
+    memcpy(out + i * 2, tk_lua_hex_pairs + s[i] * 2, 2);
+  *out_size = size0 * 2;
 }
 
 static inline char *tk_lua_to_hex (const char *data, size_t size0, size_t *out_size)
@@ -963,20 +1103,57 @@ static inline const char *tk_lua_from_hex_buf (const char *data, size_t size0, c
 {
   if (size0 % 2 != 0)
     return "Invalid hex string length";
-  size_t size1 = size0 / 2;
-  for (size_t i = 0; i < size0; i += 2) {
-    int high = data[i];
-    int low = data[i + 1];
-    if (!isxdigit(high) || !isxdigit(low))
-      return "Invalid hex character";
-    high = (isdigit(high) ? high - '0' : (toupper(high) - 'A' + 10));
-    low = (isdigit(low) ? low - '0' : (toupper(low) - 'A' + 10));
+  const unsigned char *s = (const unsigned char *) data;
+  size_t i = 0;
+#ifdef TK_LUA_SIMD
+  int level = tk_lua_simd_level();
+  if (level > 0)
+    i = level > 1 ? tk_lua_hex_dec_avx2(s, size0, out) : tk_lua_hex_dec_ssse3(s, size0, out);
+#endif
+  // Invalid digits set the high bit, which is checked once at the end.
+  unsigned char bad = 0;
+  for (; i < size0; i += 2) {
+    unsigned char high = tk_lua_hex_dec[s[i]];
+    unsigned char low = tk_lua_hex_dec[s[i + 1]];
+    bad |= high | low;
     out[i / 2] = (char) ((high << 4) | low);
   }
-  *out_size = size1;
+  if (bad & 0x80)
+    return "Invalid hex character";
+  *out_size = size0 / 2;
   return NULL;
 }
 
+// Nibble value of hex digit c computed without branches or lookups, with
+// bit 8 set when c isn't a hex digit.
+static inline uint32_t tk_lua_hex_nibble_ct (uint32_t c)
+{
+  int32_t d = (int32_t) c - '0';
+  int32_t l = (int32_t) (c | 0x20) - 'a';
+  int32_t isd = ~(((9 - d) | d) >> 31);
+  int32_t isl = ~(((5 - l) | l) >> 31);
+  return (uint32_t) ((isd & d) | (isl & (l + 10)) | (~(isd | isl) & 0x100));
+}
+
+// Compares hex (either case) against raw bytes without decoding it and in
+// time that depends only on the lengths: mismatches are accumulated rather
+// than returned early, and digits never index a table. Invalid digits
+// compare unequal.
+static inline bool tk_lua_hex_equals (const char *hex, size_t hexlen, const char *raw, size_t rawlen)
+{
+  if (hexlen != rawlen * 2)
+    return false;
+  const unsigned char *h = (const unsigned char *) hex;
+  const unsigned char *r = (const unsigned char *) raw;
+  uint32_t diff = 0;
+  for (size_t i = 0; i < rawlen; i++) {
+    uint32_t hi = tk_lua_hex_nibble_ct(h[i * 2]);
+    uint32_t lo = tk_lua_hex_nibble_ct(h[i * 2 + 1]);
+    diff |= ((hi << 4) | lo) ^ r[i];
+  }
+  return diff == 0;
+}
+
 static inline char *tk_lua_from_hex (const char *data, size_t size0, size_t *out_size, const char **err)
 {
   *err = NULL;
@@ -998,39 +1175,196 @@ static inline char *tk_lua_from_hex (const char *data, size_t size0, size_t *out
 static unsigned char tk_lua_b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static unsigned char tk_lua_b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
+// Reverse alphabets: the 6-bit value of each character, 0xFF for characters
+// outside the alphabet (including '=').
+static const unsigned char tk_lua_b64_dec[256] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+  0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const unsigned char tk_lua_b64url_dec[256] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+  0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0x3F,
+  0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+// Base64 vector paths follow Muła and Lemire ("Faster Base64 Encoding and
+// Decoding using AVX2 Instructions"): bytes are regrouped into 6-bit indices
+// with shuffles and multiplies, and translated with a small shuffle table or
+// range compares.
+#ifdef TK_LUA_SIMD
+#define TK_LUA_B64_SIMD_FNS(tgt, sfx, vec, setr16, set1_32, set1_8, shuffle, vand, vor, vadd, subs_epu8, cmpgt, cmpeq, mulhi, mullo, maddubs, madd, movemask, ones) \
+  __attribute__((target(tgt))) static inline vec tk_lua_b64_enc_ascii_##sfx (vec idx, char c62, char c63) \
+  { \
+    vec r = subs_epu8(idx, set1_8(51)); \
+    vec less = cmpgt(set1_8(26), idx); \
+    r = vor(r, vand(less, set1_8(13))); \
+    vec lut = setr16('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+      '0' - 52, '0' - 52, '0' - 52, (char) (c62 - 62), (char) (c63 - 63), 'A', 0, 0); \
+    return vadd(shuffle(lut, r), idx); \
+  } \
+  __attribute__((target(tgt))) static inline vec tk_lua_b64_enc_split_##sfx (vec in) \
+  { \
+    in = shuffle(in, setr16(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10)); \
+    vec t0 = vand(in, set1_32(0x0fc0fc00)); \
+    vec t1 = mulhi(t0, set1_32(0x04000040)); \
+    vec t2 = vand(in, set1_32(0x003f03f0)); \
+    vec t3 = mullo(t2, set1_32(0x01000010)); \
+    return vor(t1, t3); \
+  } \
+  /* Translates characters to 6-bit values, returning false if any is */ \
+  /* outside the alphabet. Signed compares reject bytes >= 0x80 too. */ \
+  __attribute__((target(tgt))) static inline bool tk_lua_b64_dec_values_##sfx (vec *v, char c62, char c63) \
+  { \
+    vec c = *v; \
+    vec up = vand(cmpgt(c, set1_8('A' - 1)), cmpgt(set1_8('Z' + 1), c)); \
+    vec lo = vand(cmpgt(c, set1_8('a' - 1)), cmpgt(set1_8('z' + 1), c)); \
+    vec dg = vand(cmpgt(c, set1_8('0' - 1)), cmpgt(set1_8('9' + 1), c)); \
+    vec e62 = cmpeq(c, set1_8(c62)); \
+    vec e63 = cmpeq(c, set1_8(c63)); \
+    vec ok = vor(vor(up, lo), vor(dg, vor(e62, e63))); \
+    if ((uint32_t) movemask(ok) != ones) \
+      return false; \
+    vec off = vor(vor(vand(up, set1_8(-65)), vand(lo, set1_8(-71))), \
+      vor(vand(dg, set1_8(4)), vor(vand(e62, set1_8((char) (62 - c62))), vand(e63, set1_8((char) (63 - c63)))))); \
+    *v = vadd(c, off); \
+    return true; \
+  } \
+  __attribute__((target(tgt))) static inline vec tk_lua_b64_dec_pack_##sfx (vec v) \
+  { \
+    vec ab = maddubs(v, set1_32(0x01400140)); \
+    vec out = madd(ab, set1_32(0x00011000)); \
+    return shuffle(out, setr16(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)); \
+  }
+
+#define tk_lua_b64_setr16_128(...) _mm_setr_epi8(__VA_ARGS__)
+#define tk_lua_b64_setr16_256(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+TK_LUA_B64_SIMD_FNS("ssse3", ssse3, __m128i, tk_lua_b64_setr16_128,
+  _mm_set1_epi32, _mm_set1_epi8, _mm_shuffle_epi8, _mm_and_si128, _mm_or_si128, _mm_add_epi8, _mm_subs_epu8,
+  _mm_cmpgt_epi8, _mm_cmpeq_epi8, _mm_mulhi_epu16, _mm_mullo_epi16, _mm_maddubs_epi16, _mm_madd_epi16,
+  _mm_movemask_epi8, 0xFFFFu)
+
+TK_LUA_B64_SIMD_FNS("avx2", avx2, __m256i, tk_lua_b64_setr16_256,
+  _mm256_set1_epi32, _mm256_set1_epi8, _mm256_shuffle_epi8, _mm256_and_si256, _mm256_or_si256, _mm256_add_epi8,
+  _mm256_subs_epu8, _mm256_cmpgt_epi8, _mm256_cmpeq_epi8, _mm256_mulhi_epu16, _mm256_mullo_epi16,
+  _mm256_maddubs_epi16, _mm256_madd_epi16, _mm256_movemask_epi8, 0xFFFFFFFFu)
+
+// Each returns how many input bytes it consumed, always a multiple of 3 (for
+// encoding) or 4 (for decoding), leaving the rest to the scalar loop.
+
+__attribute__((target("ssse3"))) static inline size_t tk_lua_b64_enc_ssse3 (const unsigned char *src, size_t len, char *out, char c62, char c63)
+{
+  size_t i = 0;
+  for (; i + 16 <= len; i += 12, out += 16) {
+    __m128i v = tk_lua_b64_enc_split_ssse3(_mm_loadu_si128((const __m128i *) (src + i)));
+    _mm_storeu_si128((__m128i *) out, tk_lua_b64_enc_ascii_ssse3(v, c62, c63));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static inline size_t tk_lua_b64_enc_avx2 (const unsigned char *src, size_t len, char *out, char c62, char c63)
+{
+  size_t i = 0;
+  for (; i + 28 <= len; i += 24, out += 32) {
+    __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+      _mm_loadu_si128((const __m128i *) (src + i))), _mm_loadu_si128((const __m128i *) (src + i + 12)), 1);
+    __m256i v = tk_lua_b64_enc_split_avx2(in);
+    _mm256_storeu_si256((__m256i *) out, tk_lua_b64_enc_ascii_avx2(v, c62, c63));
+  }
+  return i + tk_lua_b64_enc_ssse3(src + i, len - i, out, c62, c63);
+}
+
+__attribute__((target("ssse3"))) static inline size_t tk_lua_b64_dec_ssse3 (const unsigned char *src, size_t len, char *out, char c62, char c63)
+{
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16, out += 12) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    if (!tk_lua_b64_dec_values_ssse3(&v, c62, c63))
+      break;
+    char tmp[16];
+    _mm_storeu_si128((__m128i *) tmp, tk_lua_b64_dec_pack_ssse3(v));
+    memcpy(out, tmp, 12);
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static inline size_t tk_lua_b64_dec_avx2 (const unsigned char *src, size_t len, char *out, char c62, char c63)
+{
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32, out += 24) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    if (!tk_lua_b64_dec_values_avx2(&v, c62, c63))
+      break;
+    v = _mm256_permutevar8x32_epi32(tk_lua_b64_dec_pack_avx2(v), _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    char tmp[32];
+    _mm256_storeu_si256((__m256i *) tmp, v);
+    memcpy(out, tmp, 24);
+  }
+  return i + tk_lua_b64_dec_ssse3(src + i, len - i, out, c62, c63);
+}
+#endif
+
 static inline void tk_lua_to_base64_buf (const char *src, size_t len, bool url, bool pad, char *out, size_t *out_size)
 {
-  unsigned char *enc = url ? tk_lua_b64url : tk_lua_b64;
-  int64_t i, j;
-  i = j = 0;
-  size_t size = 0;
-  unsigned char buf[4] = {0};
-  unsigned char tmp[3] = {0};
-  size_t remaining = len;
-  while (remaining--) {
-    tmp[i++] = (unsigned char) *(src++);
-    if (3 == i) {
-      buf[0] = (tmp[0] & 0xfc) >> 2;
-      buf[1] = ((tmp[0] & 0x03) << 4) + ((tmp[1] & 0xf0) >> 4);
-      buf[2] = ((tmp[1] & 0x0f) << 2) + ((tmp[2] & 0xc0) >> 6);
-      buf[3] = tmp[2] & 0x3f;
-      for (i = 0; i < 4; ++i)
-        out[size++] = (char) enc[buf[i]];
-      i = 0;
-    }
+  const unsigned char *enc = url ? tk_lua_b64url : tk_lua_b64;
+  const unsigned char *s = (const unsigned char *) src;
+  size_t i = 0, size = 0;
+#ifdef TK_LUA_SIMD
+  int level = tk_lua_simd_level();
+  if (level > 0) {
+    i = level > 1
+      ? tk_lua_b64_enc_avx2(s, len, out, (char) enc[62], (char) enc[63])
+      : tk_lua_b64_enc_ssse3(s, len, out, (char) enc[62], (char) enc[63]);
+    size = i / 3 * 4;
+  }
+#endif
+  for (; i + 3 <= len; i += 3) {
+    uint32_t v = ((uint32_t) s[i] << 16) | ((uint32_t) s[i + 1] << 8) | s[i + 2];
+    out[size++] = (char) enc[v >> 18];
+    out[size++] = (char) enc[(v >> 12) & 0x3f];
+    out[size++] = (char) enc[(v >> 6) & 0x3f];
+    out[size++] = (char) enc[v & 0x3f];
   }
-  if (i > 0) {
-    for (j = i; j < 3; ++j)
-      tmp[j] = '\0';
-    buf[0] = (tmp[0] & 0xfc) >> 2;
-    buf[1] = ((tmp[0] & 0x03) << 4) + ((tmp[1] & 0xf0) >> 4);
-    buf[2] = ((tmp[1] & 0x0f) << 2) + ((tmp[2] & 0xc0) >> 6);
-    buf[3] = tmp[2] & 0x3f;
-    for (j = 0; (j < i + 1); ++j)
-      out[size++] = (char) enc[buf[j]];
+  if (i < len) {
+    uint32_t v = (uint32_t) s[i] << 16;
+    if (i + 1 < len)
+      v |= (uint32_t) s[i + 1] << 8;
+    out[size++] = (char) enc[v >> 18];
+    out[size++] = (char) enc[(v >> 12) & 0x3f];
+    if (i + 1 < len)
+      out[size++] = (char) enc[(v >> 6) & 0x3f];
+    else if (pad)
+      out[size++] = '=';
     if (pad)
-      while ((i++ < 3))
-        out[size++] = '=';
+      out[size++] = '=';
   }
   *out_size = size;
 }
@@ -1044,51 +1378,41 @@ static inline char *tk_lua_to_base64 (const char *src, size_t len, bool url, boo
   return out;
 }
 
+// Decodes up to the first character outside the alphabet (padding included)
+// and ignores the rest, so trailing '=' and garbage after the data are
+// accepted. A final partial group of n characters yields n - 1 bytes.
 static inline void tk_lua_from_base64_buf (const char *src, size_t len, bool url, char *out, size_t *out_size)
 {
-  unsigned char *enc = url ? tk_lua_b64url : tk_lua_b64;
-  int64_t i, j, l;
-  i = j = l = 0;
-  size_t size = 0;
-  unsigned char buf[3];
-  unsigned char tmp[4];
-  size_t remaining = len;
-  while (remaining--) {
-    if ('=' == src[j] || !(isalnum(src[j]) || (url
-        ? ('-' == src[j] || '_' == src[j])
-        : ('+' == src[j] || '/' == src[j]))))
-      break;
-    tmp[i++] = (unsigned char) src[j++];
-    if (4 == i) {
-      for (i = 0; i < 4; ++i)
-        for (l = 0; l < 64; ++l)
-          if (tmp[i] == enc[l]) {
-            tmp[i] = (unsigned char) l;
-            break;
-          }
-      buf[0] = (tmp[0] << 2) + ((tmp[1] & 0x30) >> 4);
-      buf[1] = ((tmp[1] & 0xf) << 4) + ((tmp[2] & 0x3c) >> 2);
-      buf[2] = ((tmp[2] & 0x3) << 6) + tmp[3];
-      for (i = 0; i < 3; ++i)
-        out[size++] = (char) buf[i];
-      i = 0;
-    }
+  const unsigned char *dec = url ? tk_lua_b64url_dec : tk_lua_b64_dec;
+  const unsigned char *s = (const unsigned char *) src;
+  size_t i = 0, size = 0;
+#ifdef TK_LUA_SIMD
+  int level = tk_lua_simd_level();
+  if (level > 0) {
+    char c62 = url ? '-' : '+', c63 = url ? '_' : '/';
+    i = level > 1
+      ? tk_lua_b64_dec_avx2(s, len, out, c62, c63)
+      : tk_lua_b64_dec_ssse3(s, len, out, c62, c63);
+    size = i / 4 * 3;
   }
-  if (i > 0) {
-    for (j = i; j < 4; ++j)
-      tmp[j] = '\0';
-    for (j = 0; j < 4; ++j)
-      for (l = 0; l < 64; ++l)
-        if (tmp[j] == enc[l]) {
-          tmp[j] = (unsigned char) l;
-          break;
-        }
-    buf[0] = (tmp[0] << 2) + ((tmp[1] & 0x30) >> 4);
-    buf[1] = ((tmp[1] & 0xf) << 4) + ((tmp[2] & 0x3c) >> 2);
-    buf[2] = ((tmp[2] & 0x3) << 6) + tmp[3];
-    for (j = 0; (j < i - 1); ++j)
-      out[size++] = (char) buf[j];
+#endif
+  for (; i + 4 <= len; i += 4) {
+    uint32_t a = dec[s[i]], b = dec[s[i + 1]], c = dec[s[i + 2]], d = dec[s[i + 3]];
+    if ((a | b | c | d) & 0x80)
+      break;
+    uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+    out[size++] = (char) (v >> 16);
+    out[size++] = (char) (v >> 8);
+    out[size++] = (char) v;
   }
+  uint32_t v = 0;
+  size_t n = 0;
+  for (; n < 4 && i + n < len && dec[s[i + n]] < 64; n++)
+    v |= (uint32_t) dec[s[i + n]] << (18 - 6 * n);
+  if (n > 1)
+    out[size++] = (char) (v >> 16);
+  if (n > 2)
+    out[size++] = (char) (v >> 8);
   *out_size = size;
 }
 
@@ -1109,8 +1433,9 @@ static inline void tk_lua_to_url_buf (const char *data, size_t size0, char *out,
     if (isalnum(d) || strchr("-_.~", d)) {
       out[j++] = (char) d;
     } else {
-      sprintf(out + j, "%%%02x", d);
-      j += 3;
+      out[j++] = '%';
+      out[j++] = "0123456789abcdef"[d >> 4];
+      out[j++] = "0123456789abcdef"[d & 0x0F];
     }
   }
   *out_size = (size_t) j;
@@ -1132,8 +1457,17 @@ static inline const char *tk_lua_from_url_buf (const char *data, size_t size0, c
     unsigned char d = (unsigned char) data[i];
     if (d == '%') {
       if (i + 2 < (int64_t) size0) {
-        char hex[3] = { data[i + 1], data[i + 2], 0 };
-        out[j++] = (char) strtol(hex, NULL, 16);
+        int high = (unsigned char) data[i + 1];
+        int low = (unsigned char) data[i + 2];
+        if (isxdigit(high) && isxdigit(low)) {
+          high = isdigit(high) ? high - '0' : (toupper(high) - 'A' + 10);
+          low = isdigit(low) ? low - '0' : (toupper(low) - 'A' + 10);
+          out[j++] = (char) ((high << 4) | low);
+        } else {
+          // Malformed escapes keep strtol's lenient reading.
+          char hex[3] = { data[i + 1], data[i + 2], 0 };
+          out[j++] = (char) strtol(hex, NULL, 16);
+        }
         i += 2;
       } else {
         return "Invalid URL encoding";
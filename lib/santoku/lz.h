@@ -0,0 +1,173 @@
+#ifndef TK_LZ_H
+#define TK_LZ_H
+
+// Block compression in the LZ4 block format: a token holding the literal and
+// match lengths, the literals, then a two-byte little-endian offset into the
+// last 64KB of output. Compression is greedy over a small hash table of
+// four-byte sequences, trading ratio for speed. Blocks are independent; the
+// caller records each block's raw size, which decompression needs.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TK_LZ_HASH_LOG 12
+#define TK_LZ_MIN_MATCH 4
+#define TK_LZ_MAX_OFFSET 65535
+// The last match must start at least this far from the end, and the last
+// bytes are always literals, so decoders can copy without checking the tail.
+#define TK_LZ_MFLIMIT 12
+#define TK_LZ_LASTLITERALS 5
+
+// Worst-case compressed size of n bytes.
+static inline size_t tk_lz_bound(size_t n) {
+  return n + n / 255 + 16;
+}
+
+static inline uint32_t tk_lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t tk_lz_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t tk_lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - TK_LZ_HASH_LOG);
+}
+
+static inline uint8_t *tk_lz_putlen(uint8_t *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static inline uint8_t *tk_lz_sequence(
+  uint8_t *op,
+  const uint8_t *lit,
+  size_t nlit,
+  size_t offset,
+  size_t mlen
+) {
+  uint8_t *token = op++;
+  *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+  if (nlit >= 15)
+    op = tk_lz_putlen(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (!mlen)
+    return op;
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+  mlen -= TK_LZ_MIN_MATCH;
+  *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+  if (mlen >= 15)
+    op = tk_lz_putlen(op, mlen - 15);
+  return op;
+}
+
+// Compresses n bytes of src into dst, which must hold tk_lz_bound(n) bytes,
+// and returns the compressed size. Blocks must be smaller than 4GB.
+static inline size_t tk_lz_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+  uint32_t table[1 << TK_LZ_HASH_LOG];
+  uint8_t *op = dst;
+  size_t anchor = 0;
+  if (n > TK_LZ_MFLIMIT) {
+    memset(table, 0, sizeof(table));
+    size_t mflimit = n - TK_LZ_MFLIMIT;
+    size_t matchlimit = n - TK_LZ_LASTLITERALS;
+    size_t ip = 1;
+    while (ip < mflimit) {
+      uint32_t seq = tk_lz_read32(src + ip);
+      uint32_t h = tk_lz_hash(seq);
+      size_t ref = table[h];
+      table[h] = (uint32_t)ip;
+      if (ip - ref > TK_LZ_MAX_OFFSET || tk_lz_read32(src + ref) != seq) {
+        // Step further the longer nothing has matched, so incompressible
+        // input is skipped quickly.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        ip--;
+        ref--;
+      }
+      size_t mlen = TK_LZ_MIN_MATCH;
+      while (ip + mlen + 8 <= matchlimit && tk_lz_read64(src + ip + mlen) == tk_lz_read64(src + ref + mlen))
+        mlen += 8;
+      while (ip + mlen < matchlimit && src[ip + mlen] == src[ref + mlen])
+        mlen++;
+      op = tk_lz_sequence(op, src + anchor, ip - anchor, ip - ref, mlen);
+      ip += mlen;
+      anchor = ip;
+      if (ip < mflimit)
+        table[tk_lz_hash(tk_lz_read32(src + ip - 2))] = (uint32_t)(ip - 2);
+    }
+  }
+  return (size_t)(tk_lz_sequence(op, src + anchor, n - anchor, 0, 0) - dst);
+}
+
+static inline int tk_lz_getlen(const uint8_t **ip, const uint8_t *end, size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= end)
+      return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+// Decompresses n bytes of src into exactly out bytes at dst. Returns 0, or -1
+// when the input is malformed or doesn't decode to out bytes.
+static inline int tk_lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out) {
+  const uint8_t *ip = src, *end = src + n;
+  uint8_t *op = dst, *oend = dst + out;
+  for (;;) {
+    if (ip >= end)
+      return -1;
+    uint8_t token = *ip++;
+    size_t nlit = token >> 4;
+    if (nlit == 15 && tk_lz_getlen(&ip, end, &nlit) != 0)
+      return -1;
+    if (nlit > (size_t)(end - ip) || nlit > (size_t)(oend - op))
+      return -1;
+    memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == end)
+      break;
+    if (end - ip < 2)
+      return -1;
+    size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst))
+      return -1;
+    size_t mlen = token & 15;
+    if (mlen == 15 && tk_lz_getlen(&ip, end, &mlen) != 0)
+      return -1;
+    mlen += TK_LZ_MIN_MATCH;
+    if (mlen > (size_t)(oend - op))
+      return -1;
+    const uint8_t *ref = op - offset;
+    if (offset >= mlen) {
+      memcpy(op, ref, mlen);
+      op += mlen;
+    } else {
+      // Overlapping matches repeat the last offset bytes.
+      for (size_t i = 0; i < mlen; i++)
+        op[i] = ref[i];
+      op += mlen;
+    }
+  }
+  return op == oend ? 0 : -1;
+}
+
+#endif
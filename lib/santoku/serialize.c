@@ -4,7 +4,17 @@
 #include <ctype.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <santoku/lua/utils.h>
+#include <santoku/atod.h>
+#include <santoku/dtoa.h>
+#include <santoku/lz.h>
+
 
 #define MAX_DEPTH_DEFAULT 200
 #define INDENT_STRING "  "
@@ -28,120 +38,686 @@ static int lua_isinteger_compat(lua_State *L, int idx) {
 #endif
 }
 
-static void out_push(lua_State *L, int out_idx, lua_Integer *n, const char *s) {
-  lua_pushstring(L, s);
-  lua_rawseti(L, out_idx, ++(*n));
+#define TK_SERIALIZE_MT "santoku_serialize_state"
+#define TK_SERIALIZE_VIEW_MT "santoku_serialize_view"
+#define TK_SERIALIZE_MAP_MT "santoku_serialize_map"
+#define TK_JSON_ARRAY_MT "santoku_serialize_json_array"
+#define TK_JSON_OBJECT_MT "santoku_serialize_json_object"
+#define TK_SERIALIZE_MAGIC "\x1bTKS"
+#define TK_SERIALIZE_MAGIC_LEN 4
+#define TK_SERIALIZE_VERSION 1
+#define TK_LZ_FRAME_MAGIC "\x1bTKZ"
+#define TK_LZ_FRAME_MAGIC_LEN 4
+#define TK_LZ_FRAME_VERSION 1
+
+enum {
+  TAG_NIL = 0,
+  TAG_FALSE = 1,
+  TAG_TRUE = 2,
+  TAG_INT = 3,
+  TAG_DOUBLE = 4,
+  TAG_STRING = 5,
+  TAG_TABLE = 6,
+  TAG_REFS = 7,
+  TAG_REF = 8,
+  TAG_STRINGS = 9,
+  TAG_STRREF = 10,
+  TAG_COLUMNS = 11,
+  TAG_PATCH = 12,
+  TAG_ITABLE = 13,
+};
+
+enum {
+  PATCH_END = 0,
+  PATCH_SET = 1,
+  PATCH_DEL = 2,
+  PATCH_TABLE = 3,
+};
+
+enum {
+  COL_ANY = 0,
+  COL_INT = 1,
+  COL_DOUBLE = 2,
+  COL_BOOL = 3,
+  COL_STRING = 4,
+};
+
+#define COLUMNS_MIN_ROWS 2
+
+#define tk_serialize_ptr_hash(k) ((khint_t)tk_hash_mix(k))
+KHASH_INIT(tk_serialize_seen, khint64_t, uint64_t, 1, tk_serialize_ptr_hash, kh_int64_hash_equal)
+
+#define CHUNK_SIZE_DEFAULT 65536
+#define CHUNK_SLACK 16
+#define LZ_BLOCK_SIZE (1 << 18)
+#define LZ_HEADER_MAX (TK_LZ_FRAME_MAGIC_LEN + 1 + 20)
+
+#define DIGEST_SEED_LO 0x243f6a8885a308d3ULL
+#define DIGEST_SEED_HI 0x13198a2e03707344ULL
+
+// Hash-part key captured for canonical ordering.
+typedef struct {
+  int type;
+  bool isint;
+  int64_t i;
+  double n;
+  const char *s;
+  size_t len;
+} tk_serialize_key_t;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  int sink;
+  FILE *fh;
+  size_t chunk;
+  size_t total;
+  khash_t(tk_serialize_seen) seen;
+  bool refs;
+  uint64_t next_id;
+  khash_t(tk_serialize_seen) strs;
+  bool intern;
+  uint64_t next_str;
+  khash_t(tk_serialize_seen) coldict;
+  bool columnar;
+  bool canonical;
+  tk_serialize_key_t *keys;
+  size_t nkeys;
+  size_t keys_cap;
+  bool indexed;
+  uint64_t *offs;
+  size_t noffs;
+  size_t offs_cap;
+  bool compress;
+  bool zstarted;
+  char *zdata;
+  size_t zcap;
+  bool json;
+  int null;
+  bool digest;
+  uint64_t digest_lo;
+  uint64_t digest_hi;
+} tk_serialize_t;
+
+// Orders by type, then value; integral numbers compare as integers.
+static inline bool tk_serialize_key_lt(tk_serialize_key_t a, tk_serialize_key_t b) {
+  if (a.type != b.type)
+    return a.type < b.type;
+  switch (a.type) {
+    case LUA_TBOOLEAN:
+      return a.i < b.i;
+    case LUA_TNUMBER:
+      return (a.isint && b.isint) ? a.i < b.i : a.n < b.n;
+    default: {
+      int c = memcmp(a.s, b.s, tk_min(a.len, b.len));
+      return c < 0 || (c == 0 && a.len < b.len);
+    }
+  }
+}
+
+KSORT_INIT(tk_serialize_keys, tk_serialize_key_t, tk_serialize_key_lt)
+
+static int tk_serialize_gc(lua_State *L) {
+  tk_serialize_t *S = (tk_serialize_t *)luaL_checkudata(L, 1, TK_SERIALIZE_MT);
+  free(S->data);
+  S->data = NULL;
+  S->len = S->cap = 0;
+  free(S->keys);
+  S->keys = NULL;
+  S->nkeys = S->keys_cap = 0;
+  free(S->offs);
+  S->offs = NULL;
+  S->noffs = S->offs_cap = 0;
+  free(S->zdata);
+  S->zdata = NULL;
+  S->zcap = 0;
+  kh_destroy(tk_serialize_seen, &S->seen);
+  kh_destroy(tk_serialize_seen, &S->strs);
+  kh_destroy(tk_serialize_seen, &S->coldict);
+  return 0;
+}
+
+// Buffers are released by __gc so errors don't leak.
+static tk_serialize_t *tk_serialize_new(lua_State *L) {
+  tk_serialize_t *S = tk_lua_newuserdata(L, tk_serialize_t, TK_SERIALIZE_MT, NULL, tk_serialize_gc);
+  kh_init(tk_serialize_seen, &S->seen, 1);
+  kh_init(tk_serialize_seen, &S->strs, 1);
+  kh_init(tk_serialize_seen, &S->coldict, 1);
+  return S;
+}
+
+// Returns true when the table was already seen; refs keeps ids for shared tables.
+static bool seen_enter(lua_State *L, tk_serialize_t *S, int idx, uint64_t *id) {
+  int absent;
+  uint64_t key = (uint64_t)(uintptr_t)lua_topointer(L, idx);
+  khint_t k = kh_put(tk_serialize_seen, &S->seen, key, &absent);
+  if (absent < 0)
+    tk_lua_errmalloc(L);
+  if (!absent) {
+    *id = kh_value(&S->seen, k);
+    return true;
+  }
+  kh_value(&S->seen, k) = S->refs ? ++S->next_id : 0;
+  return false;
+}
+
+static void seen_leave(lua_State *L, tk_serialize_t *S, int idx) {
+  if (S->refs)
+    return;
+  uint64_t key = (uint64_t)(uintptr_t)lua_topointer(L, idx);
+  khint_t k = kh_get(tk_serialize_seen, &S->seen, key);
+  if (k != kh_end(&S->seen))
+    kh_del(tk_serialize_seen, &S->seen, k);
+}
+
+// Chunks are multiples of 8 bytes, so the digest doesn't depend on chunk_size.
+static void digest_update(tk_serialize_t *S, const char *s, size_t len) {
+  uint64_t lo = S->digest_lo, hi = S->digest_hi;
+  while (len) {
+    uint64_t w = 0;
+    size_t n = tk_min(len, 8);
+    for (size_t i = 0; i < n; i++)
+      w |= (uint64_t)(uint8_t)s[i] << (8 * i);
+    lo = tk_hash_128(w, lo);
+    hi = tk_hash_128(((w << 32) | (w >> 32)) ^ DIGEST_SEED_LO, hi + lo);
+    s += n;
+    len -= n;
+  }
+  S->digest_lo = lo;
+  S->digest_hi = hi;
+}
+
+static void buf_out(lua_State *L, tk_serialize_t *S, const char *s, size_t len) {
+  S->total += len;
+  if (S->digest) {
+    digest_update(S, s, len);
+  } else if (S->fh) {
+    tk_lua_fwrite(L, (void *)s, 1, len, S->fh);
+  } else {
+    lua_pushvalue(L, S->sink);
+    lua_pushlstring(L, s, len);
+    lua_call(L, 1, 0);
+  }
+}
+
+static inline size_t lz_putvarint(char *p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (char)((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (char)v;
+  return n;
+}
+
+// Block: raw length, stored length << 1 | uncompressed, bytes. Zero ends the frame.
+static const char *lz_block(lua_State *L, tk_serialize_t *S, const char *s, size_t len, size_t *n) {
+  size_t need = LZ_HEADER_MAX + tk_lz_bound(len);
+  if (need > S->zcap) {
+    S->zdata = tk_realloc(L, S->zdata, need);
+    S->zcap = need;
+  }
+  char *body = S->zdata + LZ_HEADER_MAX;
+  size_t clen = len ? tk_lz_compress((const uint8_t *)s, len, (uint8_t *)body) : 0;
+  bool stored = clen >= len;
+  if (stored && len) {
+    memcpy(body, s, len);
+    clen = len;
+  }
+  char head[LZ_HEADER_MAX];
+  size_t h = 0;
+  if (!S->zstarted) {
+    memcpy(head, TK_LZ_FRAME_MAGIC, TK_LZ_FRAME_MAGIC_LEN);
+    head[TK_LZ_FRAME_MAGIC_LEN] = TK_LZ_FRAME_VERSION;
+    h = TK_LZ_FRAME_MAGIC_LEN + 1;
+    S->zstarted = true;
+  }
+  h += lz_putvarint(head + h, len);
+  if (len)
+    h += lz_putvarint(head + h, ((uint64_t)clen << 1) | stored);
+  else
+    clen = 0;
+  memcpy(body - h, head, h);
+  *n = h + clen;
+  return body - h;
+}
+
+static void buf_emit(lua_State *L, tk_serialize_t *S, const char *s, size_t len) {
+  if (!len)
+    return;
+  if (!S->compress) {
+    buf_out(L, S, s, len);
+    return;
+  }
+  while (len) {
+    size_t n, m = tk_min(len, (size_t)LZ_BLOCK_SIZE);
+    const char *b = lz_block(L, S, s, m, &n);
+    buf_out(L, S, b, n);
+    s += m;
+    len -= m;
+  }
+}
+
+static void lz_push(lua_State *L, tk_serialize_t *S, const char *s, size_t len) {
+  luaL_Buffer B;
+  luaL_buffinit(L, &B);
+  size_t n;
+  const char *b;
+  while (len) {
+    size_t m = tk_min(len, (size_t)LZ_BLOCK_SIZE);
+    b = lz_block(L, S, s, m, &n);
+    luaL_addlstring(&B, b, n);
+    s += m;
+    len -= m;
+  }
+  b = lz_block(L, S, NULL, 0, &n);
+  luaL_addlstring(&B, b, n);
+  luaL_pushresult(&B);
+}
+
+static void buf_flush(lua_State *L, tk_serialize_t *S) {
+  size_t off = 0;
+  while (S->len - off >= S->chunk) {
+    buf_emit(L, S, S->data + off, S->chunk);
+    off += S->chunk;
+  }
+  if (off) {
+    memmove(S->data, S->data + off, S->len - off);
+    S->len -= off;
+  }
+}
+
+static void buf_finish(lua_State *L, tk_serialize_t *S) {
+  if (S->sink) {
+    buf_flush(L, S);
+    buf_emit(L, S, S->data, S->len);
+    S->len = 0;
+    if (S->compress) {
+      size_t n;
+      const char *b = lz_block(L, S, NULL, 0, &n);
+      buf_out(L, S, b, n);
+    }
+    lua_pushnumber(L, (lua_Number)S->total);
+  } else if (S->compress) {
+    lz_push(L, S, S->data, S->len);
+  } else {
+    lua_pushlstring(L, S->data, S->len);
+  }
+}
+
+static inline void buf_reserve(lua_State *L, tk_serialize_t *S, size_t n) {
+  if (S->len + n <= S->cap)
+    return;
+  if (S->sink && S->len >= S->chunk) {
+    buf_flush(L, S);
+    if (S->len + n <= S->cap)
+      return;
+  }
+  size_t cap = S->cap ? S->cap : 256;
+  while (cap < S->len + n)
+    cap *= 2;
+  S->data = tk_realloc(L, S->data, cap);
+  S->cap = cap;
+}
+
+static inline void buf_write(lua_State *L, tk_serialize_t *S, const void *s, size_t len) {
+  if (S->sink && S->len + len > S->cap) {
+    const char *p = (const char *)s;
+    while (len) {
+      if (S->len == S->cap)
+        buf_flush(L, S);
+      size_t n = tk_min(len, S->cap - S->len);
+      memcpy(S->data + S->len, p, n);
+      S->len += n;
+      p += n;
+      len -= n;
+    }
+    return;
+  }
+  buf_reserve(L, S, len);
+  memcpy(S->data + S->len, s, len);
+  S->len += len;
+}
+
+static inline void buf_str(lua_State *L, tk_serialize_t *S, const char *s) {
+  buf_write(L, S, s, strlen(s));
+}
+
+static inline void buf_byte(lua_State *L, tk_serialize_t *S, uint8_t c) {
+  buf_reserve(L, S, 1);
+  S->data[S->len++] = (char)c;
+}
+
+static inline void buf_varint(lua_State *L, tk_serialize_t *S, uint64_t v) {
+  buf_reserve(L, S, 10);
+  while (v >= 0x80) {
+    S->data[S->len++] = (char)((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  S->data[S->len++] = (char)v;
+}
+
+static inline void buf_double(lua_State *L, tk_serialize_t *S, double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  buf_reserve(L, S, 8);
+  for (int i = 0; i < 8; i++)
+    S->data[S->len++] = (char)((bits >> (8 * i)) & 0xFF);
+}
+
+static inline int binary_isint(double num, int64_t *out) {
+  if (!(num >= -9223372036854775808.0 && num < 9223372036854775808.0))
+    return 0;
+  if (num == 0 && signbit(num))
+    return 0;
+  int64_t i = (int64_t)num;
+  if ((double)i != num)
+    return 0;
+  *out = i;
+  return 1;
+}
+
+static inline void push_int64(lua_State *L, int64_t i) {
+#if LUA_VERSION_NUM >= 503
+  lua_pushinteger(L, (lua_Integer)i);
+#else
+  lua_pushnumber(L, (lua_Number)i);
+#endif
+}
+
+static int serialize_max_depth(lua_State *L, lua_Integer max_depth) {
+  if (max_depth < 1)
+    luaL_error(L, "max_depth must be at least 1");
+  return (int)max_depth;
+}
+
+static lua_Integer table_maxi(lua_State *L, int idx) {
+  lua_Integer maxi = 0;
+  lua_Integer n = (lua_Integer)lua_rawlen(L, idx);
+  if (n > 100000000)
+    luaL_error(L, "array part too large: %d", (int)n);
+  for (lua_Integer i = 1; i <= n; i++) {
+    lua_rawgeti(L, idx, i);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      break;
+    }
+    maxi = i;
+    lua_pop(L, 1);
+  }
+  return maxi;
+}
+
+static inline int table_inarray(lua_State *L, int kidx, lua_Integer maxi) {
+  if (lua_type(L, kidx) == LUA_TNUMBER && lua_isinteger_compat(L, kidx)) {
+    lua_Integer k = lua_tointeger(L, kidx);
+    return k >= 1 && k <= maxi;
+  }
+  return 0;
 }
 
-static void out_pushlen(lua_State *L, int out_idx, lua_Integer *n, const char *s, size_t len) {
-  lua_pushlstring(L, s, len);
-  lua_rawseti(L, out_idx, ++(*n));
+// Pushes the sorted hash keys onto S->keys; callers reset S->nkeys when done.
+static size_t table_keys(lua_State *L, tk_serialize_t *S, int idx, lua_Integer maxi) {
+  size_t base = S->nkeys;
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0) {
+    lua_pop(L, 1);
+    if (table_inarray(L, -1, maxi))
+      continue;
+    if (S->nkeys == S->keys_cap) {
+      S->keys_cap = S->keys_cap ? S->keys_cap * 2 : 64;
+      S->keys = tk_realloc(L, S->keys, S->keys_cap * sizeof(tk_serialize_key_t));
+    }
+    tk_serialize_key_t *k = &S->keys[S->nkeys++];
+    memset(k, 0, sizeof(*k));
+    k->type = lua_type(L, -1);
+    switch (k->type) {
+      case LUA_TBOOLEAN:
+        k->i = lua_toboolean(L, -1);
+        break;
+      case LUA_TNUMBER:
+        k->n = lua_tonumber(L, -1);
+        k->isint = lua_isinteger_compat(L, -1);
+        if (k->isint)
+          k->i = (int64_t)lua_tointeger(L, -1);
+        break;
+      case LUA_TSTRING:
+        k->s = lua_tolstring(L, -1, &k->len);
+        break;
+      default:
+        luaL_error(L, "cannot canonically order %s keys", lua_typename(L, k->type));
+    }
+  }
+  size_t n = S->nkeys - base;
+  ks_introsort(tk_serialize_keys, n, S->keys + base);
+  return n;
 }
 
-static void out_pushchar(lua_State *L, int out_idx, lua_Integer *n, char c) {
-  lua_pushlstring(L, &c, 1);
-  lua_rawseti(L, out_idx, ++(*n));
+static void table_pushkey(lua_State *L, tk_serialize_key_t *k) {
+  switch (k->type) {
+    case LUA_TBOOLEAN:
+      lua_pushboolean(L, (int)k->i);
+      break;
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+      if (k->isint) {
+        lua_pushinteger(L, (lua_Integer)k->i);
+        break;
+      }
+#endif
+      lua_pushnumber(L, k->n);
+      break;
+    default:
+      lua_pushlstring(L, k->s, k->len);
+      break;
+  }
 }
 
-static void out_pushvalue(lua_State *L, int out_idx, lua_Integer *n) {
-  lua_rawseti(L, out_idx, ++(*n));
+// lua_next, or the sorted keys from table_keys in canonical mode.
+static int table_next(lua_State *L, tk_serialize_t *S, int idx, size_t base, size_t n, size_t *i) {
+  if (!S->canonical)
+    return lua_next(L, idx);
+  lua_pop(L, 1);
+  if (*i >= n)
+    return 0;
+  table_pushkey(L, &S->keys[base + (*i)++]);
+  lua_pushvalue(L, -1);
+  lua_rawget(L, idx);
+  return 1;
 }
 
 static void serialize_value(
   lua_State *L,
-  int out_idx,
-  lua_Integer *out_n,
+  tk_serialize_t *S,
   int idx,
   int level,
   const char *nl,
   const char *div,
   const char *sep,
-  int seen_idx,
   int max_depth);
 
-static void serialize_string(lua_State *L, int out_idx, lua_Integer *out_n, const char *s, size_t len) {
-  out_pushchar(L, out_idx, out_n, '"');
+// 0 copies, 1 writes \ddd, otherwise the escape character.
+static const char lua_escape[256] = {
+  1, 1, 1, 1, 1, 1, 1, 'a', 'b', 't', 'n', 'v', 'f', 'r', 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+// 0 copies, 'u' writes \u00XX, otherwise the escape character.
+static const char json_escape[256] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+};
+
+#ifdef TK_LUA_SIMD
+// Escaped bytes are all < 32 or 127 as signed bytes (JSON: < 32 unsigned).
+static inline size_t escape_scan_sse2(const char *s, size_t i, size_t len, bool json) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i ctl = _mm_set1_epi8(0x1F);
+  const __m128i del = _mm_set1_epi8(0x7F);
+  while (i + 16 <= len) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, bslash));
+    if (json)
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(x, ctl), x));
+    else
+      m = _mm_or_si128(m, _mm_or_si128(_mm_cmplt_epi8(x, space), _mm_cmpeq_epi8(x, del)));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(m);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+    i += 16;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static inline size_t escape_scan_avx2(const char *s, size_t i, size_t len, bool json) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i bslash = _mm256_set1_epi8('\\');
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i ctl = _mm256_set1_epi8(0x1F);
+  const __m256i del = _mm256_set1_epi8(0x7F);
+  while (i + 32 <= len) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(const void *)(s + i));
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(x, quote), _mm256_cmpeq_epi8(x, bslash));
+    if (json)
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(x, ctl), x));
+    else
+      m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpgt_epi8(space, x), _mm256_cmpeq_epi8(x, del)));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+    i += 32;
+  }
+  return escape_scan_sse2(s, i, len, json);
+}
+#endif
+
+static inline size_t escape_scan(const char *s, size_t i, size_t len, bool json) {
+#ifdef TK_LUA_SIMD
+  i = tk_lua_simd_level() > 1 ? escape_scan_avx2(s, i, len, json) : escape_scan_sse2(s, i, len, json);
+#endif
+  const char *table = json ? json_escape : lua_escape;
+  while (i < len && !table[(unsigned char)s[i]])
+    i++;
+  return i;
+}
+
+static void serialize_string(lua_State *L, tk_serialize_t *S, const char *s, size_t len) {
+  buf_byte(L, S, '"');
   size_t start = 0;
-  for (size_t i = 0; i < len; i++) {
+  size_t i = 0;
+  while ((i = escape_scan(s, i, len, false)) < len) {
+    if (i > start)
+      buf_write(L, S, s + start, i - start);
     unsigned char c = (unsigned char)s[i];
-    const char *esc = NULL;
-    char escbuf[5];
-    switch (c) {
-      case '"':  esc = "\\\""; break;
-      case '\\': esc = "\\\\"; break;
-      case '\n': esc = "\\n"; break;
-      case '\r': esc = "\\r"; break;
-      case '\t': esc = "\\t"; break;
-      case '\0': esc = "\\000"; break;
-      case '\a': esc = "\\a"; break;
-      case '\b': esc = "\\b"; break;
-      case '\f': esc = "\\f"; break;
-      case '\v': esc = "\\v"; break;
-      default:
-        if (c < 32 || c >= 127) {
-          snprintf(escbuf, sizeof(escbuf), "\\%03d", c);
-          esc = escbuf;
-        }
-        break;
-    }
-    if (esc) {
-      if (i > start)
-        out_pushlen(L, out_idx, out_n, s + start, i - start);
-      out_push(L, out_idx, out_n, esc);
-      start = i + 1;
+    char e = lua_escape[c];
+    buf_reserve(L, S, 4);
+    S->data[S->len++] = '\\';
+    if (e != 1) {
+      S->data[S->len++] = e;
+    } else {
+      S->data[S->len++] = (char)('0' + c / 100);
+      S->data[S->len++] = (char)('0' + c / 10 % 10);
+      S->data[S->len++] = (char)('0' + c % 10);
     }
+    start = ++i;
   }
   if (len > start)
-    out_pushlen(L, out_idx, out_n, s + start, len - start);
-  out_pushchar(L, out_idx, out_n, '"');
+    buf_write(L, S, s + start, len - start);
+  buf_byte(L, S, '"');
 }
 
+#include <santoku/serialize/json.h>
+
+static inline int table_hashed(lua_State *L, int idx, lua_Integer maxi) {
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0) {
+    lua_pop(L, 1);
+    if (!table_inarray(L, -1, maxi)) {
+      lua_pop(L, 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static inline void serialize_indent(lua_State *L, tk_serialize_t *S, const char *nl, const char *div, int level) {
+  if (nl[0] == '\0')
+    return;
+  buf_byte(L, S, '\n');
+  for (int d = 0; d < level; d++)
+    buf_str(L, S, div);
+}
+
+// S->json switches the scalar, bracket and key emitters to JSON.
 static void serialize_value(
   lua_State *L,
-  int out_idx,
-  lua_Integer *out_n,
+  tk_serialize_t *S,
   int idx,
   int level,
   const char *nl,
   const char *div,
   const char *sep,
-  int seen_idx,
   int max_depth
 ) {
   if (idx < 0 && idx > LUA_REGISTRYINDEX)
     idx = lua_gettop(L) + idx + 1;
-  if (seen_idx < 0 && seen_idx > LUA_REGISTRYINDEX)
-    seen_idx = lua_gettop(L) + seen_idx + 1;
+  if (S->json && S->null && lua_rawequal(L, idx, S->null)) {
+    buf_str(L, S, "null");
+    return;
+  }
   int type = lua_type(L, idx);
   switch (type) {
 
     case LUA_TNIL:
-      out_push(L, out_idx, out_n, "nil");
+      buf_str(L, S, S->json ? "null" : "nil");
       break;
 
     case LUA_TBOOLEAN:
-      out_push(L, out_idx, out_n, lua_toboolean(L, idx) ? "true" : "false");
+      buf_str(L, S, lua_toboolean(L, idx) ? "true" : "false");
       break;
 
     case LUA_TNUMBER: {
       double num = lua_tonumber(L, idx);
-      if (isnan(num)) {
-        out_push(L, out_idx, out_n, "(0/0)");
+      if (S->json) {
+        char numbuf[TK_DTOA_BUFSIZE];
+        buf_write(L, S, numbuf, (size_t)json_numfmt(L, idx, numbuf));
+      } else if (isnan(num)) {
+        buf_str(L, S, "(0/0)");
       } else if (isinf(num)) {
-        out_push(L, out_idx, out_n, num > 0 ? "(1/0)" : "(-1/0)");
+        buf_str(L, S, num > 0 ? "(1/0)" : "(-1/0)");
       } else if (lua_isinteger_compat(L, idx)) {
 #if LUA_VERSION_NUM >= 503
-        lua_pushfstring(L, "%I", lua_tointeger(L, idx));
-        out_pushvalue(L, out_idx, out_n);
+        buf_str(L, S, lua_pushfstring(L, "%I", lua_tointeger(L, idx)));
+        lua_pop(L, 1);
 #else
-        char numbuf[64];
-        snprintf(numbuf, sizeof(numbuf), "%.0f", num);
-        out_push(L, out_idx, out_n, numbuf);
+        char numbuf[TK_DTOA_BUFSIZE];
+        int numlen = num == 0 ? tk_dtoa(num, numbuf) : tk_i64toa((int64_t)num, numbuf);
+        buf_write(L, S, numbuf, (size_t)numlen);
 #endif
       } else {
-        lua_pushnumber(L, num);
-        lua_tostring(L, -1);
-        out_pushvalue(L, out_idx, out_n);
+        char numbuf[TK_DTOA_BUFSIZE];
+        buf_write(L, S, numbuf, (size_t)tk_dtoa(num, numbuf));
       }
       break;
     }
@@ -149,110 +725,97 @@ static void serialize_value(
     case LUA_TSTRING: {
       size_t len;
       const char *s = lua_tolstring(L, idx, &len);
-      serialize_string(L, out_idx, out_n, s, len);
+      if (S->json)
+        json_string(L, S, s, len);
+      else
+        serialize_string(L, S, s, len);
       break;
     }
 
     case LUA_TTABLE: {
       if (level >= max_depth)
         luaL_error(L, "maximum serialization depth (%d) exceeded", max_depth);
+      luaL_checkstack(L, 4, "serialization too deep");
 
-      lua_pushvalue(L, idx);
-      lua_gettable(L, seen_idx);
-      if (!lua_isnil(L, -1)) {
-        lua_pop(L, 1);
-        out_push(L, out_idx, out_n, "nil");
+      uint64_t id;
+      if (seen_enter(L, S, idx, &id)) {
+        buf_str(L, S, S->json ? "null" : "nil");
         break;
       }
-      lua_pop(L, 1);
 
-      lua_pushvalue(L, idx);
-      lua_pushboolean(L, 1);
-      lua_settable(L, seen_idx);
-
-      out_pushchar(L, out_idx, out_n, '{');
-      int nl_len = (nl[0] == '\0') ? 0 : 1;
-
-      lua_Integer maxi = 0;
-      lua_Integer n = (lua_Integer)lua_rawlen(L, idx);
-      if (n > 100000000)
-        luaL_error(L, "array part too large: %d", (int)n);
-      for (lua_Integer i = 1; i <= n; i++) {
-        lua_rawgeti(L, idx, i);
-        if (lua_isnil(L, -1)) {
-          lua_pop(L, 1);
-          break;
-        }
-        maxi = i;
-        lua_pop(L, 1);
+      lua_Integer maxi = table_maxi(L, idx);
+      size_t kbase = S->nkeys, kn = 0, ki = 0;
+      bool array = false;
+      if (S->json) {
+        int shape = json_shape(L, idx);
+        array = shape == 1;
+        if (!array && S->canonical)
+          kn = table_keys(L, S, idx, maxi);
+        if (!shape)
+          array = maxi > 0 && (S->canonical ? kn == 0 : !table_hashed(L, idx, maxi));
+      } else if (S->canonical) {
+        kn = table_keys(L, S, idx, maxi);
       }
 
-      int has_items = 0;
+      buf_byte(L, S, array ? '[' : '{');
+      bool first = true;
       for (lua_Integer i = 1; i <= maxi; i++) {
-        if (nl_len > 0) {
-          out_pushchar(L, out_idx, out_n, '\n');
-          for (int d = 0; d <= level; d++)
-            out_push(L, out_idx, out_n, div);
+        if (!first)
+          buf_byte(L, S, ',');
+        serialize_indent(L, S, nl, div, level + 1);
+        if (S->json && !array) {
+          lua_pushinteger(L, i);
+          json_key(L, S, idx, -1, sep);
+          lua_pop(L, 1);
         }
-        int top = lua_gettop(L);
         lua_rawgeti(L, idx, i);
-        serialize_value(L, out_idx, out_n, -1, level + 1, nl, div, sep, seen_idx, max_depth);
-        lua_settop(L, top);
-        if (i < maxi)
-          out_pushchar(L, out_idx, out_n, ',');
-        has_items = 1;
+        serialize_value(L, S, -1, level + 1, nl, div, sep, max_depth);
+        lua_pop(L, 1);
+        first = false;
       }
-
-      int first_hash = (maxi == 0);
-      lua_pushnil(L);
-      while (lua_next(L, idx) != 0) {
-        int skip = 0;
-        if (lua_type(L, -2) == LUA_TNUMBER && lua_isinteger_compat(L, -2)) {
-          lua_Integer k = lua_tointeger(L, -2);
-          if (k >= 1 && k <= maxi)
-            skip = 1;
-        }
-        if (!skip) {
-          if (!first_hash && nl_len == 0)
-            out_pushchar(L, out_idx, out_n, ',');
-          if (nl_len > 0) {
-            if (!first_hash)
-              out_pushchar(L, out_idx, out_n, ',');
-            out_pushchar(L, out_idx, out_n, '\n');
-            for (int d = 0; d <= level; d++)
-              out_push(L, out_idx, out_n, div);
+      if (!array) {
+        lua_pushnil(L);
+        while (table_next(L, S, idx, kbase, kn, &ki) != 0) {
+          if (!table_inarray(L, -2, maxi)) {
+            if (!first)
+              buf_byte(L, S, ',');
+            serialize_indent(L, S, nl, div, level + 1);
+            if (S->json) {
+              json_key(L, S, idx, -2, sep);
+            } else {
+              buf_byte(L, S, '[');
+              serialize_value(L, S, -2, level + 1, nl, div, sep, max_depth);
+              buf_byte(L, S, ']');
+              buf_str(L, S, sep);
+              buf_byte(L, S, '=');
+              buf_str(L, S, sep);
+            }
+            serialize_value(L, S, -1, level + 1, nl, div, sep, max_depth);
+            first = false;
           }
-          out_pushchar(L, out_idx, out_n, '[');
-          serialize_value(L, out_idx, out_n, -2, level + 1, nl, div, sep, seen_idx, max_depth);
-          out_pushchar(L, out_idx, out_n, ']');
-          out_push(L, out_idx, out_n, sep);
-          out_pushchar(L, out_idx, out_n, '=');
-          out_push(L, out_idx, out_n, sep);
-          serialize_value(L, out_idx, out_n, -1, level + 1, nl, div, sep, seen_idx, max_depth);
-          first_hash = 0;
-          has_items = 1;
+          lua_pop(L, 1);
         }
-        lua_pop(L, 1);
-      }
-
-      if (has_items && nl_len > 0) {
-        out_pushchar(L, out_idx, out_n, '\n');
-        for (int d = 0; d < level; d++)
-          out_push(L, out_idx, out_n, div);
       }
+      S->nkeys = kbase;
+      if (!first)
+        serialize_indent(L, S, nl, div, level);
+      buf_byte(L, S, array ? ']' : '}');
 
-      out_pushchar(L, out_idx, out_n, '}');
-
-      lua_pushvalue(L, idx);
-      lua_pushnil(L);
-      lua_settable(L, seen_idx);
+      seen_leave(L, S, idx);
       break;
     }
 
+    case LUA_TLIGHTUSERDATA:
+      if (S->json && lua_touserdata(L, idx) == NULL) {
+        buf_str(L, S, "null");
+        break;
+      }
+      // fallthrough
     case LUA_TFUNCTION:
     case LUA_TUSERDATA:
-    case LUA_TLIGHTUSERDATA:
     case LUA_TTHREAD:
+      if (S->json)
+        luaL_error(L, "cannot encode %s as JSON", lua_typename(L, type));
       luaL_error(L, "cannot serialize %s", lua_typename(L, type));
       break;
 
@@ -264,25 +827,20 @@ static void serialize_value(
 
 static void serialize_table_contents(
   lua_State *L,
-  int out_idx,
-  lua_Integer *out_n,
+  tk_serialize_t *S,
   int idx,
   int level,
   const char *nl,
   const char *div,
   const char *sep,
-  int seen_idx,
   int max_depth
 ) {
   if (idx < 0 && idx > LUA_REGISTRYINDEX)
     idx = lua_gettop(L) + idx + 1;
-  if (seen_idx < 0 && seen_idx > LUA_REGISTRYINDEX)
-    seen_idx = lua_gettop(L) + seen_idx + 1;
   luaL_checktype(L, idx, LUA_TTABLE);
 
-  lua_pushvalue(L, idx);
-  lua_pushboolean(L, 1);
-  lua_settable(L, seen_idx);
+  uint64_t id;
+  seen_enter(L, S, idx, &id);
 
   int nl_len = (nl[0] == '\0') ? 0 : 1;
 
@@ -303,22 +861,25 @@ static void serialize_table_contents(
   int has_items = 0;
   for (lua_Integer i = 1; i <= maxi; i++) {
     if (nl_len > 0) {
-      out_pushchar(L, out_idx, out_n, '\n');
+      buf_byte(L, S, '\n');
       for (int d = 0; d < level; d++)
-        out_push(L, out_idx, out_n, div);
+        buf_str(L, S, div);
     }
     int top = lua_gettop(L);
     lua_rawgeti(L, idx, i);
-    serialize_value(L, out_idx, out_n, -1, level, nl, div, sep, seen_idx, max_depth);
+    serialize_value(L, S, -1, level, nl, div, sep, max_depth);
     lua_settop(L, top);
     if (i < maxi)
-      out_pushchar(L, out_idx, out_n, ',');
+      buf_byte(L, S, ',');
     has_items = 1;
   }
 
   int first_hash = (maxi == 0);
+  size_t kbase = S->nkeys, kn = 0, ki = 0;
+  if (S->canonical)
+    kn = table_keys(L, S, idx, maxi);
   lua_pushnil(L);
-  while (lua_next(L, idx) != 0) {
+  while (table_next(L, S, idx, kbase, kn, &ki) != 0) {
     int skip = 0;
     if (lua_type(L, -2) == LUA_TNUMBER && lua_isinteger_compat(L, -2)) {
       lua_Integer k = lua_tointeger(L, -2);
@@ -327,104 +888,1408 @@ static void serialize_table_contents(
     }
     if (!skip) {
       if (!first_hash && nl_len == 0)
-        out_pushchar(L, out_idx, out_n, ',');
+        buf_byte(L, S, ',');
       if (nl_len > 0) {
         if (!first_hash)
-          out_pushchar(L, out_idx, out_n, ',');
-        out_pushchar(L, out_idx, out_n, '\n');
+          buf_byte(L, S, ',');
+        buf_byte(L, S, '\n');
         for (int d = 0; d < level; d++)
-          out_push(L, out_idx, out_n, div);
+          buf_str(L, S, div);
       }
-      out_pushchar(L, out_idx, out_n, '[');
-      serialize_value(L, out_idx, out_n, -2, level, nl, div, sep, seen_idx, max_depth);
-      out_pushchar(L, out_idx, out_n, ']');
-      out_push(L, out_idx, out_n, sep);
-      out_pushchar(L, out_idx, out_n, '=');
-      out_push(L, out_idx, out_n, sep);
-      serialize_value(L, out_idx, out_n, -1, level, nl, div, sep, seen_idx, max_depth);
+      buf_byte(L, S, '[');
+      serialize_value(L, S, -2, level, nl, div, sep, max_depth);
+      buf_byte(L, S, ']');
+      buf_str(L, S, sep);
+      buf_byte(L, S, '=');
+      buf_str(L, S, sep);
+      serialize_value(L, S, -1, level, nl, div, sep, max_depth);
       first_hash = 0;
       has_items = 1;
     }
     lua_pop(L, 1);
   }
+  S->nkeys = kbase;
 
   if (has_items && nl_len > 0) {
-    out_pushchar(L, out_idx, out_n, '\n');
+    buf_byte(L, S, '\n');
     for (int d = 0; d < level - 1; d++)
-      out_push(L, out_idx, out_n, div);
+      buf_str(L, S, div);
   }
 
-  lua_pushvalue(L, idx);
-  lua_pushnil(L);
-  lua_settable(L, seen_idx);
+  seen_leave(L, S, idx);
 }
 
-static void concat_out(lua_State *L, int out_idx) {
-  lua_getglobal(L, "table");
-  lua_getfield(L, -1, "concat");
-  lua_remove(L, -2);
-  lua_pushvalue(L, out_idx);
-  lua_call(L, 1, 1);
+// opts.sink is a file handle or a function taking each chunk.
+static void serialize_sink(lua_State *L, tk_serialize_t *S, int opts, bool compressible) {
+  S->compress = compressible && tk_lua_foptboolean(L, opts, "serialize", "compress", false);
+  lua_getfield(L, opts, "sink");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  void *fh = tk_lua_testuserdata(L, -1, LUA_FILEHANDLE);
+  if (fh) {
+    S->fh = *(FILE **)fh;
+    if (!S->fh)
+      luaL_error(L, "attempt to use a closed file");
+  } else if (!lua_isfunction(L, -1)) {
+    luaL_error(L, "sink must be a file handle or function");
+  }
+  S->sink = lua_gettop(L);
+  lua_Integer chunk = tk_lua_foptinteger(L, opts, "serialize", "chunk_size", CHUNK_SIZE_DEFAULT);
+  if (chunk < 1)
+    luaL_error(L, "chunk_size must be at least 1");
+  S->chunk = (size_t)chunk;
+  S->cap = S->chunk + CHUNK_SLACK;
+  S->data = tk_malloc(L, S->cap);
 }
 
-static int santoku_serialize(lua_State *L) {
-  int minify = 0;
-  int seen_idx = 0;
-  int max_depth = MAX_DEPTH_DEFAULT;
-  if (lua_gettop(L) >= 2 && !lua_isnil(L, 2))
-    minify = lua_toboolean(L, 2);
-  if (lua_gettop(L) >= 3 && lua_istable(L, 3)) {
-    seen_idx = 3;
-  } else {
-    lua_newtable(L);
-    seen_idx = lua_gettop(L);
+// Options are the legacy minify flag or an options table.
+static tk_serialize_t *serialize_opts(lua_State *L, int *minify, int *max_depth) {
+  *minify = 0;
+  *max_depth = MAX_DEPTH_DEFAULT;
+  int opts = 0;
+  bool canonical = false;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    opts = 2;
+    *minify = tk_lua_foptboolean(L, opts, "serialize", "minify", false);
+    *max_depth = serialize_max_depth(L, tk_lua_foptinteger(L, opts, "serialize", "max_depth", MAX_DEPTH_DEFAULT));
+    canonical = tk_lua_foptboolean(L, opts, "serialize", "canonical", false);
+  } else if (!lua_isnoneornil(L, 2)) {
+    *minify = lua_toboolean(L, 2);
   }
-  if (lua_gettop(L) >= 4 && lua_isnumber(L, 4)) {
-    max_depth = lua_tointeger(L, 4);
-    if (max_depth < 1)
-      return luaL_error(L, "max_depth must be at least 1");
+  if (lua_gettop(L) >= 4 && lua_isnumber(L, 4))
+    *max_depth = serialize_max_depth(L, lua_tointeger(L, 4));
+  lua_settop(L, 3);
+  tk_serialize_t *S = tk_serialize_new(L);
+  S->canonical = canonical;
+  if (lua_istable(L, 3)) {
+    uint64_t id;
+    lua_pushnil(L);
+    while (lua_next(L, 3) != 0) {
+      if (lua_istable(L, -2))
+        seen_enter(L, S, -2, &id);
+      lua_pop(L, 1);
+    }
   }
+  if (opts)
+    serialize_sink(L, S, opts, true);
+  return S;
+}
+
+static int santoku_serialize(lua_State *L) {
+  int minify, max_depth;
+  tk_serialize_t *S = serialize_opts(L, &minify, &max_depth);
   const char *nl = minify ? "" : "\n";
   const char *div = minify ? "" : INDENT_STRING;
   const char *sep = minify ? "" : " ";
-
-  lua_newtable(L);
-  int out_idx = lua_gettop(L);
-  lua_Integer out_n = 0;
-
-  serialize_value(L, out_idx, &out_n, 1, 0, nl, div, sep, seen_idx, max_depth);
-  concat_out(L, out_idx);
+  serialize_value(L, S, 1, 0, nl, div, sep, max_depth);
+  buf_finish(L, S);
   return 1;
 }
 
 static int santoku_serialize_table_contents(lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
-  int minify = 0;
-  int seen_idx = 0;
-  int max_depth = MAX_DEPTH_DEFAULT;
-  if (lua_gettop(L) >= 2 && !lua_isnil(L, 2))
-    minify = lua_toboolean(L, 2);
-  if (lua_gettop(L) >= 3 && lua_istable(L, 3)) {
-    seen_idx = 3;
-  } else {
-    lua_newtable(L);
-    seen_idx = lua_gettop(L);
-  }
-  if (lua_gettop(L) >= 4 && lua_isnumber(L, 4)) {
-    max_depth = lua_tointeger(L, 4);
-    if (max_depth < 1)
-      return luaL_error(L, "max_depth must be at least 1");
-  }
+  int minify, max_depth;
+  tk_serialize_t *S = serialize_opts(L, &minify, &max_depth);
   const char *nl = minify ? "" : "\n";
   const char *div = minify ? "" : INDENT_STRING;
   const char *sep = minify ? "" : " ";
+  serialize_table_contents(L, S, 1, 1, nl, div, sep, max_depth);
+  buf_finish(L, S);
+  return 1;
+}
 
-  lua_newtable(L);
-  int out_idx = lua_gettop(L);
-  lua_Integer out_n = 0;
+static int santoku_serialize_json(lua_State *L) {
+  luaL_checkany(L, 1);
+  int max_depth = MAX_DEPTH_DEFAULT;
+  int opts = 0, null = 0;
+  bool pretty = false, canonical = false;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    opts = 2;
+    max_depth = serialize_max_depth(L, tk_lua_foptinteger(L, opts, "serialize_json", "max_depth", MAX_DEPTH_DEFAULT));
+    pretty = tk_lua_foptboolean(L, opts, "serialize_json", "pretty", false);
+    canonical = tk_lua_foptboolean(L, opts, "serialize_json", "canonical", false);
+  } else if (!lua_isnoneornil(L, 2)) {
+    pretty = lua_toboolean(L, 2);
+  }
+  lua_settop(L, 2);
+  if (opts) {
+    lua_getfield(L, opts, "null");
+    if (!lua_isnil(L, -1))
+      null = lua_gettop(L);
+  }
+  tk_serialize_t *S = tk_serialize_new(L);
+  S->canonical = canonical;
+  S->json = true;
+  S->null = null;
+  if (opts)
+    serialize_sink(L, S, opts, false);
+  serialize_value(L, S, 1, 0, pretty ? "\n" : "", INDENT_STRING, pretty ? " " : "", max_depth);
+  buf_finish(L, S);
+  return 1;
+}
+
+static inline uint64_t zigzag_encode(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void serialize_binary_value(
+  lua_State *L,
+  tk_serialize_t *S,
+  int idx,
+  int level,
+  int max_depth);
+
+// Integers and doubles share a column; other mixes fall back to tagged.
+static inline uint8_t column_kind(lua_State *L, uint8_t kind, bool first) {
+  uint8_t k;
+  int64_t i;
+  switch (lua_type(L, -1)) {
+    case LUA_TBOOLEAN:
+      k = COL_BOOL;
+      break;
+    case LUA_TSTRING:
+      k = COL_STRING;
+      break;
+    case LUA_TNUMBER:
+      k = binary_isint(lua_tonumber(L, -1), &i) ? COL_INT : COL_DOUBLE;
+      break;
+    default:
+      k = COL_ANY;
+      break;
+  }
+  if (first || k == kind)
+    return k;
+  if ((k == COL_INT && kind == COL_DOUBLE) || (k == COL_DOUBLE && kind == COL_INT))
+    return COL_DOUBLE;
+  return COL_ANY;
+}
+
+// Returns the column count, leaving keys and kinds on the stack, or 0.
+static size_t columns_shape(lua_State *L, tk_serialize_t *S, int idx, lua_Integer maxi) {
+  int top = lua_gettop(L);
+  lua_rawgeti(L, idx, 1);
+  if (!lua_istable(L, -1)) {
+    lua_settop(L, top);
+    return 0;
+  }
+  lua_pushnil(L);
+  while (lua_next(L, top + 1) != 0) {
+    int t = lua_type(L, -2);
+    lua_pop(L, 1);
+    if (t != LUA_TBOOLEAN && t != LUA_TNUMBER && t != LUA_TSTRING) {
+      lua_settop(L, top);
+      return 0;
+    }
+  }
+  size_t base = S->nkeys;
+  size_t ncols = table_keys(L, S, top + 1, 0);
+  lua_settop(L, top);
+  if (!ncols) {
+    S->nkeys = base;
+    return 0;
+  }
+  lua_createtable(L, (int)tk_min(ncols, INT_MAX), 0);
+  int keys = lua_gettop(L);
+  for (size_t j = 0; j < ncols; j++) {
+    table_pushkey(L, &S->keys[base + j]);
+    lua_rawseti(L, keys, (int)j + 1);
+  }
+  S->nkeys = base;
+  uint8_t *kinds = (uint8_t *)lua_newuserdata(L, ncols);
+  for (lua_Integer r = 1; r <= maxi; r++) {
+    lua_rawgeti(L, idx, r);
+    int row = lua_gettop(L);
+    if (!lua_istable(L, row) ||
+        kh_get(tk_serialize_seen, &S->seen, (uint64_t)(uintptr_t)lua_topointer(L, row)) != kh_end(&S->seen)) {
+      lua_settop(L, top);
+      return 0;
+    }
+    size_t n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, row) != 0) {
+      lua_pop(L, 1);
+      n++;
+    }
+    if (n != ncols) {
+      lua_settop(L, top);
+      return 0;
+    }
+    for (size_t j = 0; j < ncols; j++) {
+      lua_rawgeti(L, keys, (int)j + 1);
+      lua_rawget(L, row);
+      if (lua_isnil(L, -1)) {
+        lua_settop(L, top);
+        return 0;
+      }
+      kinds[j] = column_kind(L, kinds[j], r == 1);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  return ncols;
+}
+
+// Returns false, writing nothing, unless the array holds flat records.
+static bool serialize_columns(
+  lua_State *L,
+  tk_serialize_t *S,
+  int idx,
+  lua_Integer maxi,
+  int level,
+  int max_depth
+) {
+  if (maxi < COLUMNS_MIN_ROWS || level + 1 >= max_depth)
+    return false;
+  luaL_checkstack(L, 8, "serialization too deep");
+  int top = lua_gettop(L);
+  size_t ncols = columns_shape(L, S, idx, maxi);
+  if (!ncols)
+    return false;
+  int keys = top + 1;
+  uint8_t *kinds = (uint8_t *)lua_touserdata(L, top + 2);
+  buf_byte(L, S, TAG_COLUMNS);
+  buf_varint(L, S, (uint64_t)maxi);
+  buf_varint(L, S, ncols);
+  for (size_t j = 0; j < ncols; j++) {
+    lua_rawgeti(L, keys, (int)j + 1);
+    int key = lua_gettop(L);
+    serialize_binary_value(L, S, key, level + 1, max_depth);
+    buf_byte(L, S, kinds[j]);
+    uint64_t ndict = 0;
+    if (kinds[j] == COL_STRING)
+      kh_clear(tk_serialize_seen, &S->coldict);
+    uint8_t bits = 0;
+    for (lua_Integer r = 1; r <= maxi; r++) {
+      lua_rawgeti(L, idx, r);
+      lua_pushvalue(L, key);
+      lua_rawget(L, -2);
+      switch (kinds[j]) {
+        case COL_INT: {
+          int64_t i = 0;
+          binary_isint(lua_tonumber(L, -1), &i);
+          buf_varint(L, S, zigzag_encode(i));
+          break;
+        }
+        case COL_DOUBLE:
+          buf_double(L, S, lua_tonumber(L, -1));
+          break;
+        case COL_BOOL:
+          if (lua_toboolean(L, -1))
+            bits |= (uint8_t)(1 << ((r - 1) & 7));
+          if (((r - 1) & 7) == 7 || r == maxi) {
+            buf_byte(L, S, bits);
+            bits = 0;
+          }
+          break;
+        case COL_STRING: {
+          size_t len;
+          const char *str = lua_tolstring(L, -1, &len);
+          int absent;
+          khint_t k = kh_put(tk_serialize_seen, &S->coldict, (uint64_t)(uintptr_t)str, &absent);
+          if (absent < 0)
+            tk_lua_errmalloc(L);
+          if (absent) {
+            kh_value(&S->coldict, k) = ++ndict;
+            buf_varint(L, S, 0);
+            buf_varint(L, S, len);
+            buf_write(L, S, str, len);
+          } else {
+            buf_varint(L, S, kh_value(&S->coldict, k));
+          }
+          break;
+        }
+        default:
+          serialize_binary_value(L, S, -1, level + 2, max_depth);
+          break;
+      }
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, top);
+  return true;
+}
+
+static inline void offs_push(lua_State *L, tk_serialize_t *S, uint64_t off) {
+  if (S->noffs == S->offs_cap) {
+    S->offs_cap = S->offs_cap ? S->offs_cap * 2 : 64;
+    S->offs = tk_realloc(L, S->offs, S->offs_cap * sizeof(uint64_t));
+  }
+  S->offs[S->noffs++] = off;
+}
+
+static inline void buf_le(lua_State *L, tk_serialize_t *S, uint64_t v, uint8_t width) {
+  buf_reserve(L, S, width);
+  for (uint8_t i = 0; i < width; i++)
+    S->data[S->len++] = (char)(v >> (8 * i));
+}
+
+// The index offset is patched in afterwards, so the output must stay buffered.
+static void serialize_indexed(
+  lua_State *L,
+  tk_serialize_t *S,
+  int idx,
+  lua_Integer maxi,
+  int level,
+  int max_depth
+) {
+  size_t kbase = S->nkeys, ki = 0;
+  size_t kn = table_keys(L, S, idx, maxi);
+  size_t obase = S->noffs;
+  size_t tag = S->len;
+  buf_byte(L, S, TAG_ITABLE);
+  buf_le(L, S, 0, 8);
+
+  for (lua_Integer i = 1; i <= maxi; i++) {
+    offs_push(L, S, S->len - tag);
+    lua_rawgeti(L, idx, i);
+    serialize_binary_value(L, S, -1, level + 1, max_depth);
+    lua_pop(L, 1);
+  }
+
+  lua_pushnil(L);
+  while (table_next(L, S, idx, kbase, kn, &ki) != 0) {
+    offs_push(L, S, S->len - tag);
+    serialize_binary_value(L, S, -2, level + 1, max_depth);
+    serialize_binary_value(L, S, -1, level + 1, max_depth);
+    lua_pop(L, 1);
+  }
+  S->nkeys = kbase;
+
+  uint64_t ioff = S->len - tag;
+  for (int i = 0; i < 8; i++)
+    S->data[tag + 1 + (size_t)i] = (char)(ioff >> (8 * i));
+  uint8_t width = ioff <= UINT32_MAX ? 4 : 8;
+  buf_varint(L, S, (uint64_t)maxi);
+  buf_varint(L, S, kn);
+  buf_byte(L, S, width);
+  for (size_t i = obase; i < S->noffs; i++)
+    buf_le(L, S, S->offs[i], width);
+  S->noffs = obase;
+}
+
+static void serialize_binary_value(
+  lua_State *L,
+  tk_serialize_t *S,
+  int idx,
+  int level,
+  int max_depth
+) {
+  idx = tk_lua_absindex(L, idx);
+  int type = lua_type(L, idx);
+  switch (type) {
+
+    case LUA_TNIL:
+      buf_byte(L, S, TAG_NIL);
+      break;
+
+    case LUA_TBOOLEAN:
+      buf_byte(L, S, lua_toboolean(L, idx) ? TAG_TRUE : TAG_FALSE);
+      break;
+
+    case LUA_TNUMBER: {
+      double num = lua_tonumber(L, idx);
+      int64_t i;
+      if (binary_isint(num, &i)) {
+        buf_byte(L, S, TAG_INT);
+        buf_varint(L, S, zigzag_encode(i));
+      } else {
+        buf_byte(L, S, TAG_DOUBLE);
+        buf_double(L, S, num);
+      }
+      break;
+    }
+
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      if (S->intern) {
+        // Lua interns short strings, so equal strings share an address and
+        // the pointer identifies the dictionary entry. Every string written
+        // in full becomes the next entry on both sides.
+        int absent;
+        khint_t k = kh_put(tk_serialize_seen, &S->strs, (uint64_t)(uintptr_t)s, &absent);
+        if (absent < 0)
+          tk_lua_errmalloc(L);
+        if (!absent) {
+          buf_byte(L, S, TAG_STRREF);
+          buf_varint(L, S, kh_value(&S->strs, k));
+          break;
+        }
+        kh_value(&S->strs, k) = ++S->next_str;
+      }
+      buf_byte(L, S, TAG_STRING);
+      buf_varint(L, S, len);
+      buf_write(L, S, s, len);
+      break;
+    }
+
+    case LUA_TTABLE: {
+      if (level >= max_depth)
+        luaL_error(L, "maximum serialization depth (%d) exceeded", max_depth);
+      luaL_checkstack(L, 4, "serialization too deep");
+
+      uint64_t id;
+      if (seen_enter(L, S, idx, &id)) {
+        if (S->refs) {
+          buf_byte(L, S, TAG_REF);
+          buf_varint(L, S, id);
+        } else {
+          buf_byte(L, S, TAG_NIL);
+        }
+        break;
+      }
+
+      lua_Integer maxi = table_maxi(L, idx);
+      if (S->indexed) {
+        serialize_indexed(L, S, idx, maxi, level, max_depth);
+        seen_leave(L, S, idx);
+        break;
+      }
+
+      size_t kbase = S->nkeys, kn = 0, ki = 0;
+      uint64_t nhash = 0;
+      if (S->canonical) {
+        kn = table_keys(L, S, idx, maxi);
+        nhash = kn;
+      } else {
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+          if (!table_inarray(L, -2, maxi))
+            nhash++;
+          lua_pop(L, 1);
+        }
+      }
+
+      if (S->columnar && !S->refs && nhash == 0 && serialize_columns(L, S, idx, maxi, level, max_depth)) {
+        seen_leave(L, S, idx);
+        break;
+      }
+
+      buf_byte(L, S, TAG_TABLE);
+      buf_varint(L, S, (uint64_t)maxi);
+      buf_varint(L, S, nhash);
+
+      for (lua_Integer i = 1; i <= maxi; i++) {
+        lua_rawgeti(L, idx, i);
+        serialize_binary_value(L, S, -1, level + 1, max_depth);
+        lua_pop(L, 1);
+      }
+
+      lua_pushnil(L);
+      while (table_next(L, S, idx, kbase, kn, &ki) != 0) {
+        if (!table_inarray(L, -2, maxi)) {
+          serialize_binary_value(L, S, -2, level + 1, max_depth);
+          serialize_binary_value(L, S, -1, level + 1, max_depth);
+        }
+        lua_pop(L, 1);
+      }
+      S->nkeys = kbase;
+
+      seen_leave(L, S, idx);
+      break;
+    }
+
+    case LUA_TFUNCTION:
+    case LUA_TUSERDATA:
+    case LUA_TLIGHTUSERDATA:
+    case LUA_TTHREAD:
+      luaL_error(L, "cannot serialize %s", lua_typename(L, type));
+      break;
+
+    default:
+      luaL_error(L, "unknown type: %s", lua_typename(L, type));
+      break;
+  }
+}
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  int max_depth;
+  int refs;
+  uint64_t nrefs;
+  int strs;
+  uint64_t nstrs;
+  int columns;
+  uint64_t ncolumns;
+  bool as_columns;
+} tk_deserialize_t;
+
+static inline uint8_t read_byte(lua_State *L, tk_deserialize_t *D) {
+  if (D->p >= D->end)
+    luaL_error(L, "invalid binary serialization: unexpected end of data");
+  return *D->p++;
+}
+
+static inline uint64_t read_varint(lua_State *L, tk_deserialize_t *D) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t b = read_byte(L, D);
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      return v;
+  }
+  luaL_error(L, "invalid binary serialization: malformed varint");
+  return 0;
+}
+
+static inline double read_double(lua_State *L, tk_deserialize_t *D) {
+  if (D->end - D->p < 8)
+    luaL_error(L, "invalid binary serialization: unexpected end of data");
+  uint64_t bits = 0;
+  for (int i = 0; i < 8; i++)
+    bits |= (uint64_t)D->p[i] << (8 * i);
+  D->p += 8;
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+static inline bool lz_getvarint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*p >= end)
+      return false;
+    uint8_t b = *(*p)++;
+    *v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// Returns the raw size; decompresses into out when given.
+static size_t lz_blocks(lua_State *L, const char *s, size_t len, char *out) {
+  const uint8_t *p = (const uint8_t *)s + TK_LZ_FRAME_MAGIC_LEN + 1;
+  const uint8_t *end = (const uint8_t *)s + len;
+  size_t total = 0;
+  for (;;) {
+    uint64_t raw, c;
+    if (!lz_getvarint(&p, end, &raw))
+      luaL_error(L, "invalid compressed data: unexpected end of data");
+    if (!raw)
+      break;
+    if (!lz_getvarint(&p, end, &c))
+      luaL_error(L, "invalid compressed data: unexpected end of data");
+    uint64_t clen = c >> 1;
+    bool stored = c & 1;
+    // A block can't expand by more than the format allows, which bounds the
+    // allocation a corrupt frame can ask for.
+    if (clen > (uint64_t)(end - p) || (stored ? raw != clen : raw > clen * 255 + 16) || raw > SIZE_MAX - total)
+      luaL_error(L, "invalid compressed data: bad block");
+    if (out) {
+      if (stored)
+        memcpy(out + total, p, (size_t)clen);
+      else if (tk_lz_decompress(p, (size_t)clen, (uint8_t *)out + total, (size_t)raw) != 0)
+        luaL_error(L, "invalid compressed data: bad block");
+    }
+    total += (size_t)raw;
+    p += clen;
+  }
+  if (p != end)
+    luaL_error(L, "invalid compressed data: trailing data");
+  return total;
+}
+
+static inline bool lz_isframe(const char *s, size_t len) {
+  return len > TK_LZ_FRAME_MAGIC_LEN && memcmp(s, TK_LZ_FRAME_MAGIC, TK_LZ_FRAME_MAGIC_LEN) == 0;
+}
+
+static void lz_decode(lua_State *L, const char *s, size_t len) {
+  if (!lz_isframe(s, len))
+    luaL_error(L, "invalid compressed data: bad header");
+  if ((uint8_t)s[TK_LZ_FRAME_MAGIC_LEN] != TK_LZ_FRAME_VERSION)
+    luaL_error(L, "unsupported compressed data version: %d", (int)(uint8_t)s[TK_LZ_FRAME_MAGIC_LEN]);
+  size_t total = lz_blocks(L, s, len, NULL);
+  char *out = (char *)lua_newuserdata(L, total ? total : 1);
+  lz_blocks(L, s, len, out);
+  lua_pushlstring(L, out, total);
+  lua_remove(L, -2);
+}
+
+static const char *lz_checkinput(lua_State *L, int idx, size_t *len) {
+  const char *s = luaL_checklstring(L, idx, len);
+  if (!lz_isframe(s, *len))
+    return s;
+  lz_decode(L, s, *len);
+  lua_replace(L, idx);
+  return lua_tolstring(L, idx, len);
+}
+
+static int santoku_serialize_compress(lua_State *L) {
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  tk_serialize_t *S = tk_serialize_new(L);
+  lz_push(L, S, s, len);
+  return 1;
+}
+
+static int santoku_serialize_decompress(lua_State *L) {
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  lz_decode(L, s, len);
+  return 1;
+}
+
+static inline size_t read_length(lua_State *L, tk_deserialize_t *D) {
+  uint64_t len = read_varint(L, D);
+  if (len > (uint64_t)(D->end - D->p))
+    luaL_error(L, "invalid binary serialization: length exceeds data");
+  return (size_t)len;
+}
+
+static void deserialize_binary_value(lua_State *L, tk_deserialize_t *D, int level);
+
+static void deserialize_table(lua_State *L, tk_deserialize_t *D, int level, uint64_t narr, uint64_t nhash) {
+  if (level >= D->max_depth)
+    luaL_error(L, "maximum deserialization depth (%d) exceeded", D->max_depth);
+  luaL_checkstack(L, 4, "deserialization too deep");
+  // Every entry takes at least one byte, which bounds the presize hints
+  // against corrupt counts.
+  uint64_t avail = (uint64_t)(D->end - D->p);
+  if (narr > avail || nhash > avail)
+    luaL_error(L, "invalid binary serialization: length exceeds data");
+  lua_createtable(L, (int)tk_min(narr, INT_MAX), (int)tk_min(nhash, INT_MAX));
+  int t = lua_gettop(L);
+  if (D->refs) {
+    lua_pushvalue(L, t);
+    lua_rawseti(L, D->refs, (int)++D->nrefs);
+  }
+  for (uint64_t i = 1; i <= narr; i++) {
+    deserialize_binary_value(L, D, level + 1);
+    lua_rawseti(L, t, (int)i);
+  }
+  for (uint64_t i = 0; i < nhash; i++) {
+    deserialize_binary_value(L, D, level + 1);
+    deserialize_binary_value(L, D, level + 1);
+    if (lua_isnil(L, -2) || (lua_type(L, -2) == LUA_TNUMBER && isnan(lua_tonumber(L, -2))))
+      lua_pop(L, 2);
+    else
+      lua_rawset(L, t);
+  }
+}
+
+// Leaves D at the first value after the tag.
+static void read_index(
+  lua_State *L,
+  tk_deserialize_t *D,
+  const uint8_t *tag,
+  uint64_t *narr,
+  uint64_t *nhash,
+  const uint8_t **index,
+  const uint8_t **index_end,
+  const uint8_t **entries
+) {
+  if (D->end - D->p < 8)
+    luaL_error(L, "invalid binary serialization: unexpected end of data");
+  uint64_t off = 0;
+  for (int i = 0; i < 8; i++)
+    off |= (uint64_t)D->p[i] << (8 * i);
+  D->p += 8;
+  if (off < 9 || off > (uint64_t)(D->end - tag))
+    luaL_error(L, "invalid binary serialization: bad table index");
+  tk_deserialize_t I = *D;
+  I.p = tag + off;
+  *narr = read_varint(L, &I);
+  *nhash = read_varint(L, &I);
+  uint8_t width = read_byte(L, &I);
+  uint64_t avail = (uint64_t)(I.end - I.p);
+  if ((width != 4 && width != 8) || *narr > avail / width || *nhash > avail / width - *narr)
+    luaL_error(L, "invalid binary serialization: bad table index");
+  *index = tag + off;
+  if (entries)
+    *entries = I.p;
+  *index_end = I.p + (*narr + *nhash) * width;
+}
+
+// Tagged values are decoded even when skipped to keep references in step.
+static void read_column_value(
+  lua_State *L,
+  tk_deserialize_t *D,
+  uint8_t kind,
+  uint64_t r,
+  uint8_t *bits,
+  int dict,
+  uint64_t *ndict,
+  int level,
+  bool push
+) {
+  switch (kind) {
+    case COL_INT: {
+      uint64_t v = read_varint(L, D);
+      if (push)
+        push_int64(L, zigzag_decode(v));
+      break;
+    }
+    case COL_DOUBLE: {
+      double d = read_double(L, D);
+      int64_t i;
+      if (!push)
+        break;
+      if (binary_isint(d, &i))
+        push_int64(L, i);
+      else
+        lua_pushnumber(L, d);
+      break;
+    }
+    case COL_BOOL:
+      if (((r - 1) & 7) == 0)
+        *bits = read_byte(L, D);
+      if (push)
+        lua_pushboolean(L, (*bits >> ((r - 1) & 7)) & 1);
+      break;
+    case COL_STRING: {
+      uint64_t id = read_varint(L, D);
+      if (id == 0) {
+        size_t len = read_length(L, D);
+        if (push) {
+          lua_pushlstring(L, (const char *)D->p, len);
+          lua_pushvalue(L, -1);
+          lua_rawseti(L, dict, (int)++*ndict);
+        } else {
+          ++*ndict;
+        }
+        D->p += len;
+      } else if (id > *ndict) {
+        luaL_error(L, "invalid binary serialization: bad string reference");
+      } else if (push) {
+        lua_rawgeti(L, dict, (int)id);
+      }
+      break;
+    }
+    default:
+      deserialize_binary_value(L, D, level);
+      if (!push)
+        lua_pop(L, 1);
+      break;
+  }
+}
+
+static void deserialize_columns(lua_State *L, tk_deserialize_t *D, int level) {
+  if (level + 1 >= D->max_depth)
+    luaL_error(L, "maximum deserialization depth (%d) exceeded", D->max_depth);
+  luaL_checkstack(L, 8, "deserialization too deep");
+  // A column costs at least one bit per row, which bounds the presize hints
+  // against corrupt counts.
+  uint64_t nrows = read_varint(L, D);
+  uint64_t ncols = read_varint(L, D);
+  uint64_t avail = (uint64_t)(D->end - D->p);
+  if (nrows > avail * 8 || ncols > avail || (nrows && ncols > avail * 8 / nrows))
+    luaL_error(L, "invalid binary serialization: length exceeds data");
+  int t;
+  if (D->as_columns) {
+    lua_createtable(L, 0, (int)tk_min(ncols, INT_MAX));
+    t = lua_gettop(L);
+  } else {
+    lua_createtable(L, (int)tk_min(nrows, INT_MAX), 0);
+    t = lua_gettop(L);
+    uint64_t nfields = D->columns ? tk_min(ncols, D->ncolumns) : ncols;
+    for (uint64_t r = 1; r <= nrows; r++) {
+      lua_createtable(L, 0, (int)tk_min(nfields, INT_MAX));
+      lua_rawseti(L, t, (int)r);
+    }
+  }
+  for (uint64_t c = 0; c < ncols; c++) {
+    deserialize_binary_value(L, D, level + 1);
+    int key = lua_gettop(L);
+    if (lua_isnil(L, key) || (lua_type(L, key) == LUA_TNUMBER && isnan(lua_tonumber(L, key))))
+      luaL_error(L, "invalid binary serialization: bad column key");
+    uint8_t kind = read_byte(L, D);
+    if (kind > COL_STRING)
+      luaL_error(L, "invalid binary serialization: unknown column kind %d", (int)kind);
+    bool keep = true;
+    if (D->columns) {
+      lua_pushvalue(L, key);
+      lua_rawget(L, D->columns);
+      keep = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+    lua_newtable(L);
+    int dict = lua_gettop(L);
+    if (keep && D->as_columns)
+      lua_createtable(L, (int)tk_min(nrows, INT_MAX), 0);
+    int col = lua_gettop(L);
+    uint64_t ndict = 0;
+    uint8_t bits = 0;
+    for (uint64_t r = 1; r <= nrows; r++) {
+      if (!keep) {
+        read_column_value(L, D, kind, r, &bits, dict, &ndict, level + 2, false);
+      } else if (D->as_columns) {
+        read_column_value(L, D, kind, r, &bits, dict, &ndict, level + 2, true);
+        lua_rawseti(L, col, (int)r);
+      } else {
+        lua_rawgeti(L, t, (int)r);
+        lua_pushvalue(L, key);
+        read_column_value(L, D, kind, r, &bits, dict, &ndict, level + 2, true);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+      }
+    }
+    if (keep && D->as_columns) {
+      lua_pushvalue(L, key);
+      lua_pushvalue(L, col);
+      lua_rawset(L, t);
+    }
+    lua_settop(L, t);
+  }
+}
+
+static void deserialize_binary_value(lua_State *L, tk_deserialize_t *D, int level) {
+  uint8_t tag = read_byte(L, D);
+  switch (tag) {
+
+    case TAG_NIL:
+      lua_pushnil(L);
+      break;
+
+    case TAG_FALSE:
+      lua_pushboolean(L, 0);
+      break;
+
+    case TAG_TRUE:
+      lua_pushboolean(L, 1);
+      break;
+
+    case TAG_INT: {
+      int64_t i = zigzag_decode(read_varint(L, D));
+#if LUA_VERSION_NUM >= 503
+      lua_pushinteger(L, (lua_Integer)i);
+#else
+      lua_pushnumber(L, (lua_Number)i);
+#endif
+      break;
+    }
+
+    case TAG_DOUBLE:
+      lua_pushnumber(L, read_double(L, D));
+      break;
+
+    case TAG_STRING: {
+      size_t len = read_length(L, D);
+      lua_pushlstring(L, (const char *)D->p, len);
+      D->p += len;
+      if (D->strs) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, D->strs, (int)++D->nstrs);
+      }
+      break;
+    }
+
+    case TAG_COLUMNS:
+      deserialize_columns(L, D, level);
+      break;
+
+    case TAG_STRREF: {
+      uint64_t id = read_varint(L, D);
+      if (!D->strs || id < 1 || id > D->nstrs)
+        luaL_error(L, "invalid binary serialization: bad string reference");
+      lua_rawgeti(L, D->strs, (int)id);
+      break;
+    }
+
+    case TAG_TABLE: {
+      uint64_t narr = read_varint(L, D);
+      uint64_t nhash = read_varint(L, D);
+      deserialize_table(L, D, level, narr, nhash);
+      break;
+    }
+
+    case TAG_ITABLE: {
+      // Values are read in order as for a plain table; the trailing index is
+      // only checked for its counts and skipped.
+      const uint8_t *itag = D->p - 1;
+      uint64_t narr, nhash;
+      const uint8_t *index, *index_end;
+      read_index(L, D, itag, &narr, &nhash, &index, &index_end, NULL);
+      deserialize_table(L, D, level, narr, nhash);
+      if (D->p != index)
+        luaL_error(L, "invalid binary serialization: bad table index");
+      D->p = index_end;
+      break;
+    }
+
+    case TAG_REF: {
+      uint64_t id = read_varint(L, D);
+      if (!D->refs || id < 1 || id > D->nrefs)
+        luaL_error(L, "invalid binary serialization: bad reference");
+      lua_rawgeti(L, D->refs, (int)id);
+      break;
+    }
+
+    default:
+      luaL_error(L, "invalid binary serialization: unknown tag %d", (int)tag);
+      break;
+  }
+}
+
+static int santoku_serialize_binary(lua_State *L) {
+  luaL_checkany(L, 1);
+  int max_depth = MAX_DEPTH_DEFAULT;
+  int opts = 0;
+  bool refs = false, canonical = false, intern = false, columnar = false, indexed = false;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    opts = 2;
+    max_depth = serialize_max_depth(L, tk_lua_foptinteger(L, opts, "serialize", "max_depth", MAX_DEPTH_DEFAULT));
+    refs = tk_lua_foptboolean(L, opts, "serialize", "refs", false);
+    canonical = tk_lua_foptboolean(L, opts, "serialize", "canonical", false);
+    intern = tk_lua_foptboolean(L, opts, "serialize", "intern", false);
+    columnar = tk_lua_foptboolean(L, opts, "serialize", "columnar", false);
+    indexed = tk_lua_foptboolean(L, opts, "serialize", "indexed", false);
+    if (indexed && (refs || intern || columnar))
+      luaL_error(L, "indexed cannot be combined with refs, intern or columnar");
+  } else if (lua_isnumber(L, 2)) {
+    max_depth = serialize_max_depth(L, lua_tointeger(L, 2));
+  }
+  lua_settop(L, 2);
+  tk_serialize_t *S = tk_serialize_new(L);
+  S->refs = refs;
+  S->canonical = canonical || indexed;
+  S->intern = intern;
+  S->columnar = columnar;
+  S->indexed = indexed;
+  if (opts)
+    serialize_sink(L, S, opts, true);
+  if (indexed && S->sink)
+    luaL_error(L, "indexed cannot be combined with sink");
+  buf_write(L, S, TK_SERIALIZE_MAGIC, TK_SERIALIZE_MAGIC_LEN);
+  buf_byte(L, S, TK_SERIALIZE_VERSION);
+  if (refs)
+    buf_byte(L, S, TAG_REFS);
+  if (intern)
+    buf_byte(L, S, TAG_STRINGS);
+  serialize_binary_value(L, S, 1, 0, max_depth);
+  buf_finish(L, S);
+  return 1;
+}
+
+static int santoku_digest(lua_State *L) {
+  luaL_checkany(L, 1);
+  int max_depth = MAX_DEPTH_DEFAULT;
+  lua_Integer bits = 128;
+  bool refs = false;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    max_depth = serialize_max_depth(L, tk_lua_foptinteger(L, 2, "digest", "max_depth", MAX_DEPTH_DEFAULT));
+    refs = tk_lua_foptboolean(L, 2, "digest", "refs", false);
+    bits = tk_lua_foptinteger(L, 2, "digest", "bits", 128);
+  } else if (lua_isnumber(L, 2)) {
+    bits = lua_tointeger(L, 2);
+  }
+  if (bits != 64 && bits != 128)
+    luaL_error(L, "digest bits must be 64 or 128");
+  lua_settop(L, 2);
+  tk_serialize_t *S = tk_serialize_new(L);
+  S->refs = refs;
+  S->canonical = true;
+  S->digest = true;
+  S->digest_lo = DIGEST_SEED_LO;
+  S->digest_hi = DIGEST_SEED_HI;
+  S->sink = lua_gettop(L);
+  S->chunk = CHUNK_SIZE_DEFAULT;
+  S->cap = S->chunk + CHUNK_SLACK;
+  S->data = tk_malloc(L, S->cap);
+  buf_write(L, S, TK_SERIALIZE_MAGIC, TK_SERIALIZE_MAGIC_LEN);
+  buf_byte(L, S, TK_SERIALIZE_VERSION);
+  if (refs)
+    buf_byte(L, S, TAG_REFS);
+  serialize_binary_value(L, S, 1, 0, max_depth);
+  buf_flush(L, S);
+  buf_emit(L, S, S->data, S->len);
+  uint64_t lo = tk_hash_128(S->total, S->digest_lo);
+  uint64_t hi = tk_hash_128(lo, S->digest_hi);
+  char hex[33];
+  if (bits == 64)
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)lo);
+  else
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)hi, (unsigned long long)lo);
+  lua_pushstring(L, hex);
+  return 1;
+}
+
+static int santoku_deserialize_binary(lua_State *L) {
+  size_t len;
+  const char *data = lz_checkinput(L, 1, &len);
+  tk_deserialize_t D;
+  D.p = (const uint8_t *)data;
+  D.end = D.p + len;
+  D.max_depth = MAX_DEPTH_DEFAULT;
+  D.columns = 0;
+  D.ncolumns = 0;
+  D.as_columns = false;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    lua_settop(L, 2);
+    D.max_depth = serialize_max_depth(L, tk_lua_foptinteger(L, 2, "deserialize", "max_depth", MAX_DEPTH_DEFAULT));
+    lua_getfield(L, 2, "layout");
+    if (!lua_isnil(L, -1)) {
+      if (tk_lua_streq(L, -1, "columns"))
+        D.as_columns = true;
+      else if (!tk_lua_streq(L, -1, "rows"))
+        luaL_error(L, "layout must be \"rows\" or \"columns\"");
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "columns");
+    if (lua_istable(L, -1)) {
+      lua_newtable(L);
+      for (int i = 1; ; i++) {
+        lua_rawgeti(L, -2, i);
+        if (lua_isnil(L, -1)) {
+          lua_pop(L, 1);
+          break;
+        }
+        lua_pushboolean(L, 1);
+        lua_rawset(L, -3);
+        D.ncolumns++;
+      }
+      lua_replace(L, 3);
+      D.columns = 3;
+    } else if (!lua_isnil(L, -1)) {
+      luaL_error(L, "columns must be a table");
+    }
+  } else if (lua_gettop(L) >= 2 && lua_isnumber(L, 2)) {
+    D.max_depth = serialize_max_depth(L, lua_tointeger(L, 2));
+  }
+  if (len < TK_SERIALIZE_MAGIC_LEN + 1 || memcmp(data, TK_SERIALIZE_MAGIC, TK_SERIALIZE_MAGIC_LEN) != 0)
+    return luaL_error(L, "invalid binary serialization: bad header");
+  D.p += TK_SERIALIZE_MAGIC_LEN;
+  uint8_t version = read_byte(L, &D);
+  if (version != TK_SERIALIZE_VERSION)
+    return luaL_error(L, "unsupported binary serialization version: %d", (int)version);
+  lua_settop(L, D.columns ? D.columns : 1);
+  D.refs = 0;
+  D.nrefs = 0;
+  D.strs = 0;
+  D.nstrs = 0;
+  if (D.p < D.end && *D.p == TAG_REFS) {
+    D.p++;
+    lua_newtable(L);
+    D.refs = lua_gettop(L);
+  }
+  if (D.p < D.end && *D.p == TAG_STRINGS) {
+    D.p++;
+    lua_newtable(L);
+    D.strs = lua_gettop(L);
+  }
+  deserialize_binary_value(L, &D, 0);
+  if (D.p != D.end)
+    return luaL_error(L, "invalid binary serialization: trailing data");
+  return 1;
+}
+
+#include <santoku/serialize/view.h>
+#include <santoku/serialize/diff.h>
+
+typedef struct {
+  const char *s;
+  const char *p;
+  const char *end;
+  const uint32_t *counts;
+  size_t ncounts;
+  size_t next;
+  int max_depth;
+} tk_parse_t;
+
+static inline int parse_isident(int c) {
+  return isalnum(c) || c == '_';
+}
+
+static inline int parse_isspace(int c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static int parse_error(lua_State *L, tk_parse_t *P, const char *msg) {
+  return luaL_error(L, "invalid serialized data at position %d: %s", (int)(P->p - P->s + 1), msg);
+}
+
+static const char *parse_skipstring(const char *p, const char *end) {
+  char q = *p++;
+  while (p < end && *p != q) {
+    if (*p == '\\')
+      p++;
+    p++;
+  }
+  return p < end ? p + 1 : end;
+}
+
+static int parse_iskeyed(const char *p, const char *end) {
+  if (*p == '[')
+    return 1;
+  if (!isalpha((unsigned char)*p) && *p != '_')
+    return 0;
+  while (p < end && parse_isident((unsigned char)*p))
+    p++;
+  while (p < end && parse_isspace((unsigned char)*p))
+    p++;
+  return p + 1 < end && p[0] == '=' && p[1] != '=';
+}
+
+// Counts are presize hints only; the parser rejects malformed input.
+static void parse_prescan(lua_State *L, tk_serialize_t *S, tk_parse_t *P) {
+  size_t *stack = lua_newuserdata(L, sizeof(size_t) * ((size_t)P->max_depth + 1));
+  int depth = 0;
+  int expect = 0;
+  const char *p = P->s;
+  const char *end = P->end;
+  while (p < end) {
+    char c = *p;
+    if (c == '"' || c == '\'') {
+      if (expect) {
+        uint32_t *n = (uint32_t *)(void *)(S->data + stack[depth]);
+        n[0]++;
+        expect = 0;
+      }
+      p = parse_skipstring(p, end);
+      continue;
+    }
+    if (expect && !parse_isspace((unsigned char)c) && c != '}') {
+      uint32_t *n = (uint32_t *)(void *)(S->data + stack[depth]);
+      n[parse_iskeyed(p, end)]++;
+      expect = 0;
+    }
+    switch (c) {
+      case '{':
+        if (depth >= P->max_depth)
+          goto done;
+        stack[++depth] = S->len;
+        buf_reserve(L, S, 2 * sizeof(uint32_t));
+        memset(S->data + S->len, 0, 2 * sizeof(uint32_t));
+        S->len += 2 * sizeof(uint32_t);
+        expect = 1;
+        break;
+      case '}':
+        if (depth > 0)
+          depth--;
+        expect = 0;
+        break;
+      case ',':
+      case ';':
+        expect = depth > 0;
+        break;
+    }
+    p++;
+  }
+done:
+  lua_pop(L, 1);
+  P->counts = (const uint32_t *)(void *)S->data;
+  P->ncounts = S->len / (2 * sizeof(uint32_t));
+  P->next = 0;
+}
+
+static inline void parse_skipws(tk_parse_t *P) {
+  while (P->p < P->end && parse_isspace((unsigned char)*P->p))
+    P->p++;
+}
+
+static inline void parse_expect(lua_State *L, tk_parse_t *P, char c, const char *msg) {
+  parse_skipws(P);
+  if (P->p >= P->end || *P->p != c)
+    parse_error(L, P, msg);
+  P->p++;
+}
+
+static inline int parse_keyword(tk_parse_t *P, const char *kw, size_t len) {
+  if ((size_t)(P->end - P->p) < len || memcmp(P->p, kw, len) != 0)
+    return 0;
+  if (P->p + len < P->end && parse_isident((unsigned char)P->p[len]))
+    return 0;
+  P->p += len;
+  return 1;
+}
+
+static double parse_rawnumber(lua_State *L, tk_parse_t *P) {
+  parse_skipws(P);
+  // Plain integers of up to 15 digits are exact as doubles and skip tk_atod,
+  // which parses the rest whatever the locale's decimal point is.
+  const char *p = P->p;
+  int neg = p < P->end && *p == '-';
+  p += neg;
+  const char *digits = p;
+  uint64_t v = 0;
+  while (p < P->end && p - digits < 16 && isdigit((unsigned char)*p))
+    v = v * 10 + (uint64_t)(*p++ - '0');
+  if (p > digits && p - digits < 16 && (p >= P->end || !(isalnum((unsigned char)*p) || *p == '.'))) {
+    P->p = p;
+    return neg ? -(double)v : (double)v;
+  }
+  double d;
+  size_t n = tk_atod(P->p, (size_t)(P->end - P->p), &d);
+  if (!n)
+    parse_error(L, P, "malformed number");
+  P->p += n;
+  return d;
+}
+
+static void parse_string(lua_State *L, tk_parse_t *P) {
+  char q = *P->p++;
+  const char *start = P->p;
+  const char *p = start;
+  while (p < P->end && *p != q && *p != '\\' && *p != '\n')
+    p++;
+  if (p < P->end && *p == q) {
+    lua_pushlstring(L, start, (size_t)(p - start));
+    P->p = p + 1;
+    return;
+  }
+  luaL_Buffer B;
+  luaL_buffinit(L, &B);
+  luaL_addlstring(&B, start, (size_t)(p - start));
+  while (p < P->end && *p != q) {
+    char c = *p++;
+    if (c == '\n') {
+      P->p = p - 1;
+      parse_error(L, P, "unfinished string");
+    } else if (c != '\\') {
+      luaL_addchar(&B, c);
+      continue;
+    }
+    if (p >= P->end)
+      break;
+    c = *p++;
+    switch (c) {
+      case 'n': luaL_addchar(&B, '\n'); break;
+      case 't': luaL_addchar(&B, '\t'); break;
+      case 'r': luaL_addchar(&B, '\r'); break;
+      case 'a': luaL_addchar(&B, '\a'); break;
+      case 'b': luaL_addchar(&B, '\b'); break;
+      case 'f': luaL_addchar(&B, '\f'); break;
+      case 'v': luaL_addchar(&B, '\v'); break;
+      case '\n': luaL_addchar(&B, '\n'); break;
+      case '\\': case '"': case '\'': luaL_addchar(&B, c); break;
+      default: {
+        if (!isdigit((unsigned char)c)) {
+          P->p = p - 1;
+          parse_error(L, P, "invalid escape sequence");
+        }
+        int v = c - '0';
+        for (int i = 0; i < 2 && p < P->end && isdigit((unsigned char)*p); i++)
+          v = v * 10 + (*p++ - '0');
+        if (v > 255) {
+          P->p = p;
+          parse_error(L, P, "escape sequence too large");
+        }
+        luaL_addchar(&B, (char)v);
+        break;
+      }
+    }
+  }
+  if (p >= P->end) {
+    P->p = P->end;
+    parse_error(L, P, "unfinished string");
+  }
+  P->p = p + 1;
+  luaL_pushresult(&B);
+}
+
+static void parse_value(lua_State *L, tk_parse_t *P, int level);
+
+static void parse_table(lua_State *L, tk_parse_t *P, int level) {
+  if (level >= P->max_depth)
+    luaL_error(L, "maximum deserialization depth (%d) exceeded", P->max_depth);
+  luaL_checkstack(L, 4, "deserialization too deep");
+  uint32_t narr = 0, nhash = 0;
+  if (P->next < P->ncounts) {
+    memcpy(&narr, P->counts + 2 * P->next, sizeof(narr));
+    memcpy(&nhash, P->counts + 2 * P->next + 1, sizeof(nhash));
+    P->next++;
+  }
+  lua_createtable(L, (int)tk_min(narr, INT_MAX), (int)tk_min(nhash, INT_MAX));
+  int t = lua_gettop(L);
+  int i = 1;
+  P->p++;
+  while (1) {
+    parse_skipws(P);
+    if (P->p >= P->end)
+      parse_error(L, P, "unfinished table");
+    if (*P->p == '}') {
+      P->p++;
+      return;
+    }
+    if (*P->p == '[') {
+      P->p++;
+      parse_value(L, P, level + 1);
+      parse_expect(L, P, ']', "expected ']'");
+      parse_expect(L, P, '=', "expected '='");
+      parse_value(L, P, level + 1);
+      if (lua_isnil(L, -2) || (lua_type(L, -2) == LUA_TNUMBER && isnan(lua_tonumber(L, -2))))
+        lua_pop(L, 2);
+      else
+        lua_rawset(L, t);
+    } else if (parse_iskeyed(P->p, P->end)) {
+      const char *k = P->p;
+      while (P->p < P->end && parse_isident((unsigned char)*P->p))
+        P->p++;
+      lua_pushlstring(L, k, (size_t)(P->p - k));
+      parse_expect(L, P, '=', "expected '='");
+      parse_value(L, P, level + 1);
+      lua_rawset(L, t);
+    } else {
+      parse_value(L, P, level + 1);
+      lua_rawseti(L, t, i++);
+    }
+    parse_skipws(P);
+    if (P->p < P->end && (*P->p == ',' || *P->p == ';')) {
+      P->p++;
+    } else if (P->p >= P->end || *P->p != '}') {
+      parse_error(L, P, "expected ',' or '}'");
+    }
+  }
+}
+
+static void parse_value(lua_State *L, tk_parse_t *P, int level) {
+  parse_skipws(P);
+  if (P->p >= P->end)
+    parse_error(L, P, "unexpected end of data");
+  char c = *P->p;
+  if (c == '{') {
+    parse_table(L, P, level);
+  } else if (c == '"' || c == '\'') {
+    parse_string(L, P);
+  } else if (c == '(') {
+    P->p++;
+    double a = parse_rawnumber(L, P);
+    parse_expect(L, P, '/', "expected '/'");
+    double b = parse_rawnumber(L, P);
+    parse_expect(L, P, ')', "expected ')'");
+    lua_pushnumber(L, a / b);
+  } else if (c == '-' || c == '.' || isdigit((unsigned char)c)) {
+    lua_pushnumber(L, parse_rawnumber(L, P));
+  } else if (parse_keyword(P, "nil", 3)) {
+    lua_pushnil(L);
+  } else if (parse_keyword(P, "true", 4)) {
+    lua_pushboolean(L, 1);
+  } else if (parse_keyword(P, "false", 5)) {
+    lua_pushboolean(L, 0);
+  } else {
+    parse_error(L, P, "unexpected character");
+  }
+}
 
-  serialize_table_contents(L, out_idx, &out_n, 1, 1, nl, div, sep, seen_idx, max_depth);
-  concat_out(L, out_idx);
+static int santoku_deserialize(lua_State *L) {
+  size_t len;
+  const char *data = lz_checkinput(L, 1, &len);
+  tk_parse_t P;
+  P.s = P.p = data;
+  P.end = data + len;
+  P.max_depth = MAX_DEPTH_DEFAULT;
+  if (lua_gettop(L) >= 2 && lua_isnumber(L, 2))
+    P.max_depth = serialize_max_depth(L, lua_tointeger(L, 2));
+  lua_settop(L, 1);
+  tk_serialize_t *S = tk_serialize_new(L);
+  parse_prescan(L, S, &P);
+  parse_skipws(&P);
+  parse_keyword(&P, "return", 6);
+  parse_value(L, &P, 0);
+  parse_skipws(&P);
+  if (P.p < P.end && *P.p == ';')
+    P.p++;
+  parse_skipws(&P);
+  if (P.p < P.end)
+    parse_error(L, &P, "trailing characters");
   return 1;
 }
 
@@ -436,12 +2301,42 @@ static int santoku_serialize_call(lua_State *L) {
 static luaL_Reg fns[] = {
   { "serialize", santoku_serialize },
   { "serialize_table_contents", santoku_serialize_table_contents },
+  { "serialize_binary", santoku_serialize_binary },
+  { "deserialize", santoku_deserialize },
+  { "deserialize_binary", santoku_deserialize_binary },
+  { "digest", santoku_digest },
+  { "diff", santoku_diff },
+  { "patch", santoku_patch },
+  { "serialize_json", santoku_serialize_json },
+  { "deserialize_json", santoku_deserialize_json },
+  { "compress", santoku_serialize_compress },
+  { "decompress", santoku_serialize_decompress },
+  { "view", santoku_serialize_view },
+  { "mmap", santoku_serialize_mmap },
+  { "pairs", santoku_serialize_pairs },
+  { "materialize", santoku_serialize_materialize },
   { NULL, NULL }
 };
 
 int luaopen_santoku_serialize(lua_State *L) {
   lua_newtable(L);
   tk_lua_register(L, fns, 0);
+  luaL_newmetatable(L, TK_JSON_ARRAY_MT);
+  lua_setfield(L, -2, "json_array");
+  luaL_newmetatable(L, TK_JSON_OBJECT_MT);
+  lua_setfield(L, -2, "json_object");
+  luaL_newmetatable(L, TK_SERIALIZE_VIEW_MT);
+  lua_pushcfunction(L, tk_serialize_view_index);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, tk_serialize_view_newindex);
+  lua_setfield(L, -2, "__newindex");
+  lua_pushcfunction(L, tk_serialize_view_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, tk_serialize_view_pairs);
+  lua_setfield(L, -2, "__pairs");
+  lua_pop(L, 1);
+  lua_pushlightuserdata(L, NULL);
+  lua_setfield(L, -2, "null");
   lua_newtable(L);
   lua_pushcfunction(L, santoku_serialize_call);
   lua_setfield(L, -2, "__call");
@@ -0,0 +1,167 @@
+#ifndef TK_SERIALIZE_DIFF_H
+#define TK_SERIALIZE_DIFF_H
+
+// Table diffs and patches in the binary format, included by serialize.c.
+
+static inline void diff_checkkey(lua_State *L, int idx) {
+  int t = lua_type(L, idx);
+  if (t != LUA_TBOOLEAN && t != LUA_TNUMBER && t != LUA_TSTRING)
+    luaL_error(L, "cannot diff %s keys", lua_typename(L, t));
+}
+
+static inline bool diff_equal(lua_State *L, int a, int b) {
+  if (lua_rawequal(L, a, b))
+    return true;
+  return lua_type(L, a) == LUA_TNUMBER && lua_type(L, b) == LUA_TNUMBER &&
+    isnan(lua_tonumber(L, a)) && isnan(lua_tonumber(L, b));
+}
+
+// Returns the number of sets and deletes; empty nested patches are rolled back.
+static uint64_t diff_table(lua_State *L, tk_serialize_t *S, int a, int b, int level, int max_depth) {
+  if (level >= max_depth)
+    luaL_error(L, "maximum diff depth (%d) exceeded", max_depth);
+  luaL_checkstack(L, 6, "diff too deep");
+  uint64_t id;
+  if (seen_enter(L, S, b, &id))
+    luaL_error(L, "cannot diff cyclic tables");
+  uint64_t nops = 0;
+
+  size_t kbase = S->nkeys, kn = 0, ki = 0;
+  if (S->canonical)
+    kn = table_keys(L, S, b, 0);
+  lua_pushnil(L);
+  while (table_next(L, S, b, kbase, kn, &ki) != 0) {
+    int v = lua_gettop(L);
+    int k = v - 1;
+    diff_checkkey(L, k);
+    lua_pushvalue(L, k);
+    lua_rawget(L, a);
+    int ov = v + 1;
+    if (lua_istable(L, v) && lua_istable(L, ov) && !lua_rawequal(L, v, ov)) {
+      size_t mark = S->len;
+      buf_byte(L, S, PATCH_TABLE);
+      serialize_binary_value(L, S, k, level + 1, max_depth);
+      uint64_t n = diff_table(L, S, ov, v, level + 1, max_depth);
+      if (n)
+        nops += n;
+      else
+        S->len = mark;
+    } else if (!diff_equal(L, v, ov)) {
+      buf_byte(L, S, PATCH_SET);
+      serialize_binary_value(L, S, k, level + 1, max_depth);
+      serialize_binary_value(L, S, v, level + 1, max_depth);
+      nops++;
+    }
+    lua_settop(L, k);
+  }
+  S->nkeys = kbase;
+
+  kn = ki = 0;
+  if (S->canonical)
+    kn = table_keys(L, S, a, 0);
+  lua_pushnil(L);
+  while (table_next(L, S, a, kbase, kn, &ki) != 0) {
+    int k = lua_gettop(L) - 1;
+    diff_checkkey(L, k);
+    lua_pushvalue(L, k);
+    lua_rawget(L, b);
+    if (lua_isnil(L, -1)) {
+      buf_byte(L, S, PATCH_DEL);
+      serialize_binary_value(L, S, k, level + 1, max_depth);
+      nops++;
+    }
+    lua_settop(L, k);
+  }
+  S->nkeys = kbase;
+
+  buf_byte(L, S, PATCH_END);
+  seen_leave(L, S, b);
+  return nops;
+}
+
+static int santoku_diff(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int max_depth = MAX_DEPTH_DEFAULT;
+  bool canonical = false;
+  if (lua_type(L, 3) == LUA_TTABLE) {
+    max_depth = serialize_max_depth(L, tk_lua_foptinteger(L, 3, "diff", "max_depth", MAX_DEPTH_DEFAULT));
+    canonical = tk_lua_foptboolean(L, 3, "diff", "canonical", false);
+  } else if (lua_isnumber(L, 3)) {
+    max_depth = serialize_max_depth(L, lua_tointeger(L, 3));
+  }
+  lua_settop(L, 3);
+  tk_serialize_t *S = tk_serialize_new(L);
+  S->canonical = canonical;
+  buf_write(L, S, TK_SERIALIZE_MAGIC, TK_SERIALIZE_MAGIC_LEN);
+  buf_byte(L, S, TK_SERIALIZE_VERSION);
+  buf_byte(L, S, TAG_PATCH);
+  uint64_t nops = diff_table(L, S, 1, 2, 0, max_depth);
+  buf_finish(L, S);
+  lua_pushnumber(L, (lua_Number)nops);
+  return 2;
+}
+
+static void patch_table(lua_State *L, tk_deserialize_t *D, int t, int level) {
+  if (level >= D->max_depth)
+    luaL_error(L, "maximum patch depth (%d) exceeded", D->max_depth);
+  luaL_checkstack(L, 6, "patch too deep");
+  for (;;) {
+    uint8_t op = read_byte(L, D);
+    if (op == PATCH_END)
+      return;
+    deserialize_binary_value(L, D, level + 1);
+    if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && isnan(lua_tonumber(L, -1))))
+      luaL_error(L, "invalid patch: bad key");
+    switch (op) {
+      case PATCH_SET:
+        deserialize_binary_value(L, D, level + 1);
+        lua_rawset(L, t);
+        break;
+      case PATCH_DEL:
+        lua_pushnil(L);
+        lua_rawset(L, t);
+        break;
+      case PATCH_TABLE:
+        lua_rawget(L, t);
+        if (!lua_istable(L, -1))
+          luaL_error(L, "invalid patch: target is not a table");
+        patch_table(L, D, lua_gettop(L), level + 1);
+        lua_pop(L, 1);
+        break;
+      default:
+        luaL_error(L, "invalid patch: unknown operation %d", (int)op);
+        break;
+    }
+  }
+}
+
+// A corrupt patch can leave the table partially updated.
+static int santoku_patch(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  tk_deserialize_t D;
+  memset(&D, 0, sizeof(D));
+  D.p = (const uint8_t *)data;
+  D.end = D.p + len;
+  D.max_depth = MAX_DEPTH_DEFAULT;
+  if (lua_isnumber(L, 3))
+    D.max_depth = serialize_max_depth(L, lua_tointeger(L, 3));
+  if (len < TK_SERIALIZE_MAGIC_LEN + 2 || memcmp(data, TK_SERIALIZE_MAGIC, TK_SERIALIZE_MAGIC_LEN) != 0)
+    return luaL_error(L, "invalid patch: bad header");
+  D.p += TK_SERIALIZE_MAGIC_LEN;
+  uint8_t version = read_byte(L, &D);
+  if (version != TK_SERIALIZE_VERSION)
+    return luaL_error(L, "unsupported binary serialization version: %d", (int)version);
+  if (read_byte(L, &D) != TAG_PATCH)
+    return luaL_error(L, "invalid patch: not a patch");
+  lua_settop(L, 2);
+  patch_table(L, &D, 1, 0);
+  if (D.p != D.end)
+    return luaL_error(L, "invalid patch: trailing data");
+  lua_settop(L, 1);
+  return 1;
+}
+
+#endif
@@ -0,0 +1,407 @@
+#ifndef TK_SERIALIZE_JSON_H
+#define TK_SERIALIZE_JSON_H
+
+// JSON encoding helpers and decoder, included by serialize.c.
+
+static void json_string(lua_State *L, tk_serialize_t *S, const char *s, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  buf_byte(L, S, '"');
+  size_t start = 0;
+  size_t i = 0;
+  while ((i = escape_scan(s, i, len, true)) < len) {
+    if (i > start)
+      buf_write(L, S, s + start, i - start);
+    unsigned char c = (unsigned char)s[i];
+    char e = json_escape[c];
+    buf_reserve(L, S, 6);
+    S->data[S->len++] = '\\';
+    S->data[S->len++] = e;
+    if (e == 'u') {
+      S->data[S->len++] = '0';
+      S->data[S->len++] = '0';
+      S->data[S->len++] = hex[c >> 4];
+      S->data[S->len++] = hex[c & 15];
+    }
+    start = ++i;
+  }
+  if (len > start)
+    buf_write(L, S, s + start, len - start);
+  buf_byte(L, S, '"');
+}
+
+static int json_numfmt(lua_State *L, int idx, char *numbuf) {
+  int64_t i;
+  double num = lua_tonumber(L, idx);
+  if (isnan(num) || isinf(num))
+    luaL_error(L, "cannot encode %s as JSON", isnan(num) ? "NaN" : "infinity");
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L, idx))
+    return tk_i64toa((int64_t)lua_tointeger(L, idx), numbuf);
+#endif
+  return binary_isint(num, &i) ? tk_i64toa(i, numbuf) : tk_dtoa(num, numbuf);
+}
+
+// Numeric keys are quoted, so they must not collide with string keys.
+static void json_key(lua_State *L, tk_serialize_t *S, int t, int kidx, const char *sep) {
+  switch (lua_type(L, kidx)) {
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, kidx, &len);
+      json_string(L, S, s, len);
+      break;
+    }
+    case LUA_TNUMBER: {
+      char numbuf[TK_DTOA_BUFSIZE];
+      int numlen = json_numfmt(L, kidx, numbuf);
+      lua_pushlstring(L, numbuf, (size_t)numlen);
+      lua_rawget(L, t);
+      if (!lua_isnil(L, -1))
+        luaL_error(L, "cannot encode duplicate JSON key \"%s\"", numbuf);
+      lua_pop(L, 1);
+      buf_byte(L, S, '"');
+      buf_write(L, S, numbuf, (size_t)numlen);
+      buf_byte(L, S, '"');
+      break;
+    }
+    default:
+      luaL_error(L, "cannot encode %s keys as JSON", lua_typename(L, lua_type(L, kidx)));
+      break;
+  }
+  buf_byte(L, S, ':');
+  buf_str(L, S, sep);
+}
+
+// 1 for json_array, 2 for json_object, 0 otherwise.
+static int json_shape(lua_State *L, int idx) {
+  if (!lua_getmetatable(L, idx))
+    return 0;
+  luaL_getmetatable(L, TK_JSON_ARRAY_MT);
+  int array = lua_rawequal(L, -1, -2);
+  luaL_getmetatable(L, TK_JSON_OBJECT_MT);
+  int object = lua_rawequal(L, -1, -3);
+  lua_pop(L, 3);
+  return array ? 1 : object ? 2 : 0;
+}
+
+typedef struct {
+  const char *s;
+  const char *p;
+  const char *end;
+  int max_depth;
+  int null;
+  bool metatables;
+} tk_json_t;
+
+static int json_error(lua_State *L, tk_json_t *J, const char *msg) {
+  return luaL_error(L, "invalid JSON at position %d: %s", (int)(J->p - J->s + 1), msg);
+}
+
+static inline void json_skipws(tk_json_t *J) {
+  while (J->p < J->end && (*J->p == ' ' || *J->p == '\n' || *J->p == '\r' || *J->p == '\t'))
+    J->p++;
+}
+
+static inline int json_hex(int c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static uint32_t json_u16(lua_State *L, tk_json_t *J) {
+  if (J->end - J->p < 4)
+    json_error(L, J, "truncated unicode escape");
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    int h = json_hex((unsigned char)J->p[i]);
+    if (h < 0)
+      json_error(L, J, "invalid unicode escape");
+    v = (v << 4) | (uint32_t)h;
+  }
+  J->p += 4;
+  return v;
+}
+
+static void json_utf8(luaL_Buffer *B, uint32_t c) {
+  if (c < 0x80) {
+    luaL_addchar(B, (char)c);
+  } else if (c < 0x800) {
+    luaL_addchar(B, (char)(0xC0 | (c >> 6)));
+    luaL_addchar(B, (char)(0x80 | (c & 0x3F)));
+  } else if (c < 0x10000) {
+    luaL_addchar(B, (char)(0xE0 | (c >> 12)));
+    luaL_addchar(B, (char)(0x80 | ((c >> 6) & 0x3F)));
+    luaL_addchar(B, (char)(0x80 | (c & 0x3F)));
+  } else {
+    luaL_addchar(B, (char)(0xF0 | (c >> 18)));
+    luaL_addchar(B, (char)(0x80 | ((c >> 12) & 0x3F)));
+    luaL_addchar(B, (char)(0x80 | ((c >> 6) & 0x3F)));
+    luaL_addchar(B, (char)(0x80 | (c & 0x3F)));
+  }
+}
+
+static void json_parse_string(lua_State *L, tk_json_t *J) {
+  const char *start = ++J->p;
+  const char *p = start;
+  while (p < J->end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+    p++;
+  if (p < J->end && *p == '"') {
+    lua_pushlstring(L, start, (size_t)(p - start));
+    J->p = p + 1;
+    return;
+  }
+  luaL_Buffer B;
+  luaL_buffinit(L, &B);
+  luaL_addlstring(&B, start, (size_t)(p - start));
+  while (p < J->end && *p != '"') {
+    char c = *p++;
+    if ((unsigned char)c < 0x20) {
+      J->p = p - 1;
+      json_error(L, J, "control character in string");
+    } else if (c != '\\') {
+      luaL_addchar(&B, c);
+      continue;
+    }
+    if (p >= J->end)
+      break;
+    c = *p++;
+    switch (c) {
+      case '"': case '\\': case '/': luaL_addchar(&B, c); break;
+      case 'b': luaL_addchar(&B, '\b'); break;
+      case 'f': luaL_addchar(&B, '\f'); break;
+      case 'n': luaL_addchar(&B, '\n'); break;
+      case 'r': luaL_addchar(&B, '\r'); break;
+      case 't': luaL_addchar(&B, '\t'); break;
+      case 'u': {
+        J->p = p;
+        uint32_t u = json_u16(L, J);
+        // A high surrogate followed by an escaped low surrogate is one code
+        // point; unpaired surrogates are kept as they are.
+        if (u >= 0xD800 && u < 0xDC00 && J->end - J->p >= 6 && J->p[0] == '\\' && J->p[1] == 'u') {
+          const char *save = J->p;
+          J->p += 2;
+          uint32_t lo = json_u16(L, J);
+          if (lo >= 0xDC00 && lo < 0xE000)
+            u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+          else
+            J->p = save;
+        }
+        json_utf8(&B, u);
+        p = J->p;
+        break;
+      }
+      default:
+        J->p = p - 1;
+        json_error(L, J, "invalid escape sequence");
+    }
+  }
+  if (p >= J->end) {
+    J->p = J->end;
+    json_error(L, J, "unfinished string");
+  }
+  J->p = p + 1;
+  luaL_pushresult(&B);
+}
+
+static void json_parse_number(lua_State *L, tk_json_t *J) {
+  const char *start = J->p;
+  const char *p = start;
+  bool neg = *p == '-';
+  p += neg;
+  const char *digits = p;
+  uint64_t v = 0;
+  if (p < J->end && *p == '0') {
+    p++;
+  } else {
+    while (p < J->end && isdigit((unsigned char)*p))
+      v = v * 10 + (uint64_t)(*p++ - '0');
+  }
+  if (p == digits)
+    json_error(L, J, "malformed number");
+  size_t ndigits = (size_t)(p - digits);
+  bool integral = true;
+  if (p < J->end && *p == '.') {
+    integral = false;
+    const char *f = ++p;
+    while (p < J->end && isdigit((unsigned char)*p))
+      p++;
+    if (p == f)
+      json_error(L, J, "malformed number");
+  }
+  if (p < J->end && (*p == 'e' || *p == 'E')) {
+    integral = false;
+    p++;
+    if (p < J->end && (*p == '+' || *p == '-'))
+      p++;
+    const char *e = p;
+    while (p < J->end && isdigit((unsigned char)*p))
+      p++;
+    if (p == e)
+      json_error(L, J, "malformed number");
+  }
+  J->p = p;
+  // Integers of up to 15 digits are exact as doubles and skip tk_atod, which
+  // parses the rest whatever the locale's decimal point is.
+  if (integral && ndigits <= 15) {
+    if (neg && v == 0)
+      lua_pushnumber(L, -0.0);
+    else
+      push_int64(L, neg ? -(int64_t)v : (int64_t)v);
+    return;
+  }
+  double d;
+  if (tk_atod(start, (size_t)(p - start), &d) != (size_t)(p - start))
+    json_error(L, J, "malformed number");
+  int64_t i;
+  if (integral && binary_isint(d, &i))
+    push_int64(L, i);
+  else
+    lua_pushnumber(L, d);
+}
+
+static inline void json_setshape(lua_State *L, tk_json_t *J, const char *mt) {
+  if (!J->metatables)
+    return;
+  luaL_getmetatable(L, mt);
+  lua_setmetatable(L, -2);
+}
+
+static void json_parse_value(lua_State *L, tk_json_t *J, int level) {
+  json_skipws(J);
+  if (J->p >= J->end)
+    json_error(L, J, "unexpected end of input");
+  switch (*J->p) {
+
+    case '{': {
+      if (level >= J->max_depth)
+        json_error(L, J, "maximum depth exceeded");
+      luaL_checkstack(L, 4, "deserialization too deep");
+      J->p++;
+      lua_newtable(L);
+      json_setshape(L, J, TK_JSON_OBJECT_MT);
+      json_skipws(J);
+      if (J->p < J->end && *J->p == '}') {
+        J->p++;
+        break;
+      }
+      for (;;) {
+        json_skipws(J);
+        if (J->p >= J->end || *J->p != '"')
+          json_error(L, J, "expected string key");
+        json_parse_string(L, J);
+        json_skipws(J);
+        if (J->p >= J->end || *J->p != ':')
+          json_error(L, J, "expected ':'");
+        J->p++;
+        json_parse_value(L, J, level + 1);
+        lua_rawset(L, -3);
+        json_skipws(J);
+        if (J->p < J->end && *J->p == ',') {
+          J->p++;
+          continue;
+        }
+        if (J->p < J->end && *J->p == '}') {
+          J->p++;
+          break;
+        }
+        json_error(L, J, "expected ',' or '}'");
+      }
+      break;
+    }
+
+    case '[': {
+      if (level >= J->max_depth)
+        json_error(L, J, "maximum depth exceeded");
+      luaL_checkstack(L, 4, "deserialization too deep");
+      J->p++;
+      lua_newtable(L);
+      json_setshape(L, J, TK_JSON_ARRAY_MT);
+      json_skipws(J);
+      if (J->p < J->end && *J->p == ']') {
+        J->p++;
+        break;
+      }
+      for (int n = 1; ; n++) {
+        json_parse_value(L, J, level + 1);
+        lua_rawseti(L, -2, n);
+        json_skipws(J);
+        if (J->p < J->end && *J->p == ',') {
+          J->p++;
+          continue;
+        }
+        if (J->p < J->end && *J->p == ']') {
+          J->p++;
+          break;
+        }
+        json_error(L, J, "expected ',' or ']'");
+      }
+      break;
+    }
+
+    case '"':
+      json_parse_string(L, J);
+      break;
+
+    case 't':
+      if (J->end - J->p < 4 || memcmp(J->p, "true", 4) != 0)
+        json_error(L, J, "unexpected character");
+      J->p += 4;
+      lua_pushboolean(L, 1);
+      break;
+
+    case 'f':
+      if (J->end - J->p < 5 || memcmp(J->p, "false", 5) != 0)
+        json_error(L, J, "unexpected character");
+      J->p += 5;
+      lua_pushboolean(L, 0);
+      break;
+
+    case 'n':
+      if (J->end - J->p < 4 || memcmp(J->p, "null", 4) != 0)
+        json_error(L, J, "unexpected character");
+      J->p += 4;
+      if (J->null)
+        lua_pushvalue(L, J->null);
+      else
+        lua_pushnil(L);
+      break;
+
+    default:
+      if (*J->p == '-' || isdigit((unsigned char)*J->p))
+        json_parse_number(L, J);
+      else
+        json_error(L, J, "unexpected character");
+      break;
+  }
+}
+
+static int santoku_deserialize_json(lua_State *L) {
+  size_t len;
+  const char *data = luaL_checklstring(L, 1, &len);
+  tk_json_t J;
+  J.s = J.p = data;
+  J.end = data + len;
+  J.max_depth = MAX_DEPTH_DEFAULT;
+  J.null = 0;
+  J.metatables = false;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    lua_settop(L, 2);
+    J.max_depth = serialize_max_depth(L, tk_lua_foptinteger(L, 2, "deserialize_json", "max_depth", MAX_DEPTH_DEFAULT));
+    J.metatables = tk_lua_foptboolean(L, 2, "deserialize_json", "metatables", false);
+    lua_getfield(L, 2, "null");
+    if (!lua_isnil(L, -1))
+      J.null = lua_gettop(L);
+  } else if (lua_isnumber(L, 2)) {
+    J.max_depth = serialize_max_depth(L, lua_tointeger(L, 2));
+  }
+  json_parse_value(L, &J, 0);
+  json_skipws(&J);
+  if (J.p < J.end)
+    json_error(L, &J, "trailing characters");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,301 @@
+#ifndef TK_SERIALIZE_VIEW_H
+#define TK_SERIALIZE_VIEW_H
+
+// Lazy views over indexed binary blobs, included by serialize.c.
+
+// The blob is kept alive by the view's environment table.
+typedef struct {
+  const uint8_t *end;
+  const uint8_t *tab;
+  const uint8_t *index;
+  const uint8_t *entries;
+  uint64_t narr;
+  uint64_t nhash;
+  uint8_t width;
+} tk_serialize_view_t;
+
+typedef struct {
+  void *addr;
+  size_t len;
+} tk_serialize_map_t;
+
+#if LUA_VERSION_NUM >= 502
+#define view_setenv lua_setuservalue
+#define view_getenv lua_getuservalue
+#else
+#define view_setenv lua_setfenv
+#define view_getenv lua_getfenv
+#endif
+
+static int tk_serialize_map_gc(lua_State *L) {
+  tk_serialize_map_t *M = (tk_serialize_map_t *)luaL_checkudata(L, 1, TK_SERIALIZE_MAP_MT);
+  if (M->addr)
+    munmap(M->addr, M->len);
+  M->addr = NULL;
+  M->len = 0;
+  return 0;
+}
+
+static inline tk_serialize_view_t *view_peek(lua_State *L, int idx) {
+  return (tk_serialize_view_t *)tk_lua_testuserdata(L, idx, TK_SERIALIZE_VIEW_MT);
+}
+
+static inline tk_deserialize_t view_reader(const uint8_t *p, const uint8_t *end) {
+  tk_deserialize_t D;
+  memset(&D, 0, sizeof(D));
+  D.p = p;
+  D.end = end;
+  D.max_depth = MAX_DEPTH_DEFAULT;
+  return D;
+}
+
+static void view_new(lua_State *L, const uint8_t *p, const uint8_t *end) {
+  tk_serialize_view_t *V = (tk_serialize_view_t *)lua_newuserdata(L, sizeof(tk_serialize_view_t));
+  luaL_getmetatable(L, TK_SERIALIZE_VIEW_MT);
+  lua_setmetatable(L, -2);
+  lua_insert(L, -2);
+  view_setenv(L, -2);
+  tk_deserialize_t D = view_reader(p + 1, end);
+  const uint8_t *index_end;
+  read_index(L, &D, p, &V->narr, &V->nhash, &V->index, &index_end, &V->entries);
+  V->end = end;
+  V->tab = p;
+  V->width = V->entries[-1];
+}
+
+static inline const uint8_t *view_entry(lua_State *L, tk_serialize_view_t *V, uint64_t i) {
+  const uint8_t *e = V->entries + i * V->width;
+  uint64_t off = 0;
+  for (uint8_t b = 0; b < V->width; b++)
+    off |= (uint64_t)e[b] << (8 * b);
+  if (off < 9 || V->tab + off >= V->index)
+    luaL_error(L, "invalid binary serialization: bad table index");
+  return V->tab + off;
+}
+
+static const uint8_t *view_push(lua_State *L, int vidx, tk_serialize_view_t *V, const uint8_t *p) {
+  if (*p == TAG_ITABLE) {
+    view_getenv(L, vidx);
+    view_new(L, p, V->end);
+    tk_serialize_view_t *C = (tk_serialize_view_t *)lua_touserdata(L, -1);
+    return C->index;
+  }
+  tk_deserialize_t D = view_reader(p, V->index);
+  deserialize_binary_value(L, &D, 0);
+  return D.p;
+}
+
+// String keys point into the blob.
+static const uint8_t *view_key(lua_State *L, tk_serialize_view_t *V, const uint8_t *p, tk_serialize_key_t *k) {
+  tk_deserialize_t D = view_reader(p, V->index);
+  memset(k, 0, sizeof(*k));
+  uint8_t tag = read_byte(L, &D);
+  switch (tag) {
+    case TAG_FALSE:
+    case TAG_TRUE:
+      k->type = LUA_TBOOLEAN;
+      k->i = tag == TAG_TRUE;
+      break;
+    case TAG_INT:
+      k->type = LUA_TNUMBER;
+      k->isint = true;
+      k->i = zigzag_decode(read_varint(L, &D));
+      k->n = (double)k->i;
+      break;
+    case TAG_DOUBLE:
+      k->type = LUA_TNUMBER;
+      k->n = read_double(L, &D);
+      break;
+    case TAG_STRING: {
+      uint64_t len = read_varint(L, &D);
+      if (len > (uint64_t)(D.end - D.p))
+        luaL_error(L, "invalid binary serialization: length exceeds data");
+      k->type = LUA_TSTRING;
+      k->s = (const char *)D.p;
+      k->len = (size_t)len;
+      D.p += len;
+      break;
+    }
+    default:
+      luaL_error(L, "invalid binary serialization: bad table key");
+  }
+  return D.p;
+}
+
+static int tk_serialize_view_index(lua_State *L) {
+  tk_serialize_view_t *V = (tk_serialize_view_t *)luaL_checkudata(L, 1, TK_SERIALIZE_VIEW_MT);
+  tk_serialize_key_t k;
+  memset(&k, 0, sizeof(k));
+  k.type = lua_type(L, 2);
+  switch (k.type) {
+    case LUA_TBOOLEAN:
+      k.i = lua_toboolean(L, 2);
+      break;
+    case LUA_TNUMBER:
+      k.n = lua_tonumber(L, 2);
+      k.isint = lua_isinteger_compat(L, 2);
+      if (k.isint) {
+        k.i = (int64_t)lua_tointeger(L, 2);
+        if (k.i >= 1 && (uint64_t)k.i <= V->narr) {
+          view_push(L, 1, V, view_entry(L, V, (uint64_t)k.i - 1));
+          return 1;
+        }
+      } else if (isnan(k.n)) {
+        return 0;
+      }
+      break;
+    case LUA_TSTRING:
+      k.s = lua_tolstring(L, 2, &k.len);
+      break;
+    default:
+      return 0;
+  }
+  uint64_t lo = 0, hi = V->nhash;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    tk_serialize_key_t m;
+    const uint8_t *v = view_key(L, V, view_entry(L, V, V->narr + mid), &m);
+    if (tk_serialize_key_lt(m, k)) {
+      lo = mid + 1;
+    } else if (tk_serialize_key_lt(k, m)) {
+      hi = mid;
+    } else {
+      view_push(L, 1, V, v);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int tk_serialize_view_newindex(lua_State *L) {
+  return luaL_error(L, "cannot assign to a serialize view");
+}
+
+static int tk_serialize_view_len(lua_State *L) {
+  tk_serialize_view_t *V = (tk_serialize_view_t *)luaL_checkudata(L, 1, TK_SERIALIZE_VIEW_MT);
+  lua_pushnumber(L, (lua_Number)V->narr);
+  return 1;
+}
+
+static int view_iter(lua_State *L) {
+  tk_serialize_view_t *V = (tk_serialize_view_t *)luaL_checkudata(L, 1, TK_SERIALIZE_VIEW_MT);
+  uint64_t i = (uint64_t)lua_tonumber(L, lua_upvalueindex(1));
+  if (i >= V->narr + V->nhash)
+    return 0;
+  lua_pushnumber(L, (lua_Number)(i + 1));
+  lua_replace(L, lua_upvalueindex(1));
+  const uint8_t *p = view_entry(L, V, i);
+  if (i < V->narr) {
+    lua_pushnumber(L, (lua_Number)(i + 1));
+  } else {
+    tk_deserialize_t D = view_reader(p, V->index);
+    deserialize_binary_value(L, &D, 0);
+    p = D.p;
+    if (p >= V->index)
+      return luaL_error(L, "invalid binary serialization: unexpected end of data");
+  }
+  view_push(L, 1, V, p);
+  return 2;
+}
+
+static int tk_serialize_view_pairs(lua_State *L) {
+  luaL_checkudata(L, 1, TK_SERIALIZE_VIEW_MT);
+  lua_pushnumber(L, 0);
+  lua_pushcclosure(L, view_iter, 1);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+// __pairs is ignored under Lua 5.1.
+static int santoku_serialize_pairs(lua_State *L) {
+  if (view_peek(L, 1))
+    return tk_serialize_view_pairs(L);
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getglobal(L, "next");
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static int view_open(lua_State *L, const uint8_t *p, const uint8_t *end) {
+  size_t len = (size_t)(end - p);
+  if (lz_isframe((const char *)p, len))
+    return luaL_error(L, "cannot view a compressed blob");
+  if (len < TK_SERIALIZE_MAGIC_LEN + 2 || memcmp(p, TK_SERIALIZE_MAGIC, TK_SERIALIZE_MAGIC_LEN) != 0)
+    return luaL_error(L, "invalid binary serialization: bad header");
+  p += TK_SERIALIZE_MAGIC_LEN;
+  if (*p != TK_SERIALIZE_VERSION)
+    return luaL_error(L, "unsupported binary serialization version: %d", (int)*p);
+  p++;
+  if (*p == TAG_REFS || *p == TAG_STRINGS)
+    return luaL_error(L, "cannot view a blob written with refs or intern");
+  if (*p != TAG_ITABLE) {
+    lua_pop(L, 1);
+    tk_deserialize_t D = view_reader(p, end);
+    deserialize_binary_value(L, &D, 0);
+    if (D.p != end)
+      return luaL_error(L, "invalid binary serialization: trailing data");
+    return 1;
+  }
+  view_new(L, p, end);
+  tk_serialize_view_t *V = (tk_serialize_view_t *)lua_touserdata(L, -1);
+  const uint8_t *index_end = V->entries + (V->narr + V->nhash) * V->width;
+  if (index_end != end)
+    return luaL_error(L, "invalid binary serialization: trailing data");
+  return 1;
+}
+
+static int santoku_serialize_view(lua_State *L) {
+  size_t len;
+  const char *data = luaL_checklstring(L, 1, &len);
+  lua_settop(L, 1);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  return view_open(L, (const uint8_t *)data, (const uint8_t *)data + len);
+}
+
+static int santoku_serialize_mmap(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  lua_settop(L, 1);
+  lua_createtable(L, 1, 0);
+  tk_serialize_map_t *M = tk_lua_newuserdata(L, tk_serialize_map_t, TK_SERIALIZE_MAP_MT, NULL, tk_serialize_map_gc);
+  lua_rawseti(L, -2, 1);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return luaL_error(L, "%s: %s", path, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int e = errno;
+    close(fd);
+    return luaL_error(L, "%s: %s", path, strerror(e));
+  }
+  if (st.st_size < TK_SERIALIZE_MAGIC_LEN + 2) {
+    close(fd);
+    return luaL_error(L, "invalid binary serialization: bad header");
+  }
+  void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int e = errno;
+  close(fd);
+  if (addr == MAP_FAILED)
+    return luaL_error(L, "%s: %s", path, strerror(e));
+  M->addr = addr;
+  M->len = (size_t)st.st_size;
+  return view_open(L, (const uint8_t *)addr, (const uint8_t *)addr + M->len);
+}
+
+static int santoku_serialize_materialize(lua_State *L) {
+  luaL_checkany(L, 1);
+  tk_serialize_view_t *V = view_peek(L, 1);
+  if (!V) {
+    lua_settop(L, 1);
+    return 1;
+  }
+  lua_settop(L, 1);
+  tk_deserialize_t D = view_reader(V->tab, V->end);
+  deserialize_binary_value(L, &D, 0);
+  return 1;
+}
+
+#endif
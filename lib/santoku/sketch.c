@@ -0,0 +1,452 @@
+#include <santoku/lua/utils.h>
+#include <santoku/wyhash.h>
+
+#define TK_BLOOM_MT "santoku_sketch_bloom"
+#define TK_HLL_MT "santoku_sketch_hll"
+
+#define TK_SKETCH_VERSION 1
+#define TK_BLOOM_MAGIC "TKBF"
+#define TK_HLL_MAGIC "TKHL"
+
+// Each Bloom block is one 64-byte cache line, so a lookup touches one line.
+#define TK_BLOOM_BLOCK_BITS 512
+#define TK_BLOOM_BLOCK_WORDS (TK_BLOOM_BLOCK_BITS / 64)
+#define TK_BLOOM_MAX_K 16
+
+#define TK_HLL_MIN_P 4
+#define TK_HLL_MAX_P 18
+#define TK_HLL_DEFAULT_P 14
+
+// Keys are strings or numbers. Strings are hashed with wyhash, numbers by
+// value as santoku.hash.double does, and tk_hash_mix derives the second 64 bits
+// that Bloom probes need.
+static inline uint64_t sketch_key (lua_State *L, int i, uint64_t seed)
+{
+  switch (lua_type(L, i)) {
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, i, &len);
+      return tk_wyhash(s, len, seed);
+    }
+    case LUA_TNUMBER:
+      return tk_wyhash_double(lua_tonumber(L, i), seed);
+    default:
+      luaL_argerror(L, i, "key must be a string or number");
+      return 0;
+  }
+}
+
+static inline void sketch_put64 (char *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++)
+    p[i] = (char) (v >> (8 * i));
+}
+
+static inline uint64_t sketch_get64 (const char *p)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v |= (uint64_t) (unsigned char) p[i] << (8 * i);
+  return v;
+}
+
+typedef struct {
+  uint64_t *bits;
+  uint64_t nblocks;
+  uint64_t seed;
+  int k;
+} tk_bloom_t;
+
+static inline tk_bloom_t *peek_bloom (lua_State *L, int i)
+{
+  return (tk_bloom_t *) luaL_checkudata(L, i, TK_BLOOM_MT);
+}
+
+static inline int tk_bloom_gc (lua_State *L)
+{
+  tk_bloom_t *B = peek_bloom(L, 1);
+  free(B->bits);
+  B->bits = NULL;
+  return 0;
+}
+
+// Probes k bits of the key's block, taking 9-bit positions from successive
+// tk_hash_mix rounds rather than double hashing, which over 512 positions
+// leaves too few distinct probe patterns. Sets the bits when add is true.
+// Returns whether all were already set.
+static inline bool bloom_probe (tk_bloom_t *B, uint64_t h, bool add)
+{
+  uint64_t a = h, b = B->nblocks;
+  tk_wymum(&a, &b);
+  uint64_t *block = B->bits + b * TK_BLOOM_BLOCK_WORDS;
+  uint64_t r = h, x = 0;
+  bool present = true;
+  for (int i = 0; i < B->k; i++) {
+    if (i % 7 == 0)
+      x = r = tk_hash_mix(r);
+    uint64_t bit = x & (TK_BLOOM_BLOCK_BITS - 1);
+    x >>= 9;
+    uint64_t mask = 1ULL << (bit & 63);
+    if (!(block[bit >> 6] & mask)) {
+      present = false;
+      if (!add)
+        return false;
+      block[bit >> 6] |= mask;
+    }
+  }
+  return present;
+}
+
+static inline bool bloom_compatible (tk_bloom_t *A, tk_bloom_t *B)
+{
+  return A->nblocks == B->nblocks && A->k == B->k && A->seed == B->seed;
+}
+
+static inline int bloom_add (lua_State *L)
+{
+  tk_bloom_t *B = peek_bloom(L, 1);
+  lua_pushboolean(L, !bloom_probe(B, sketch_key(L, 2, B->seed), true));
+  return 1;
+}
+
+static inline int bloom_has (lua_State *L)
+{
+  tk_bloom_t *B = peek_bloom(L, 1);
+  lua_pushboolean(L, bloom_probe(B, sketch_key(L, 2, B->seed), false));
+  return 1;
+}
+
+static inline int bloom_merge (lua_State *L)
+{
+  tk_bloom_t *A = peek_bloom(L, 1);
+  tk_bloom_t *B = peek_bloom(L, 2);
+  if (!bloom_compatible(A, B))
+    return luaL_error(L, "bloom filters differ in size, probes or seed");
+  for (uint64_t i = 0; i < A->nblocks * TK_BLOOM_BLOCK_WORDS; i++)
+    A->bits[i] |= B->bits[i];
+  lua_settop(L, 1);
+  return 1;
+}
+
+static inline int bloom_clear (lua_State *L)
+{
+  tk_bloom_t *B = peek_bloom(L, 1);
+  memset(B->bits, 0, B->nblocks * TK_BLOOM_BLOCK_BITS / 8);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static inline int bloom_bytes (lua_State *L)
+{
+  tk_bloom_t *B = peek_bloom(L, 1);
+  lua_pushinteger(L, (lua_Integer) (B->nblocks * TK_BLOOM_BLOCK_BITS / 8));
+  return 1;
+}
+
+// Magic, version, k, seed, block count, then the blocks as little-endian
+// 64-bit words.
+static inline int bloom_dump (lua_State *L)
+{
+  tk_bloom_t *B = peek_bloom(L, 1);
+  size_t nwords = B->nblocks * TK_BLOOM_BLOCK_WORDS;
+  size_t len = 6 + 16 + nwords * 8;
+  char *out = tk_malloc(L, len);
+  memcpy(out, TK_BLOOM_MAGIC, 4);
+  out[4] = TK_SKETCH_VERSION;
+  out[5] = (char) B->k;
+  sketch_put64(out + 6, B->seed);
+  sketch_put64(out + 14, B->nblocks);
+  for (size_t i = 0; i < nwords; i++)
+    sketch_put64(out + 22 + i * 8, B->bits[i]);
+  lua_pushlstring(L, out, len);
+  free(out);
+  return 1;
+}
+
+static luaL_Reg bloom_fns[] =
+{
+  { "add", bloom_add },
+  { "has", bloom_has },
+  { "merge", bloom_merge },
+  { "clear", bloom_clear },
+  { "bytes", bloom_bytes },
+  { "dump", bloom_dump },
+  { NULL, NULL }
+};
+
+static inline tk_bloom_t *bloom_new (lua_State *L, uint64_t nblocks, int k, uint64_t seed)
+{
+  tk_bloom_t *B = tk_lua_newuserdata(L, tk_bloom_t, TK_BLOOM_MT, bloom_fns, tk_bloom_gc);
+  B->bits = tk_malloc_aligned(L, nblocks * TK_BLOOM_BLOCK_BITS / 8, 64);
+  memset(B->bits, 0, nblocks * TK_BLOOM_BLOCK_BITS / 8);
+  B->nblocks = nblocks;
+  B->k = k;
+  B->seed = seed;
+  return B;
+}
+
+// False positive rate of a blocked filter holding an average of load keys
+// per block: the rate of a 512-bit filter at each load, weighted by the
+// Poisson spread of keys over blocks.
+static inline double bloom_rate (double load, int k)
+{
+  double rate = 0, pmf = exp(-load);
+  int jmax = (int) (load + 10 * sqrt(load) + 20);
+  for (int j = 0; j <= jmax; j++) {
+    if (j > 0)
+      pmf *= load / j;
+    rate += pmf * pow(1 - pow(1 - 1.0 / TK_BLOOM_BLOCK_BITS, (double) k * j), k);
+  }
+  return rate;
+}
+
+// Sizes the filter for n keys at false positive rate fp. It starts from the
+// classic m = -n ln(fp) / ln(2)^2 bits, then adds blocks until the best k
+// meets fp, since uneven block loads raise the rate above the classic one.
+// With at most 16 probes in a block the rate levels off once blocks outnumber
+// keys, so the filter stops growing there (or at the addressable size).
+static inline int bloom (lua_State *L)
+{
+  lua_Number n = luaL_checknumber(L, 1);
+  lua_Number fp = luaL_optnumber(L, 2, 0.01);
+  uint64_t seed = (uint64_t) luaL_optinteger(L, 3, 0);
+  if (!(n >= 1) || isinf(n))
+    return luaL_error(L, "expected key count must be positive");
+  if (!(fp > 0 && fp < 1))
+    return luaL_error(L, "false positive rate must be between 0 and 1");
+  double max = fmin(ceil(n), (double) (SIZE_MAX / (TK_BLOOM_BLOCK_BITS / 8)));
+  double bits = ceil(-n * log(fp) / (M_LN2 * M_LN2));
+  double start = ceil(bits / TK_BLOOM_BLOCK_BITS);
+  if (start > max)
+    return luaL_error(L, "false positive rate too low");
+  uint64_t nblocks = (uint64_t) start, maxblocks = (uint64_t) max;
+  int k;
+  while (true) {
+    double load = n / (double) nblocks, best = 2;
+    k = 1;
+    for (int j = 1; j <= TK_BLOOM_MAX_K; j++) {
+      double rate = bloom_rate(load, j);
+      if (rate < best) {
+        best = rate;
+        k = j;
+      }
+    }
+    if (best <= fp)
+      break;
+    if (nblocks == maxblocks)
+      return luaL_error(L, "false positive rate too low");
+    nblocks += nblocks / 32 + 1;
+    if (nblocks > maxblocks)
+      nblocks = maxblocks;
+  }
+  bloom_new(L, nblocks, k, seed);
+  return 1;
+}
+
+typedef struct {
+  uint8_t *reg;
+  uint64_t seed;
+  int p;
+} tk_hll_t;
+
+static inline tk_hll_t *peek_hll (lua_State *L, int i)
+{
+  return (tk_hll_t *) luaL_checkudata(L, i, TK_HLL_MT);
+}
+
+static inline int tk_hll_gc (lua_State *L)
+{
+  tk_hll_t *H = peek_hll(L, 1);
+  free(H->reg);
+  H->reg = NULL;
+  return 0;
+}
+
+// Registers are indexed by the top p bits and hold one more than the number
+// of leading zeros in the remaining 64 - p bits.
+static inline int hll_add (lua_State *L)
+{
+  tk_hll_t *H = peek_hll(L, 1);
+  uint64_t h = sketch_key(L, 2, H->seed);
+  uint64_t i = h >> (64 - H->p);
+  uint64_t w = h << H->p;
+  uint8_t rho = (uint8_t) (w ? __builtin_clzll(w) + 1 : 64 - H->p + 1);
+  bool changed = rho > H->reg[i];
+  if (changed)
+    H->reg[i] = rho;
+  lua_pushboolean(L, changed);
+  return 1;
+}
+
+static inline double hll_sigma (double x)
+{
+  if (x == 1)
+    return INFINITY;
+  double y = 1, z = x, zp;
+  do {
+    x *= x;
+    zp = z;
+    z += x * y;
+    y += y;
+  } while (z != zp);
+  return z;
+}
+
+static inline double hll_tau (double x)
+{
+  if (x == 0 || x == 1)
+    return 0;
+  double y = 1, z = 1 - x, zp;
+  do {
+    x = sqrt(x);
+    zp = z;
+    y *= 0.5;
+    z -= (1 - x) * (1 - x) * y;
+  } while (z != zp);
+  return z / 3;
+}
+
+// Ertl's improved estimator ("New cardinality estimation algorithms for
+// HyperLogLog sketches", 2017) over the register histogram. It is unbiased
+// from empty to full without HLL++'s empirical bias tables or the switch to
+// linear counting.
+static inline int hll_count (lua_State *L)
+{
+  tk_hll_t *H = peek_hll(L, 1);
+  int q = 64 - H->p;
+  size_t m = (size_t) 1 << H->p;
+  uint32_t c[66] = { 0 };
+  for (size_t i = 0; i < m; i++)
+    c[H->reg[i]]++;
+  double z = (double) m * hll_tau(1 - (double) c[q + 1] / (double) m);
+  for (int k = q; k >= 1; k--)
+    z = 0.5 * (z + c[k]);
+  z += (double) m * hll_sigma((double) c[0] / (double) m);
+  lua_pushnumber(L, round((double) m * (double) m / (2 * M_LN2 * z)));
+  return 1;
+}
+
+static inline int hll_merge (lua_State *L)
+{
+  tk_hll_t *A = peek_hll(L, 1);
+  tk_hll_t *B = peek_hll(L, 2);
+  if (A->p != B->p || A->seed != B->seed)
+    return luaL_error(L, "counters differ in precision or seed");
+  for (size_t i = 0; i < (size_t) 1 << A->p; i++)
+    if (B->reg[i] > A->reg[i])
+      A->reg[i] = B->reg[i];
+  lua_settop(L, 1);
+  return 1;
+}
+
+static inline int hll_clear (lua_State *L)
+{
+  tk_hll_t *H = peek_hll(L, 1);
+  memset(H->reg, 0, (size_t) 1 << H->p);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static inline int hll_bytes (lua_State *L)
+{
+  tk_hll_t *H = peek_hll(L, 1);
+  lua_pushinteger(L, (lua_Integer) 1 << H->p);
+  return 1;
+}
+
+// Magic, version, precision, seed, then one byte per register.
+static inline int hll_dump (lua_State *L)
+{
+  tk_hll_t *H = peek_hll(L, 1);
+  size_t m = (size_t) 1 << H->p;
+  size_t len = 6 + 8 + m;
+  char *out = tk_malloc(L, len);
+  memcpy(out, TK_HLL_MAGIC, 4);
+  out[4] = TK_SKETCH_VERSION;
+  out[5] = (char) H->p;
+  sketch_put64(out + 6, H->seed);
+  memcpy(out + 14, H->reg, m);
+  lua_pushlstring(L, out, len);
+  free(out);
+  return 1;
+}
+
+static luaL_Reg hll_fns[] =
+{
+  { "add", hll_add },
+  { "count", hll_count },
+  { "merge", hll_merge },
+  { "clear", hll_clear },
+  { "bytes", hll_bytes },
+  { "dump", hll_dump },
+  { NULL, NULL }
+};
+
+static inline tk_hll_t *hll_new (lua_State *L, int p, uint64_t seed)
+{
+  tk_hll_t *H = tk_lua_newuserdata(L, tk_hll_t, TK_HLL_MT, hll_fns, tk_hll_gc);
+  H->reg = tk_malloc(L, (size_t) 1 << p);
+  memset(H->reg, 0, (size_t) 1 << p);
+  H->p = p;
+  H->seed = seed;
+  return H;
+}
+
+static inline int hll (lua_State *L)
+{
+  lua_Integer p = luaL_optinteger(L, 1, TK_HLL_DEFAULT_P);
+  uint64_t seed = (uint64_t) luaL_optinteger(L, 2, 0);
+  if (p < TK_HLL_MIN_P || p > TK_HLL_MAX_P)
+    return luaL_error(L, "precision must be between %d and %d", TK_HLL_MIN_P, TK_HLL_MAX_P);
+  hll_new(L, (int) p, seed);
+  return 1;
+}
+
+// Restores a filter or counter from dump.
+static inline int load (lua_State *L)
+{
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  if (len < 14 || s[4] != TK_SKETCH_VERSION)
+    return luaL_error(L, "not a sketch");
+  if (!memcmp(s, TK_BLOOM_MAGIC, 4) && len >= 22) {
+    int k = (unsigned char) s[5];
+    uint64_t nblocks = sketch_get64(s + 14);
+    if (k < 1 || k > TK_BLOOM_MAX_K || !nblocks ||
+        nblocks > (len - 22) / (TK_BLOOM_BLOCK_BITS / 8) ||
+        len - 22 != nblocks * (TK_BLOOM_BLOCK_BITS / 8))
+      return luaL_error(L, "corrupt bloom filter");
+    tk_bloom_t *B = bloom_new(L, nblocks, k, sketch_get64(s + 6));
+    for (size_t i = 0; i < nblocks * TK_BLOOM_BLOCK_WORDS; i++)
+      B->bits[i] = sketch_get64(s + 22 + i * 8);
+    return 1;
+  }
+  if (!memcmp(s, TK_HLL_MAGIC, 4)) {
+    int p = (unsigned char) s[5];
+    if (p < TK_HLL_MIN_P || p > TK_HLL_MAX_P || len - 14 != (size_t) 1 << p)
+      return luaL_error(L, "corrupt hyperloglog counter");
+    tk_hll_t *H = hll_new(L, p, sketch_get64(s + 6));
+    for (size_t i = 0; i < (size_t) 1 << p; i++) {
+      if ((unsigned char) s[14 + i] > 64 - p + 1)
+        return luaL_error(L, "corrupt hyperloglog counter");
+      H->reg[i] = (uint8_t) s[14 + i];
+    }
+    return 1;
+  }
+  return luaL_error(L, "not a sketch");
+}
+
+static luaL_Reg fns[] =
+{
+  { "bloom", bloom },
+  { "hll", hll },
+  { "load", load },
+  { NULL, NULL }
+};
+
+int luaopen_santoku_sketch (lua_State *L)
+{
+  lua_newtable(L);
+  tk_lua_register(L, fns, 0);
+  return 1;
+}
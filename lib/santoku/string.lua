@@ -8,7 +8,6 @@ local gsub = string.gsub
 local format = string.format
 local reverse = string.reverse
 local smatch = string.match
-local sgmatch = string.gmatch
 local io_write = io.write
 
 local function splits (str, pat, delim, s, e)
@@ -271,7 +270,7 @@ local function format_number (n)
   if type(n) ~= "number" then
     return
   end
-  local sign, num, dec = smatch(tostring(n), "([-]?)(%d+)([.]?%d*)")
+  local sign, num, dec = smatch(base.dtoa(n), "([-]?)(%d+)([.]?%d*)")
   num = reverse(num)
   num = gsub(num, "(%d%d%d)", "%1,")
   num = reverse(num)
@@ -279,53 +278,8 @@ local function format_number (n)
   return sign .. num .. dec
 end
 
-local function to_query_stringify (v)
-  local t = type(v)
-  if t == "number" or t == "string" or t == "boolean" then
-    return base.to_url(tostring(v))
-  end
-end
-
-local function to_query (params, out)
-  if not params then
-    return
-  end
-  local should_concat = out == nil
-  local out = out or {}
-  arr.push(out, "?")
-  for k, v in pairs(params) do
-    local k = to_query_stringify(k)
-    local v = to_query_stringify(v)
-    if k and v then
-      arr.push(out, k, "=", v, "&")
-    end
-  end
-  out[#out] = nil
-  return should_concat and arr.concat(out) or out
-end
-
-local function from_query_parse (v)
-  v = base.from_url(v)
-  if v == "true" then
-    return true
-  elseif v == "false" then
-    return false
-  else
-    return tonumber(v) or v
-  end
-end
-
-local function from_query (s, out)
-  out = out or {}
-  for k, v in sgmatch(s, "([^&=?]+)=([^&=?]*)") do
-    local k = from_query_parse(k)
-    local v = from_query_parse(v)
-    if k and v then
-      out[k] = v
-    end
-  end
-  return out
-end
+local to_query = base.to_query
+local from_query = base.from_query
 
 local function to_formdata (t, out)
   local q = to_query(t, out)
@@ -393,8 +347,6 @@ return tbl.merge({
   compare = compare,
   commonprefix = commonprefix,
   format_number = format_number,
-  to_query = to_query,
-  from_query = from_query,
   to_formdata = to_formdata,
   from_formdata = from_formdata,
   encode_url = encode_url,
@@ -1,4 +1,6 @@
 #include <santoku/lua/utils.h>
+#include <santoku/dtoa.h>
+#include <santoku/atod.h>
 #include <ctype.h>
 
 static inline int number (lua_State *L)
@@ -9,9 +11,11 @@ static inline int number (lua_State *L)
   lua_Integer s = luaL_checkinteger(L, 2) - 1;
   if (s > (int64_t) len)
     luaL_error(L, "string index out of bounds in number conversion");
-  char *end;
-  double val = strtod(str + s, &end);
-  if (str != end) {
+  const char *p = str + s, *end = str + len;
+  while (p < end && isspace((unsigned char) *p))
+    p++;
+  double val;
+  if (tk_atod(p, (size_t)(end - p), &val)) {
     lua_pushnumber(L, val);
     return 1;
   } else {
@@ -19,6 +23,15 @@ static inline int number (lua_State *L)
   }
 }
 
+static inline int dtoa (lua_State *L)
+{
+  double n = luaL_checknumber(L, 1);
+  char buf[TK_DTOA_BUFSIZE];
+  int len = tk_dtoa(n, buf);
+  lua_pushlstring(L, buf, (size_t) len);
+  return 1;
+}
+
 static inline int equals (lua_State *L)
 {
   lua_settop(L, 4);
@@ -44,15 +57,180 @@ static inline int equals (lua_State *L)
   return 1;
 }
 
+#define TK_BASE_SCRATCH_MT "santoku_string_base_scratch"
+#define TK_BASE_TRIM_MT "santoku_string_base_trim"
+#define TK_BASE_SCRATCH_KEEP (1 << 20)
+
+// Shared codec output buffer; large buffers are released at the next GC once
+// no codec holds them (busy).
+typedef struct {
+  char *data;
+  size_t cap;
+  bool busy;
+  bool trim;
+  bool pending;
+} tk_base_scratch_t;
+
+typedef struct {
+  tk_base_scratch_t *S;
+} tk_base_trim_t;
+
+static inline void scratch_release (tk_base_scratch_t *S)
+{
+  free(S->data);
+  S->data = NULL;
+  S->cap = 0;
+  S->trim = false;
+}
+
+static inline int tk_base_scratch_gc (lua_State *L)
+{
+  tk_base_scratch_t *S = (tk_base_scratch_t *) luaL_checkudata(L, 1, TK_BASE_SCRATCH_MT);
+  scratch_release(S);
+  return 0;
+}
+
+static inline int tk_base_trim_gc (lua_State *L)
+{
+  tk_base_trim_t *T = (tk_base_trim_t *) luaL_checkudata(L, 1, TK_BASE_TRIM_MT);
+  tk_base_scratch_t *S = T->S;
+  S->pending = false;
+  if (S->cap <= TK_BASE_SCRATCH_KEEP)
+    return 0;
+  if (S->busy)
+    S->trim = true;
+  else
+    scratch_release(S);
+  return 0;
+}
+
+// The trim userdata's environment keeps the scratch alive past its finalizer.
+static inline void scratch_trim_later (lua_State *L, tk_base_scratch_t *S)
+{
+  tk_base_trim_t *T = tk_lua_newuserdata(L, tk_base_trim_t, TK_BASE_TRIM_MT, NULL, tk_base_trim_gc);
+  T->S = S;
+  lua_newtable(L);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  lua_pop(L, 1);
+  S->pending = true;
+}
+
+static inline char *scratch (lua_State *L, size_t n)
+{
+  tk_base_scratch_t *S = (tk_base_scratch_t *) lua_touserdata(L, lua_upvalueindex(1));
+  if (n > S->cap) {
+    S->data = tk_realloc(L, S->data, n);
+    S->cap = n;
+    if (n > TK_BASE_SCRATCH_KEEP && !S->pending)
+      scratch_trim_later(L, S);
+  }
+  S->busy = true;
+  return S->data;
+}
+
+static inline void scratch_done (lua_State *L)
+{
+  tk_base_scratch_t *S = (tk_base_scratch_t *) lua_touserdata(L, lua_upvalueindex(1));
+  S->busy = false;
+  if (S->trim)
+    scratch_release(S);
+}
+
+static inline void scratch_push (lua_State *L, size_t n)
+{
+  tk_base_scratch_t *S = (tk_base_scratch_t *) lua_touserdata(L, lua_upvalueindex(1));
+  lua_pushlstring(L, S->data, n);
+  scratch_done(L);
+}
+
+// Returns out, the count, and the position where parsing stopped.
+static inline int numbers (lua_State *L)
+{
+  size_t len;
+  const char *str = luaL_checklstring(L, 1, &len);
+  size_t dlen;
+  const char *delims = luaL_optlstring(L, 3, " \t\r\n,", &dlen);
+  lua_Integer s = luaL_optinteger(L, 4, 1);
+  lua_Integer e = luaL_optinteger(L, 5, (lua_Integer) len);
+  if (s < 1)
+    s = 1;
+  if (s > (lua_Integer) len + 1)
+    s = (lua_Integer) len + 1;
+  if (e > (lua_Integer) len)
+    e = (lua_Integer) len;
+  lua_settop(L, 2);
+  int width = 0;
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    const char *type = lua_tostring(L, 2);
+    if (!strcmp(type, "f64"))
+      width = (int) sizeof(double);
+    else if (!strcmp(type, "f32"))
+      width = (int) sizeof(float);
+    else
+      return luaL_error(L, "unknown number buffer type: %s", type);
+  } else if (lua_isnil(L, 2)) {
+    lua_newtable(L);
+    lua_replace(L, 2);
+  } else {
+    luaL_checktype(L, 2, LUA_TTABLE);
+  }
+  bool delim[256] = { false };
+  for (size_t i = 0; i < dlen; i++)
+    delim[(unsigned char) delims[i]] = true;
+  const char *p = str + s - 1;
+  const char *end = str + (e < s ? s - 1 : e);
+  char *buf = NULL;
+  size_t cap = 0;
+  lua_Integer n = 0;
+  while (true) {
+    while (p < end && delim[(unsigned char) *p])
+      p++;
+    if (p >= end)
+      break;
+    double v;
+    size_t c = tk_atod(p, (size_t)(end - p), &v);
+    if (!c || (p + c < end && !delim[(unsigned char) p[c]]))
+      break;
+    p += c;
+    if (!width) {
+      lua_pushnumber(L, v);
+      lua_rawseti(L, 2, (int) ++n);
+      continue;
+    }
+    if ((size_t) n * (size_t) width + (size_t) width > cap) {
+      // Worst case is one number per two bytes left.
+      cap = (size_t) n * (size_t) width + ((size_t)(end - p) / 2 + 1) * (size_t) width;
+      buf = scratch(L, cap);
+    }
+    if (width == sizeof(double))
+      memcpy(buf + (size_t) n * sizeof(double), &v, sizeof(double));
+    else {
+      float f = (float) v;
+      memcpy(buf + (size_t) n * sizeof(float), &f, sizeof(float));
+    }
+    n++;
+  }
+  if (width) {
+    if (!buf)
+      scratch(L, 1);
+    scratch_push(L, (size_t) n * (size_t) width);
+  } else {
+    lua_pushvalue(L, 2);
+  }
+  lua_pushinteger(L, n);
+  lua_pushinteger(L, (lua_Integer)(p - str) + 1);
+  return 3;
+}
+
 static inline int to_hex (lua_State *L)
 {
   size_t size0;
   const char *data = luaL_checklstring(L, 1, &size0);
   size_t size1;
-  char *out = tk_lua_to_hex(data, size0, &size1);
-  if (!out) return tk_lua_errmalloc(L);
-  lua_pushlstring(L, out, size1);
-  free(out);
+  tk_lua_to_hex_buf(data, size0, scratch(L, size0 * 2 + 1), &size1);
+  scratch_push(L, size1);
   return 1;
 }
 
@@ -60,13 +238,24 @@ static inline int from_hex (lua_State *L)
 {
   size_t size0;
   const char *data = luaL_checklstring(L, 1, &size0);
+  if (size0 % 2 != 0)
+    return tk_lua_error(L, "Invalid hex string length");
   size_t size1;
-  const char *err;
-  char *out = tk_lua_from_hex(data, size0, &size1, &err);
-  if (err) return tk_lua_error(L, err);
-  if (!out) return tk_lua_errmalloc(L);
-  lua_pushlstring(L, out, size1);
-  free(out);
+  const char *err = tk_lua_from_hex_buf(data, size0, scratch(L, size0 / 2 + 1), &size1);
+  if (err) {
+    scratch_done(L);
+    return tk_lua_error(L, err);
+  }
+  scratch_push(L, size1);
+  return 1;
+}
+
+static inline int hex_equals (lua_State *L)
+{
+  size_t hexlen, rawlen;
+  const char *hex = luaL_checklstring(L, 1, &hexlen);
+  const char *raw = luaL_checklstring(L, 2, &rawlen);
+  lua_pushboolean(L, tk_lua_hex_equals(hex, hexlen, raw, rawlen));
   return 1;
 }
 
@@ -77,10 +266,8 @@ static inline int to_base64 (lua_State *L)
   bool url = lua_toboolean(L, 2);
   bool pad = lua_isnil(L, 3) ? true : lua_toboolean(L, 3);
   size_t size;
-  char *out = tk_lua_to_base64(src, len, url, pad, &size);
-  if (!out) return tk_lua_errmalloc(L);
-  lua_pushlstring(L, out, size);
-  free(out);
+  tk_lua_to_base64_buf(src, len, url, pad, scratch(L, ((len + 2) / 3) * 4 + 1), &size);
+  scratch_push(L, size);
   return 1;
 }
 
@@ -90,10 +277,8 @@ static inline int from_base64 (lua_State *L)
   const char *src = luaL_checklstring(L, 1, &len);
   bool url = lua_toboolean(L, 2);
   size_t size;
-  char *out = tk_lua_from_base64(src, len, url, &size);
-  if (!out) return tk_lua_errmalloc(L);
-  lua_pushlstring(L, out, size);
-  free(out);
+  tk_lua_from_base64_buf(src, len, url, scratch(L, (len * 3) / 4 + 1), &size);
+  scratch_push(L, size);
   return 1;
 }
 
@@ -119,10 +304,8 @@ static inline int to_url (lua_State *L)
   size_t size0;
   const char *data = luaL_checklstring(L, 1, &size0);
   size_t size1;
-  char *out = tk_lua_to_url(data, size0, &size1);
-  if (!out) return tk_lua_errmalloc(L);
-  lua_pushlstring(L, out, size1);
-  free(out);
+  tk_lua_to_url_buf(data, size0, scratch(L, size0 * 3 + 1), &size1);
+  scratch_push(L, size1);
   return 1;
 }
 
@@ -131,12 +314,12 @@ static inline int from_url (lua_State *L)
   size_t size0;
   const char *data = luaL_checklstring(L, 1, &size0);
   size_t size1;
-  const char *err;
-  char *out = tk_lua_from_url(data, size0, &size1, &err);
-  if (err) return tk_lua_error(L, err);
-  if (!out) return tk_lua_errmalloc(L);
-  lua_pushlstring(L, out, size1);
-  free(out);
+  const char *err = tk_lua_from_url_buf(data, size0, scratch(L, size0 + 1), &size1);
+  if (err) {
+    scratch_done(L);
+    return tk_lua_error(L, err);
+  }
+  scratch_push(L, size1);
   return 1;
 }
 
@@ -195,76 +378,54 @@ static inline void parse_url_set_param (lua_State *L, int tbl_idx, const char *q
   }
 }
 
-static inline int parse_url (lua_State *L)
-{
-  size_t len;
-  const char *url = luaL_optlstring(L, 1, NULL, &len);
-  int has_result = lua_type(L, 2) == LUA_TTABLE;
-
-  if (has_result) {
-    lua_settop(L, 2);
-  } else {
-    lua_settop(L, 1);
-    lua_newtable(L);
-  }
-  int result = lua_gettop(L);
+#define TK_PARSED_URL_MT "santoku_string_base_parsed_url"
 
-  lua_pushnil(L); lua_setfield(L, result, "scheme");
-  lua_pushnil(L); lua_setfield(L, result, "userinfo");
-  lua_pushnil(L); lua_setfield(L, result, "host");
-  lua_pushnil(L); lua_setfield(L, result, "port");
-  lua_pushnil(L); lua_setfield(L, result, "fragment");
+typedef struct {
+  size_t off;
+  size_t len;
+  bool set;
+} tk_url_span_t;
 
-  lua_getfield(L, result, "path");
-  if (lua_type(L, -1) != LUA_TTABLE) {
-    lua_pop(L, 1);
-    lua_newtable(L);
-    lua_pushvalue(L, -1);
-    lua_setfield(L, result, "path");
-  }
-  int path_tbl = lua_gettop(L);
-  for (int i = (int)lua_objlen(L, path_tbl); i >= 1; i--) {
-    lua_pushnil(L);
-    lua_rawseti(L, path_tbl, i);
-  }
+// Offsets into the URL string, which the owner keeps alive.
+typedef struct {
+  const char *url;
+  tk_url_span_t scheme;
+  tk_url_span_t userinfo;
+  tk_url_span_t host;
+  tk_url_span_t fragment;
+  tk_url_span_t pathname;
+  tk_url_span_t query;
+  long port;
+  bool path_ready;
+  bool params_ready;
+} tk_parsed_url_t;
 
-  lua_getfield(L, result, "params");
-  if (lua_type(L, -1) != LUA_TTABLE) {
-    lua_pop(L, 1);
-    lua_newtable(L);
-    lua_pushvalue(L, -1);
-    lua_setfield(L, result, "params");
-  }
-  int params_tbl = lua_gettop(L);
-  lua_pushnil(L);
-  while (lua_next(L, params_tbl)) {
-    lua_pop(L, 1);
-    lua_pushvalue(L, -1);
-    lua_pushnil(L);
-    lua_settable(L, params_tbl);
-  }
+static inline void url_span (tk_url_span_t *S, const char *url, const char *p, size_t len)
+{
+  S->off = (size_t)(p - url);
+  S->len = len;
+  S->set = true;
+}
 
-  if (!url) {
-    lua_pushvalue(L, result);
-    return 1;
-  }
+static inline void parse_url_spans (tk_parsed_url_t *U, const char *url, size_t len)
+{
+  memset(U, 0, sizeof(*U));
+  U->url = url;
+  if (!url)
+    return;
 
   const char *p = url;
   const char *end = url + len;
 
   const char *hash = memchr(p, '#', (size_t)(end - p));
   if (hash) {
-    lua_pushlstring(L, hash + 1, (size_t)(end - hash - 1));
-    lua_setfield(L, result, "fragment");
+    url_span(&U->fragment, url, hash + 1, (size_t)(end - hash - 1));
     end = hash;
   }
 
   const char *ques = memchr(p, '?', (size_t)(end - p));
-  const char *query = NULL;
-  size_t query_len = 0;
   if (ques) {
-    query = ques + 1;
-    query_len = (size_t)(end - query);
+    url_span(&U->query, url, ques + 1, (size_t)(end - ques - 1));
     end = ques;
   }
 
@@ -276,14 +437,7 @@ static inline int parse_url (lua_State *L)
       if (!isalnum(*s) && *s != '+' && *s != '-' && *s != '.') valid_scheme = 0;
     }
     if (valid_scheme) {
-      char *scheme = malloc((size_t)(colon - p + 1));
-      if (!scheme) return tk_lua_errmalloc(L);
-      for (size_t i = 0; i < (size_t)(colon - p); i++)
-        scheme[i] = tolower(p[i]);
-      scheme[colon - p] = '\0';
-      lua_pushstring(L, scheme);
-      free(scheme);
-      lua_setfield(L, result, "scheme");
+      url_span(&U->scheme, url, p, (size_t)(colon - p));
       p = colon + 1;
     }
   }
@@ -297,8 +451,7 @@ static inline int parse_url (lua_State *L)
 
     const char *at = memchr(auth_start, '@', auth_len);
     if (at) {
-      lua_pushlstring(L, auth_start, (size_t)(at - auth_start));
-      lua_setfield(L, result, "userinfo");
+      url_span(&U->userinfo, url, auth_start, (size_t)(at - auth_start));
       auth_start = at + 1;
       auth_len = (size_t)(auth_end - auth_start);
     }
@@ -306,37 +459,68 @@ static inline int parse_url (lua_State *L)
     if (auth_len > 0 && auth_start[0] == '[') {
       const char *bracket_end = memchr(auth_start, ']', auth_len);
       if (bracket_end) {
-        lua_pushlstring(L, auth_start + 1, (size_t)(bracket_end - auth_start - 1));
-        lua_setfield(L, result, "host");
-        if (bracket_end + 1 < auth_end && bracket_end[1] == ':') {
-          long port = strtol(bracket_end + 2, NULL, 10);
-          if (port > 0) {
-            lua_pushinteger(L, port);
-            lua_setfield(L, result, "port");
-          }
-        }
+        url_span(&U->host, url, auth_start + 1, (size_t)(bracket_end - auth_start - 1));
+        if (bracket_end + 1 < auth_end && bracket_end[1] == ':')
+          U->port = strtol(bracket_end + 2, NULL, 10);
       }
     } else {
       const char *port_colon = memchr(auth_start, ':', auth_len);
       if (port_colon) {
-        lua_pushlstring(L, auth_start, (size_t)(port_colon - auth_start));
-        lua_setfield(L, result, "host");
-        long port = strtol(port_colon + 1, NULL, 10);
-        if (port > 0) {
-          lua_pushinteger(L, port);
-          lua_setfield(L, result, "port");
-        }
+        url_span(&U->host, url, auth_start, (size_t)(port_colon - auth_start));
+        U->port = strtol(port_colon + 1, NULL, 10);
       } else if (auth_len > 0) {
-        lua_pushlstring(L, auth_start, auth_len);
-        lua_setfield(L, result, "host");
+        url_span(&U->host, url, auth_start, auth_len);
       }
     }
     p = auth_end;
   }
 
-  lua_pushlstring(L, p, (size_t)(end - p));
-  lua_setfield(L, result, "pathname");
+  url_span(&U->pathname, url, p, (size_t)(end - p));
+}
 
+static inline void url_push_span (lua_State *L, tk_parsed_url_t *U, tk_url_span_t *S)
+{
+  if (S->set)
+    lua_pushlstring(L, U->url + S->off, S->len);
+  else
+    lua_pushnil(L);
+}
+
+static inline void url_push_scheme (lua_State *L, tk_parsed_url_t *U)
+{
+  if (!U->scheme.set) {
+    lua_pushnil(L);
+    return;
+  }
+  char *scheme = scratch(L, U->scheme.len);
+  for (size_t i = 0; i < U->scheme.len; i++)
+    scheme[i] = (char) tolower(U->url[U->scheme.off + i]);
+  scratch_push(L, U->scheme.len);
+}
+
+static inline void url_push_port (lua_State *L, tk_parsed_url_t *U)
+{
+  if (U->port > 0)
+    lua_pushinteger(L, U->port);
+  else
+    lua_pushnil(L);
+}
+
+static inline void url_push_search (lua_State *L, tk_parsed_url_t *U)
+{
+  if (U->query.set) {
+    lua_pushliteral(L, "?");
+    lua_pushlstring(L, U->url + U->query.off, U->query.len);
+    lua_concat(L, 2);
+  } else {
+    lua_pushliteral(L, "");
+  }
+}
+
+static inline void url_fill_path (lua_State *L, tk_parsed_url_t *U, int t)
+{
+  const char *p = U->url + U->pathname.off;
+  const char *end = p + U->pathname.len;
   int path_idx = 1;
   while (p < end) {
     while (p < end && *p == '/') p++;
@@ -344,25 +528,593 @@ static inline int parse_url (lua_State *L)
     const char *seg_end = p;
     while (seg_end < end && *seg_end != '/') seg_end++;
     lua_pushlstring(L, p, (size_t)(seg_end - p));
-    lua_rawseti(L, path_tbl, path_idx++);
+    lua_rawseti(L, t, path_idx++);
     p = seg_end;
   }
+}
 
-  if (query) {
-    lua_pushliteral(L, "?");
-    lua_pushlstring(L, query, query_len);
-    lua_concat(L, 2);
-    lua_setfield(L, result, "search");
-    parse_url_set_param(L, params_tbl, query, query_len);
+static inline int url_reuse_table (lua_State *L, int idx, const char *field, bool array)
+{
+  lua_getfield(L, idx, field);
+  if (lua_type(L, -1) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, idx, field);
+  }
+  int t = lua_gettop(L);
+  if (array) {
+    for (int i = (int)lua_objlen(L, t); i >= 1; i--) {
+      lua_pushnil(L);
+      lua_rawseti(L, t, i);
+    }
   } else {
-    lua_pushliteral(L, "");
-    lua_setfield(L, result, "search");
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_settable(L, t);
+    }
+  }
+  return t;
+}
+
+static inline int parse_url (lua_State *L)
+{
+  size_t len;
+  const char *url = luaL_optlstring(L, 1, NULL, &len);
+  int has_result = lua_type(L, 2) == LUA_TTABLE;
+
+  if (has_result) {
+    lua_settop(L, 2);
+  } else {
+    lua_settop(L, 1);
+    lua_newtable(L);
   }
+  int result = lua_gettop(L);
+
+  tk_parsed_url_t U;
+  parse_url_spans(&U, url, len);
+
+  url_push_scheme(L, &U); lua_setfield(L, result, "scheme");
+  url_push_span(L, &U, &U.userinfo); lua_setfield(L, result, "userinfo");
+  url_push_span(L, &U, &U.host); lua_setfield(L, result, "host");
+  url_push_port(L, &U); lua_setfield(L, result, "port");
+  url_push_span(L, &U, &U.fragment); lua_setfield(L, result, "fragment");
+
+  int path_tbl = url_reuse_table(L, result, "path", true);
+  int params_tbl = url_reuse_table(L, result, "params", false);
+
+  if (!url) {
+    lua_pushvalue(L, result);
+    return 1;
+  }
+
+  url_push_span(L, &U, &U.pathname);
+  lua_setfield(L, result, "pathname");
+  url_fill_path(L, &U, path_tbl);
+  url_push_search(L, &U);
+  lua_setfield(L, result, "search");
+  if (U.query.set)
+    parse_url_set_param(L, params_tbl, U.url + U.query.off, U.query.len);
 
   lua_pushvalue(L, result);
   return 1;
 }
 
+// Fields decode lazily; path and params tables are reused across parses.
+static inline int parsed_url_index (lua_State *L)
+{
+  tk_parsed_url_t *U = (tk_parsed_url_t *) luaL_checkudata(L, 1, TK_PARSED_URL_MT);
+  const char *key = lua_tostring(L, 2);
+  if (!key || lua_type(L, 2) != LUA_TSTRING)
+    return 0;
+  if (!strcmp(key, "pathname")) {
+    url_push_span(L, U, &U->pathname);
+  } else if (!strcmp(key, "host")) {
+    url_push_span(L, U, &U->host);
+  } else if (!strcmp(key, "search")) {
+    if (!U->url)
+      return 0;
+    url_push_search(L, U);
+  } else if (!strcmp(key, "path") || !strcmp(key, "params")) {
+    bool path = !strcmp(key, "path");
+    lua_getfenv(L, 1);
+    int env = lua_gettop(L);
+    if (path ? U->path_ready : U->params_ready) {
+      lua_getfield(L, env, key);
+      return 1;
+    }
+    int t = url_reuse_table(L, env, key, path);
+    if (path) {
+      if (U->url)
+        url_fill_path(L, U, t);
+      U->path_ready = true;
+    } else {
+      if (U->query.set)
+        parse_url_set_param(L, t, U->url + U->query.off, U->query.len);
+      U->params_ready = true;
+    }
+  } else if (!strcmp(key, "scheme")) {
+    url_push_scheme(L, U);
+  } else if (!strcmp(key, "port")) {
+    url_push_port(L, U);
+  } else if (!strcmp(key, "userinfo")) {
+    url_push_span(L, U, &U->userinfo);
+  } else if (!strcmp(key, "fragment")) {
+    url_push_span(L, U, &U->fragment);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static inline int parsed_url_newindex (lua_State *L)
+{
+  return luaL_error(L, "parsed URLs are read-only");
+}
+
+static inline void parsed_url_set (lua_State *L, int idx, int url_idx)
+{
+  tk_parsed_url_t *U = (tk_parsed_url_t *) luaL_checkudata(L, idx, TK_PARSED_URL_MT);
+  size_t len = 0;
+  const char *url = luaL_optlstring(L, url_idx, NULL, &len);
+  lua_getfenv(L, idx);
+  lua_pushvalue(L, url_idx);
+  lua_rawseti(L, -2, 1);
+  lua_pop(L, 1);
+  parse_url_spans(U, url, len);
+}
+
+static inline int parse_url_into (lua_State *L)
+{
+  lua_settop(L, 2);
+  parsed_url_set(L, 1, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static inline int parsed_url (lua_State *L)
+{
+  lua_settop(L, 1);
+  lua_newuserdata(L, sizeof(tk_parsed_url_t));
+  if (luaL_newmetatable(L, TK_PARSED_URL_MT)) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushcclosure(L, parsed_url_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, parsed_url_newindex);
+    lua_setfield(L, -2, "__newindex");
+  }
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lua_setfenv(L, -2);
+  parsed_url_set(L, 2, 1);
+  return 1;
+}
+
+static inline bool query_sep (char c)
+{
+  return c == '&' || c == '=' || c == '?';
+}
+
+// Converts like tonumber, with true and false mapped to booleans.
+static inline void query_push_value (lua_State *L, const char *s, size_t len)
+{
+  size_t n;
+  char *out = scratch(L, len + 1);
+  const char *err = tk_lua_from_url_buf(s, len, out, &n);
+  if (err) {
+    scratch_done(L);
+    tk_lua_error(L, err);
+    return;
+  }
+  if (n == 4 && !memcmp(out, "true", 4)) {
+    scratch_done(L);
+    lua_pushboolean(L, 1);
+  } else if (n == 5 && !memcmp(out, "false", 5)) {
+    scratch_done(L);
+    lua_pushboolean(L, 0);
+  } else {
+    scratch_push(L, n);
+    if (lua_isnumber(L, -1)) {
+      lua_Number v = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+      lua_pushnumber(L, v);
+    }
+  }
+}
+
+// Like gmatch over "([^&=?]+)=([^&=?]*)".
+static inline int from_query (lua_State *L)
+{
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  if (lua_toboolean(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+  } else {
+    lua_settop(L, 1);
+    lua_newtable(L);
+  }
+  size_t i = 0;
+  while (i < len) {
+    if (query_sep(s[i])) {
+      i++;
+      continue;
+    }
+    size_t j = i;
+    while (j < len && !query_sep(s[j]))
+      j++;
+    if (j == len || s[j] != '=') {
+      i = j;
+      continue;
+    }
+    size_t e = j + 1;
+    while (e < len && !query_sep(s[e]))
+      e++;
+    query_push_value(L, s + i, j - i);
+    query_push_value(L, s + j + 1, e - j - 1);
+    // As in the Lua version, pairs where either side is false are dropped.
+    if (lua_toboolean(L, -2) && lua_toboolean(L, -1))
+      lua_settable(L, 2);
+    else
+      lua_pop(L, 2);
+    i = e;
+  }
+  return 1;
+}
+
+// Numbers are converted on a copy so keys stay usable by lua_next.
+static inline const char *query_tostring (lua_State *L, int idx, size_t *len)
+{
+  switch (lua_type(L, idx)) {
+    case LUA_TSTRING:
+      return lua_tolstring(L, idx, len);
+    case LUA_TNUMBER:
+      lua_pushvalue(L, idx);
+      return lua_tolstring(L, -1, len);
+    case LUA_TBOOLEAN:
+      *len = lua_toboolean(L, idx) ? 4 : 5;
+      return lua_toboolean(L, idx) ? "true" : "false";
+    default:
+      return NULL;
+  }
+}
+
+static inline char *query_reserve (lua_State *L, size_t n)
+{
+  tk_base_scratch_t *S = (tk_base_scratch_t *) lua_touserdata(L, lua_upvalueindex(1));
+  return scratch(L, n > S->cap ? n * 2 : S->cap);
+}
+
+static inline void query_append (lua_State *L, int out, const char *s, size_t len, bool encode)
+{
+  if (encode) {
+    size_t n;
+    tk_lua_to_url_buf(s, len, scratch(L, len * 3 + 1), &n);
+    scratch_push(L, n);
+  } else {
+    lua_pushlstring(L, s, len);
+  }
+  lua_rawseti(L, out, (int) lua_objlen(L, out) + 1);
+}
+
+static inline int to_query (lua_State *L)
+{
+  if (!lua_toboolean(L, 1))
+    return 0;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  bool concat = lua_isnoneornil(L, 2);
+  lua_settop(L, 2);
+  if (!concat && !lua_toboolean(L, 2)) {
+    lua_newtable(L);
+    lua_replace(L, 2);
+  } else if (!concat) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+  }
+  int out = 2;
+  size_t n = 0;
+  if (concat)
+    query_reserve(L, 1)[n++] = '?';
+  else
+    query_append(L, out, "?", 1, false);
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    int top = lua_gettop(L);
+    size_t klen, vlen;
+    const char *k = query_tostring(L, top - 1, &klen);
+    const char *v = query_tostring(L, top, &vlen);
+    if (k && v) {
+      if (concat) {
+        char *buf = query_reserve(L, n + (klen + vlen) * 3 + 2);
+        size_t m;
+        tk_lua_to_url_buf(k, klen, buf + n, &m);
+        n += m;
+        buf[n++] = '=';
+        tk_lua_to_url_buf(v, vlen, buf + n, &m);
+        n += m;
+        buf[n++] = '&';
+      } else {
+        query_append(L, out, k, klen, true);
+        query_append(L, out, "=", 1, false);
+        query_append(L, out, v, vlen, true);
+        query_append(L, out, "&", 1, false);
+      }
+    }
+    lua_settop(L, top - 1);
+  }
+  if (concat) {
+    scratch_push(L, n - 1);
+  } else {
+    lua_pushnil(L);
+    lua_rawseti(L, out, (int) lua_objlen(L, out));
+    lua_pushvalue(L, out);
+  }
+  return 1;
+}
+
+#define TK_BASE_CODEC_MT "santoku_string_base_codec"
+
+typedef enum {
+  TK_CODEC_HEX,
+  TK_CODEC_BASE64,
+  TK_CODEC_URL,
+} tk_base_codec_kind_t;
+
+// Incomplete groups carry into the next update, matching the one-shot codecs.
+typedef struct {
+  tk_base_codec_kind_t kind;
+  bool decode;
+  bool url;
+  bool pad;
+  bool done;
+  unsigned char carry[4];
+  size_t ncarry;
+  char *buf;
+  size_t cap;
+} tk_base_codec_t;
+
+static inline int tk_base_codec_gc (lua_State *L)
+{
+  tk_base_codec_t *C = (tk_base_codec_t *) luaL_checkudata(L, 1, TK_BASE_CODEC_MT);
+  free(C->buf);
+  C->buf = NULL;
+  C->cap = 0;
+  return 0;
+}
+
+static inline char *codec_buf (lua_State *L, tk_base_codec_t *C, size_t n)
+{
+  if (n > C->cap) {
+    C->buf = tk_realloc(L, C->buf, n);
+    C->cap = n;
+  }
+  return C->buf;
+}
+
+static inline size_t codec_hex (lua_State *L, tk_base_codec_t *C, const char *s, size_t len, bool finish)
+{
+  size_t n, size = 0, i = 0;
+  if (!C->decode) {
+    tk_lua_to_hex_buf(s, len, codec_buf(L, C, len * 2 + 1), &n);
+    return n;
+  }
+  if (finish) {
+    if (C->ncarry)
+      tk_lua_error(L, "Invalid hex string length");
+    return 0;
+  }
+  char *out = codec_buf(L, C, len / 2 + 2);
+  const char *err = NULL;
+  if (C->ncarry && len) {
+    char pair[2] = { (char) C->carry[0], s[0] };
+    err = tk_lua_from_hex_buf(pair, 2, out, &n);
+    size = n;
+    i = 1;
+    C->ncarry = 0;
+  }
+  size_t m = (len - i) & ~(size_t) 1;
+  if (!err)
+    err = tk_lua_from_hex_buf(s + i, m, out + size, &n);
+  if (err)
+    tk_lua_error(L, err);
+  size += n;
+  i += m;
+  if (i < len)
+    C->carry[C->ncarry++] = (unsigned char) s[i];
+  return size;
+}
+
+static inline size_t codec_base64_encode (lua_State *L, tk_base_codec_t *C, const char *s, size_t len, bool finish)
+{
+  size_t n, size = 0, i = 0;
+  char *out = codec_buf(L, C, (len + 2) / 3 * 4 + 8);
+  if (finish) {
+    tk_lua_to_base64_buf((const char *) C->carry, C->ncarry, C->url, C->pad, out, &n);
+    C->ncarry = 0;
+    return n;
+  }
+  if (C->ncarry) {
+    while (C->ncarry < 3 && i < len)
+      C->carry[C->ncarry++] = (unsigned char) s[i++];
+    if (C->ncarry < 3)
+      return 0;
+    tk_lua_to_base64_buf((const char *) C->carry, 3, C->url, C->pad, out, &n);
+    size = n;
+    C->ncarry = 0;
+  }
+  size_t m = (len - i) / 3 * 3;
+  tk_lua_to_base64_buf(s + i, m, C->url, C->pad, out + size, &n);
+  size += n;
+  for (i += m; i < len; i++)
+    C->carry[C->ncarry++] = (unsigned char) s[i];
+  return size;
+}
+
+// Stops for good at the first character outside the alphabet.
+static inline size_t codec_base64_decode (lua_State *L, tk_base_codec_t *C, const char *s, size_t len, bool finish)
+{
+  const unsigned char *dec = C->url ? tk_lua_b64url_dec : tk_lua_b64_dec;
+  size_t n = 0, size = 0, i = 0;
+  char *out = codec_buf(L, C, len / 4 * 3 + 6);
+  if (!finish && !C->done) {
+    while (C->ncarry && C->ncarry < sizeof(C->carry) && i < len) {
+      if (dec[(unsigned char) s[i]] > 63) {
+        C->done = true;
+        break;
+      }
+      C->carry[C->ncarry++] = (unsigned char) s[i++];
+      if (C->ncarry == 4) {
+        tk_lua_from_base64_buf((const char *) C->carry, 4, C->url, out, &n);
+        size = n;
+        C->ncarry = 0;
+      }
+    }
+    if (!C->done) {
+      size_t m = (len - i) / 4 * 4;
+      tk_lua_from_base64_buf(s + i, m, C->url, out + size, &n);
+      size += n;
+      if (n < m / 4 * 3) {
+        C->done = true;
+        return size;
+      }
+      for (i += m; i < len; i++) {
+        if (dec[(unsigned char) s[i]] > 63) {
+          C->done = true;
+          break;
+        }
+        C->carry[C->ncarry++] = (unsigned char) s[i];
+      }
+    }
+    if (!C->done)
+      return size;
+  }
+  if (C->ncarry) {
+    tk_lua_from_base64_buf((const char *) C->carry, C->ncarry, C->url, out + size, &n);
+    size += n;
+    C->ncarry = 0;
+  }
+  return size;
+}
+
+static inline size_t codec_url (lua_State *L, tk_base_codec_t *C, const char *s, size_t len, bool finish)
+{
+  size_t n = 0, size = 0, i = 0;
+  if (!C->decode) {
+    tk_lua_to_url_buf(s, len, codec_buf(L, C, len * 3 + 1), &n);
+    return n;
+  }
+  if (finish) {
+    if (C->ncarry)
+      tk_lua_error(L, "Invalid URL encoding");
+    return 0;
+  }
+  char *out = codec_buf(L, C, len + 3);
+  if (C->ncarry) {
+    while (C->ncarry < 3 && i < len)
+      C->carry[C->ncarry++] = (unsigned char) s[i++];
+    if (C->ncarry < 3)
+      return 0;
+    tk_lua_from_url_buf((const char *) C->carry, 3, out, &n);
+    size = n;
+    C->ncarry = 0;
+  }
+  while (i < len) {
+    const char *pct = memchr(s + i, '%', len - i);
+    size_t run = pct ? (size_t) (pct - (s + i)) : len - i;
+    memcpy(out + size, s + i, run);
+    size += run;
+    i += run;
+    if (!pct)
+      break;
+    if (len - i < 3) {
+      while (i < len && C->ncarry < sizeof(C->carry))
+        C->carry[C->ncarry++] = (unsigned char) s[i++];
+      break;
+    }
+    tk_lua_from_url_buf(s + i, 3, out + size, &n);
+    size += n;
+    i += 3;
+  }
+  return size;
+}
+
+static inline int codec_run (lua_State *L, const char *s, size_t len, bool finish)
+{
+  tk_base_codec_t *C = (tk_base_codec_t *) luaL_checkudata(L, 1, TK_BASE_CODEC_MT);
+  size_t n;
+  switch (C->kind) {
+    case TK_CODEC_HEX:
+      n = codec_hex(L, C, s, len, finish);
+      break;
+    case TK_CODEC_BASE64:
+      n = C->decode
+        ? codec_base64_decode(L, C, s, len, finish)
+        : codec_base64_encode(L, C, s, len, finish);
+      break;
+    default:
+      n = codec_url(L, C, s, len, finish);
+      break;
+  }
+  if (finish) {
+    C->ncarry = 0;
+    C->done = false;
+  }
+  lua_pushlstring(L, C->buf ? C->buf : "", n);
+  return 1;
+}
+
+static inline int codec_update (lua_State *L)
+{
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  return codec_run(L, s, len, false);
+}
+
+static inline int codec_finish (lua_State *L)
+{
+  return codec_run(L, NULL, 0, true);
+}
+
+static luaL_Reg codec_fns[] =
+{
+  { "update", codec_update },
+  { "finish", codec_finish },
+  { NULL, NULL }
+};
+
+static inline int codec_new (lua_State *L, bool decode)
+{
+  const char *kind = luaL_checkstring(L, 1);
+  tk_base_codec_t *C = tk_lua_newuserdata(L, tk_base_codec_t, TK_BASE_CODEC_MT, codec_fns, tk_base_codec_gc);
+  C->decode = decode;
+  C->pad = lua_isnoneornil(L, 2) ? true : lua_toboolean(L, 2);
+  if (!strcmp(kind, "hex")) {
+    C->kind = TK_CODEC_HEX;
+  } else if (!strcmp(kind, "base64")) {
+    C->kind = TK_CODEC_BASE64;
+  } else if (!strcmp(kind, "base64_url")) {
+    C->kind = TK_CODEC_BASE64;
+    C->url = true;
+  } else if (!strcmp(kind, "url")) {
+    C->kind = TK_CODEC_URL;
+  } else {
+    return luaL_error(L, "unknown codec: %s", kind);
+  }
+  return 1;
+}
+
+static inline int encoder (lua_State *L)
+{
+  return codec_new(L, false);
+}
+
+static inline int decoder (lua_State *L)
+{
+  return codec_new(L, true);
+}
+
 static luaL_Reg fns[] =
 {
   { "to_hex", to_hex },
@@ -375,10 +1127,20 @@ static luaL_Reg fns[] =
   { "from_base64_url", from_base64_url },
   { "from_url", from_url },
 
+  { "encoder", encoder },
+  { "decoder", decoder },
+
   { "number", number },
+  { "numbers", numbers },
+  { "dtoa", dtoa },
   { "equals", equals },
+  { "hex_equals", hex_equals },
 
   { "parse_url", parse_url },
+  { "parse_url_into", parse_url_into },
+  { "from_query", from_query },
+  { "to_query", to_query },
+  { "parsed_url", parsed_url },
 
   { NULL, NULL }
 };
@@ -386,6 +1148,7 @@ static luaL_Reg fns[] =
 int luaopen_santoku_string_base (lua_State *L)
 {
   lua_newtable(L);
-  luaL_register(L, NULL, fns);
+  tk_lua_newuserdata(L, tk_base_scratch_t, TK_BASE_SCRATCH_MT, NULL, tk_base_scratch_gc);
+  tk_lua_register(L, fns, 1);
   return 1;
 }
@@ -0,0 +1,348 @@
+#include <santoku/lua/utils.h>
+#include <errno.h>
+#include <stdio.h>
+
+#define TK_CSV_MT "santoku_string_csv"
+#define TK_CSV_BLOCK_DEFAULT (1 << 20)
+
+// Results of csv_row besides a field count.
+#define TK_CSV_NEED (-1)
+#define TK_CSV_DONE (-2)
+
+// Readers tokenize a string in place, or a file handle through a buffer
+// refilled a block at a time. A row is always parsed from its first byte, so
+// when it runs past the buffer the buffer is refilled (and grown, for rows
+// longer than it) and the row parsed again. Lines without the quote
+// character are split with memchr; the rest go through a small state machine
+// for RFC 4180 quoting, lenient about text after a closing quote and about
+// unterminated quotes at the end of input.
+typedef struct {
+  FILE **fh;
+  char *buf;
+  size_t cap;
+  size_t block;
+  const char *data;
+  size_t pos;
+  size_t len;
+  bool eof;
+  char delim;
+  char quote;
+  bool quoting;
+  char *field;
+  size_t fcap;
+  size_t flen;
+} tk_csv_t;
+
+static inline tk_csv_t *peek_csv (lua_State *L, int i)
+{
+  return (tk_csv_t *) luaL_checkudata(L, i, TK_CSV_MT);
+}
+
+static inline int tk_csv_gc (lua_State *L)
+{
+  tk_csv_t *C = peek_csv(L, 1);
+  free(C->buf);
+  free(C->field);
+  C->buf = NULL;
+  C->field = NULL;
+  C->data = NULL;
+  C->fh = NULL;
+  return 0;
+}
+
+// Moves the unread bytes to the front of the buffer and reads another block
+// after them, growing the buffer when a single row fills it.
+static inline void csv_fill (lua_State *L, tk_csv_t *C)
+{
+  if (!C->fh) {
+    C->eof = true;
+    return;
+  }
+  if (!*C->fh)
+    luaL_error(L, "attempt to use a closed file");
+  size_t keep = C->len - C->pos;
+  if (C->pos)
+    memmove(C->buf, C->buf + C->pos, keep);
+  C->pos = 0;
+  C->len = keep;
+  if (C->cap - keep < C->block) {
+    size_t cap = C->cap ? C->cap : C->block;
+    while (cap - keep < C->block)
+      cap *= 2;
+    C->buf = tk_realloc(L, C->buf, cap);
+    C->cap = cap;
+  }
+  size_t r = fread(C->buf + keep, 1, C->cap - keep, *C->fh);
+  if (r == 0) {
+    if (ferror(*C->fh))
+      tk_lua_errno(L, errno);
+    C->eof = true;
+  }
+  C->len += r;
+  C->data = C->buf;
+}
+
+static inline void csv_append (lua_State *L, tk_csv_t *C, const char *s, size_t n)
+{
+  if (!n)
+    return;
+  if (C->flen + n > C->fcap) {
+    size_t cap = C->fcap ? C->fcap : 256;
+    while (cap < C->flen + n)
+      cap *= 2;
+    C->field = tk_realloc(L, C->field, cap);
+    C->fcap = cap;
+  }
+  memcpy(C->field + C->flen, s, n);
+  C->flen += n;
+}
+
+static inline void csv_push (lua_State *L, int t, int i, const char *s, size_t n)
+{
+  lua_pushlstring(L, s, n);
+  lua_rawseti(L, t, i);
+}
+
+// Scans from s to the next delimiter or newline, appending what it passes.
+// Like the unquoted path, drops a \r that ends the line, whether a newline or
+// the end of input follows. Returns NULL when the input ends first and more
+// may follow.
+static inline const char *csv_plain (lua_State *L, tk_csv_t *C, const char *s, const char *end)
+{
+  const char *f = s;
+  while (s < end && *s != C->delim && *s != '\n')
+    s++;
+  if (s == end && !C->eof)
+    return NULL;
+  const char *e = s;
+  if ((e == end || *e == '\n') && e > f && e[-1] == '\r')
+    e--;
+  csv_append(L, C, f, (size_t)(e - f));
+  return s;
+}
+
+static inline int csv_quoted_row (lua_State *L, tk_csv_t *C, int t, const char *p, const char *end)
+{
+  const char *s = p;
+  int n = 0;
+  while (true) {
+    C->flen = 0;
+    if (s < end && *s == C->quote) {
+      s++;
+      while (true) {
+        const char *q = memchr(s, C->quote, (size_t)(end - s));
+        if (!q) {
+          if (!C->eof)
+            return TK_CSV_NEED;
+          csv_append(L, C, s, (size_t)(end - s));
+          s = end;
+          break;
+        }
+        csv_append(L, C, s, (size_t)(q - s));
+        if (q + 1 == end && !C->eof)
+          return TK_CSV_NEED;
+        if (q + 1 < end && q[1] == C->quote) {
+          csv_append(L, C, q, 1);
+          s = q + 2;
+          continue;
+        }
+        s = q + 1;
+        break;
+      }
+    }
+    s = csv_plain(L, C, s, end);
+    if (!s)
+      return TK_CSV_NEED;
+    csv_push(L, t, ++n, C->field, C->flen);
+    if (s < end && *s == C->delim) {
+      s++;
+      continue;
+    }
+    if (s < end)
+      s++;
+    break;
+  }
+  C->pos = (size_t)(s - C->data);
+  return n;
+}
+
+// Parses the next row into the table at t, returning its field count,
+// TK_CSV_NEED when the buffer ends mid-row, or TK_CSV_DONE at the end.
+static inline int csv_row (lua_State *L, tk_csv_t *C, int t)
+{
+  const char *p = C->data + C->pos;
+  const char *end = C->data + C->len;
+  if (p == end)
+    return C->eof ? TK_CSV_DONE : TK_CSV_NEED;
+  const char *nl = memchr(p, '\n', (size_t)(end - p));
+  if (!nl && !C->eof)
+    return TK_CSV_NEED;
+  const char *le = nl ? nl : end;
+  if (C->quoting && memchr(p, C->quote, (size_t)(le - p)))
+    return csv_quoted_row(L, C, t, p, end);
+  C->pos = (size_t)((nl ? nl + 1 : end) - C->data);
+  if (le > p && le[-1] == '\r')
+    le--;
+  if (le == p)
+    return 0;
+  int n = 0;
+  while (true) {
+    const char *d = memchr(p, C->delim, (size_t)(le - p));
+    csv_push(L, t, ++n, p, (size_t)((d ? d : le) - p));
+    if (!d)
+      break;
+    p = d + 1;
+  }
+  return n;
+}
+
+// Reads the next row into the table at t, clearing entries left from a
+// longer previous row. Returns the field count or TK_CSV_DONE.
+static inline int csv_next (lua_State *L, tk_csv_t *C, int t)
+{
+  int n;
+  while ((n = csv_row(L, C, t)) == TK_CSV_NEED)
+    csv_fill(L, C);
+  if (n == TK_CSV_DONE)
+    return n;
+  for (int i = n + 1; ; i++) {
+    lua_rawgeti(L, t, i);
+    bool set = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (!set)
+      break;
+    lua_pushnil(L);
+    lua_rawseti(L, t, i);
+  }
+  return n;
+}
+
+// Pushes the table rows are read into: the argument at i when given, or the
+// table kept by the reader.
+static inline int csv_rowtable (lua_State *L, int i)
+{
+  if (lua_isnoneornil(L, i)) {
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, 2);
+    lua_replace(L, i);
+    lua_pop(L, 1);
+  } else {
+    luaL_checktype(L, i, LUA_TTABLE);
+  }
+  return i;
+}
+
+static inline int csv_read (lua_State *L)
+{
+  tk_csv_t *C = peek_csv(L, 1);
+  lua_settop(L, 2);
+  int t = csv_rowtable(L, 2);
+  int n = csv_next(L, C, t);
+  if (n == TK_CSV_DONE)
+    return 0;
+  lua_pushvalue(L, t);
+  lua_pushinteger(L, n);
+  return 2;
+}
+
+// Calls fn(row, n) for each row with the same table, stopping early when fn
+// returns false. Returns the number of rows passed to fn.
+static inline int csv_each (lua_State *L)
+{
+  tk_csv_t *C = peek_csv(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 3);
+  int t = csv_rowtable(L, 3);
+  lua_Integer rows = 0;
+  int n;
+  while ((n = csv_next(L, C, t)) != TK_CSV_DONE) {
+    rows++;
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, t);
+    lua_pushinteger(L, n);
+    lua_call(L, 2, 1);
+    bool stop = lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (stop)
+      break;
+  }
+  lua_pushinteger(L, rows);
+  return 1;
+}
+
+static luaL_Reg csv_fns[] =
+{
+  { "read", csv_read },
+  { "each", csv_each },
+  { NULL, NULL }
+};
+
+static inline char csv_optchar (lua_State *L, int opts, char *field, char def, bool *set)
+{
+  lua_getfield(L, opts, field);
+  if (set)
+    *set = !(lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1));
+  if (lua_isnil(L, -1) || (set && !*set)) {
+    lua_pop(L, 1);
+    return def;
+  }
+  size_t len;
+  const char *s = lua_tolstring(L, -1, &len);
+  if (!s || len != 1)
+    tk_lua_verror(L, 3, "reader", field, "field is not a single character");
+  if (s[0] == '\n' || s[0] == '\r')
+    tk_lua_verror(L, 3, "reader", field, "field is a line break");
+  lua_pop(L, 1);
+  return s[0];
+}
+
+static inline int reader (lua_State *L)
+{
+  lua_settop(L, 2);
+  bool string = lua_type(L, 1) == LUA_TSTRING;
+  FILE **fh = string ? NULL : tk_lua_testuserdata(L, 1, LUA_FILEHANDLE);
+  if (!string && !fh)
+    return luaL_error(L, "source must be a string or file handle");
+  if (fh && !*fh)
+    return luaL_error(L, "attempt to use a closed file");
+  if (lua_isnil(L, 2)) {
+    lua_newtable(L);
+    lua_replace(L, 2);
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  tk_csv_t *C = tk_lua_newuserdata(L, tk_csv_t, TK_CSV_MT, csv_fns, tk_csv_gc);
+  C->delim = csv_optchar(L, 2, "delim", ',', NULL);
+  C->quote = csv_optchar(L, 2, "quote", '"', &C->quoting);
+  if (C->quoting && C->quote == C->delim)
+    tk_lua_verror(L, 3, "reader", "quote", "field is the same as delim");
+  lua_Integer block = tk_lua_foptinteger(L, 2, "reader", "block_size", TK_CSV_BLOCK_DEFAULT);
+  if (block < 1)
+    return luaL_error(L, "block_size must be at least 1");
+  C->block = (size_t) block;
+  if (string) {
+    C->data = lua_tolstring(L, 1, &C->len);
+    C->eof = true;
+  } else {
+    C->fh = fh;
+  }
+  lua_newtable(L);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_newtable(L);
+  lua_rawseti(L, -2, 2);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+static luaL_Reg fns[] =
+{
+  { "reader", reader },
+  { NULL, NULL }
+};
+
+int luaopen_santoku_string_csv (lua_State *L)
+{
+  lua_newtable(L);
+  tk_lua_register(L, fns, 0);
+  return 1;
+}
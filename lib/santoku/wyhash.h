@@ -0,0 +1,199 @@
+#ifndef TK_WYHASH_H
+#define TK_WYHASH_H
+
+// wyhash (final version 4, Wang Yi, public domain): a 64-bit hash built on
+// 64x64->128 bit multiplication that reads 48 bytes per round in three
+// independent lanes. tk_wyhash is the one-shot function; tk_wyhash_state_t
+// gives the same results over input fed in pieces of any size. 128-bit
+// hashes are two runs with independent seeds.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static const uint64_t tk_wyp[4] = {
+  0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+  0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL,
+};
+
+// Seed for the second half of 128-bit hashes.
+#define TK_WYHASH_SEED2 0x9e3779b97f4a7c15ULL
+
+static inline void tk_wymum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t tk_wymix(uint64_t a, uint64_t b) {
+  tk_wymum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t tk_wyr8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline uint64_t tk_wyr4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static inline uint64_t tk_wyr3(const uint8_t *p, size_t k) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+static inline uint64_t tk_wyhash_seed(uint64_t seed) {
+  return seed ^ tk_wymix(seed ^ tk_wyp[0], tk_wyp[1]);
+}
+
+static inline void tk_wyhash_block(const uint8_t *p, uint64_t *seed, uint64_t *see1, uint64_t *see2) {
+  *seed = tk_wymix(tk_wyr8(p) ^ tk_wyp[1], tk_wyr8(p + 8) ^ *seed);
+  *see1 = tk_wymix(tk_wyr8(p + 16) ^ tk_wyp[2], tk_wyr8(p + 24) ^ *see1);
+  *see2 = tk_wymix(tk_wyr8(p + 32) ^ tk_wyp[3], tk_wyr8(p + 40) ^ *see2);
+}
+
+// Hashes the last i bytes at p (i <= 48) after any 48-byte rounds. When i is
+// under 16 the final read reaches back into the input before p, which must
+// be there whenever len > 16.
+static inline uint64_t tk_wyhash_tail(const uint8_t *p, size_t i, size_t len, uint64_t seed) {
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (tk_wyr4(p) << 32) | tk_wyr4(p + ((len >> 3) << 2));
+      b = (tk_wyr4(p + len - 4) << 32) | tk_wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = tk_wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    while (i > 16) {
+      seed = tk_wymix(tk_wyr8(p) ^ tk_wyp[1], tk_wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = tk_wyr8(p + i - 16);
+    b = tk_wyr8(p + i - 8);
+  }
+  a ^= tk_wyp[1];
+  b ^= seed;
+  tk_wymum(&a, &b);
+  return tk_wymix(a ^ tk_wyp[0] ^ len, b ^ tk_wyp[1]);
+}
+
+static inline uint64_t tk_wyhash(const void *data, size_t len, uint64_t seed) {
+  const uint8_t *p = (const uint8_t *)data;
+  size_t i = len;
+  seed = tk_wyhash_seed(seed);
+  if (len > 16 && i >= 48) {
+    uint64_t see1 = seed, see2 = seed;
+    do {
+      tk_wyhash_block(p, &seed, &see1, &see2);
+      p += 48;
+      i -= 48;
+    } while (i >= 48);
+    seed ^= see1 ^ see2;
+  }
+  return tk_wyhash_tail(p, i, len, seed);
+}
+
+// Hashes a 64-bit value, for integer and double keys.
+static inline uint64_t tk_wyhash64(uint64_t x, uint64_t seed) {
+  uint64_t a = x ^ tk_wyp[0], b = seed ^ tk_wyp[1];
+  tk_wymum(&a, &b);
+  return tk_wymix(a ^ tk_wyp[0], b ^ tk_wyp[1]);
+}
+
+// Hashes a double by value: -0.0 hashes as 0.0 and every NaN alike, matching
+// equality apart from NaN never equalling itself.
+static inline uint64_t tk_wyhash_double(double x, uint64_t seed) {
+  uint64_t bits;
+  if (x == 0.0)
+    bits = 0;
+  else if (x != x)
+    bits = 0x7ff8000000000000ULL;
+  else
+    memcpy(&bits, &x, sizeof(bits));
+  return tk_wyhash64(bits, seed);
+}
+
+// Incremental state. Full 48-byte rounds run as soon as 48 bytes are
+// available, as the one-shot loop would run them, and the last 16 bytes
+// before the pending ones are kept for the tail's read-back.
+typedef struct {
+  uint64_t seed;
+  uint64_t see1;
+  uint64_t see2;
+  uint64_t len;
+  bool rounds;
+  size_t npending;
+  uint8_t buf[16 + 48];
+} tk_wyhash_state_t;
+
+static inline void tk_wyhash_init(tk_wyhash_state_t *S, uint64_t seed) {
+  S->seed = S->see1 = S->see2 = tk_wyhash_seed(seed);
+  S->len = 0;
+  S->rounds = false;
+  S->npending = 0;
+}
+
+static inline void tk_wyhash_update(tk_wyhash_state_t *S, const void *data, size_t n) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint8_t *pending = S->buf + 16;
+  S->len += n;
+  if (S->npending + n < 48) {
+    memcpy(pending + S->npending, p, n);
+    S->npending += n;
+    return;
+  }
+  S->rounds = true;
+  if (S->npending) {
+    size_t k = 48 - S->npending;
+    memcpy(pending + S->npending, p, k);
+    tk_wyhash_block(pending, &S->seed, &S->see1, &S->see2);
+    memcpy(S->buf, pending + 32, 16);
+    p += k;
+    n -= k;
+    S->npending = 0;
+  }
+  while (n >= 48) {
+    tk_wyhash_block(p, &S->seed, &S->see1, &S->see2);
+    p += 48;
+    n -= 48;
+    if (n < 48)
+      memcpy(S->buf, p - 16, 16);
+  }
+  memcpy(pending, p, n);
+  S->npending = n;
+}
+
+static inline uint64_t tk_wyhash_final(const tk_wyhash_state_t *S) {
+  const uint8_t *pending = S->buf + 16;
+  if (!S->rounds)
+    return tk_wyhash_tail(pending, S->npending, (size_t)S->len, S->seed);
+  return tk_wyhash_tail(pending, S->npending, (size_t)S->len, S->seed ^ S->see1 ^ S->see2);
+}
+
+#endif
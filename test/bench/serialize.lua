@@ -0,0 +1,122 @@
+local serialize = require("santoku.serialize")
+
+local collectgarbage = collectgarbage
+local clock = os.clock
+local print = print
+local string = string
+local io = io
+
+local sbin = serialize.serialize_binary
+local dbin = serialize.deserialize_binary
+local deserialize = serialize.deserialize
+local sjson = serialize.serialize_json
+local djson = serialize.deserialize_json
+local compress = serialize.compress
+local decompress = serialize.decompress
+
+-- Peak resident memory in KB, reset before each run via clear_refs. Only
+-- available on Linux; other platforms report n/a.
+local function peak_reset ()
+  local fh = io.open("/proc/self/clear_refs", "w")
+  if fh then
+    fh:write("5")
+    fh:close()
+  end
+end
+
+local function peak_read ()
+  local fh = io.open("/proc/self/status", "r")
+  if not fh then
+    return
+  end
+  local status = fh:read("*a")
+  fh:close()
+  return tonumber(status:match("VmHWM:%s*(%d+)"))
+end
+
+-- Runs fn once with the collector stopped to count the bytes the Lua heap
+-- allocates, then again with it running to time it and measure peak RSS.
+-- Throughput is reported against the serialized size.
+local function run (tag, bytes, fn, ...)
+  collectgarbage()
+  collectgarbage()
+  collectgarbage("stop")
+  local m0 = collectgarbage("count")
+  fn(...)
+  local m1 = collectgarbage("count")
+  collectgarbage("restart")
+  collectgarbage()
+  collectgarbage()
+  peak_reset()
+  local t0 = clock()
+  local x = fn(...)
+  local t1 = clock()
+  local r1 = peak_read()
+  bytes = bytes or #x
+  local secs = t1 - t0
+  print(string.format("%-36s %8.3fs %9.1f MB/s %10.0fKB allocated %12s peak RSS",
+    tag, secs, bytes / 1048576 / (secs > 0 and secs or 1e-9), m1 - m0,
+    r1 and string.format("%.0fKB", r1) or "n/a"))
+  return x
+end
+
+local function suite (name, data, opts)
+  opts = opts or {}
+  run(name .. " pretty", nil, serialize, data)
+  local mini = run(name .. " minify", nil, serialize, data, true)
+  local bin = run(name .. " binary", nil, sbin, data, opts.binary)
+  local zbin = run(name .. " binary compressed", nil, compress, bin)
+  run(name .. " deserialize", #mini, deserialize, mini)
+  run(name .. " deserialize_binary", #bin, dbin, bin)
+  run(name .. " decompress", #bin, decompress, zbin)
+  local json = run(name .. " serialize_json", nil, sjson, data)
+  run(name .. " deserialize_json", #json, djson, json)
+end
+
+do
+  local wide = {}
+  for i = 1, 200000 do
+    wide[i] = {
+      id = i, name = "row " .. i, score = i / 7, ok = i % 2 == 0,
+      kind = i % 3 == 0 and "error" or "info", host = "host-" .. (i % 16),
+      latency = i % 997 * 0.125, retries = i % 4, region = "us-east-1",
+      user = "user" .. (i % 1000), path = "/api/v1/items/" .. i, status = 200 }
+  end
+  suite("wide records", wide, { binary = { columnar = true } })
+end
+
+do
+  local deep = {}
+  for i = 1, 2000 do
+    local node = { leaf = i }
+    for d = 1, 190 do
+      node = { depth = d, child = node }
+    end
+    deep[i] = node
+  end
+  suite("deep nesting", deep)
+end
+
+do
+  local strs = {}
+  for i = 1, 200000 do
+    strs[i] = "line \"" .. i .. "\"\n\ttab\\slash \0 nul \1\2\3 caf\195\169 " .. string.rep("x", i % 32)
+  end
+  suite("escaped strings", strs)
+end
+
+do
+  local doubles = {}
+  for i = 1, 1000000 do
+    doubles[i] = i / 3
+  end
+  suite("double array", doubles)
+end
+
+do
+  local ints = {}
+  for i = 1, 1000000 do
+    ints[i] = i * 37 - 5000000
+  end
+  suite("integer array", ints)
+end
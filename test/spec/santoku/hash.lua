@@ -0,0 +1,75 @@
+local test = require("santoku.test")
+local hash = require("santoku.hash")
+local validate = require("santoku.validate")
+
+local eq = validate.isequal
+local neq = validate.isnotequal
+
+test("string", function ()
+  -- Reference vectors for wyhash final 4, seeded with their index
+  local vectors = {
+    { "", "93228a4de0eec5a2" },
+    { "a", "c5bac3db178713c4" },
+    { "abc", "a97f2f7b1d9b3314" },
+    { "message digest", "786d1f1df3801df4" },
+    { "abcdefghijklmnopqrstuvwxyz", "dca5a8138ad37c87" },
+    { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", "b9e734f117cfaf70" },
+    { string.rep("1234567890", 8), "6cc5eab49a92d617" },
+  }
+  for i, v in ipairs(vectors) do
+    assert(eq(hash.string(v[1], i - 1, 64), v[2]))
+  end
+  local h = hash.string("abc")
+  assert(eq(h, hash.string("abc")))
+  assert(eq(h, math.floor(h)) and h >= 0 and h < 2 ^ 53)
+  assert(neq(h, hash.string("abc", 1)))
+  local h128 = hash.string("abc", 0, 128)
+  assert(eq(#h128, 32))
+  assert(eq(h128:sub(17), hash.string("abc", 0, 64)))
+  assert(not pcall(hash.string, "abc", 0, 32))
+end)
+
+test("hasher", function ()
+  local s = {}
+  for i = 1, 500 do
+    s[i] = string.char((i * 37) % 256)
+  end
+  s = table.concat(s)
+  for _, bits in ipairs({ 0, 64, 128 }) do
+    local h = hash.hasher(7, bits)
+    for n = 0, #s, 23 do
+      local sub = s:sub(1, n)
+      for step = 1, 60, 7 do
+        local i = 1
+        while i <= #sub do
+          h:update(sub:sub(i, i + step - 1))
+          i = i + step
+        end
+        assert(eq(h:finish(), hash.string(sub, 7, bits)))
+      end
+    end
+  end
+end)
+
+test("integer/double", function ()
+  assert(eq(hash.integer(42), hash.integer(42)))
+  assert(neq(hash.integer(42), hash.integer(43)))
+  assert(neq(hash.integer(42), hash.integer(42, 1)))
+  assert(eq(hash.double(0), hash.double(-0.0)))
+  assert(eq(hash.double(0 / 0), hash.double(-(0 / 0))))
+  assert(neq(hash.double(1.5), hash.double(2.5)))
+end)
+
+test("bucket", function ()
+  local counts = {}
+  for i = 1, 10000 do
+    local b = hash.bucket("key" .. i, 10)
+    assert(b >= 1 and b <= 10)
+    counts[b] = (counts[b] or 0) + 1
+  end
+  for b = 1, 10 do
+    assert(counts[b] > 850 and counts[b] < 1150)
+  end
+  assert(eq(hash.bucket("x", 1), 1))
+  assert(not pcall(hash.bucket, "x", 0))
+end)
@@ -0,0 +1,774 @@
+local test = require("santoku.test")
+local serialize = require("santoku.serialize")
+
+local err = require("santoku.error")
+local assert = err.assert
+
+local tbl = require("santoku.table")
+local teq = tbl.equals
+
+local vdt = require("santoku.validate")
+local eq = vdt.isequal
+
+local sbin = serialize.serialize_binary
+local dbin = serialize.deserialize_binary
+
+test("serialize_binary", function ()
+
+  test("round-trips scalars", function ()
+    assert(eq(nil, dbin(sbin(nil))))
+    assert(eq(true, dbin(sbin(true))))
+    assert(eq(false, dbin(sbin(false))))
+    assert(eq(0, dbin(sbin(0))))
+    assert(eq(-1, dbin(sbin(-1))))
+    assert(eq(123456789012, dbin(sbin(123456789012))))
+    assert(eq(1.5, dbin(sbin(1.5))))
+    assert(eq(0.1, dbin(sbin(0.1))))
+    assert(eq(1 / 0, dbin(sbin(1 / 0))))
+    assert(eq(-1 / 0, dbin(sbin(-1 / 0))))
+    local nan = dbin(sbin(0 / 0))
+    assert(nan ~= nan)
+    assert(eq(1 / -0, 1 / dbin(sbin(-0))))
+    assert(eq("", dbin(sbin(""))))
+    assert(eq("a\0b\n\"", dbin(sbin("a\0b\n\""))))
+  end)
+
+  test("round-trips tables", function ()
+    local t = {
+      1, 2, "three", { 4, 5 },
+      a = 1, b = "two", c = { d = { e = true } },
+      [1.5] = "x", [true] = false, [-3] = "neg",
+    }
+    assert(teq(t, dbin(sbin(t))))
+    assert(teq({}, dbin(sbin({}))))
+    assert(teq({ [2] = "hole" }, dbin(sbin({ [2] = "hole" }))))
+  end)
+
+  test("is smaller than text output", function ()
+    local t = {}
+    for i = 1, 1000 do
+      t[i] = { id = i, name = "name" .. i, score = i * 0.5, ok = i % 2 == 0 }
+    end
+    assert(#sbin(t) < #serialize(t, true))
+    assert(teq(t, dbin(sbin(t))))
+  end)
+
+  test("drops cycles", function ()
+    local t = { a = 1 }
+    t.self = t
+    assert(teq({ a = 1 }, dbin(sbin(t))))
+  end)
+
+  test("rejects invalid data", function ()
+    assert(not pcall(dbin, "not serialized"))
+    local s = sbin({ 1, 2, 3, a = "four" })
+    assert(not pcall(dbin, s:sub(1, #s - 1)))
+    assert(not pcall(dbin, s .. "x"))
+    assert(not pcall(sbin, { f = print }))
+  end)
+
+  test("respects max depth", function ()
+    local t = { { { {} } } }
+    assert(not pcall(sbin, t, 2))
+    assert(not pcall(dbin, sbin(t), 2))
+    assert(teq(t, dbin(sbin(t, 4), 4)))
+  end)
+
+end)
+
+test("serialize options", function ()
+
+  test("accepts an options table", function ()
+    local t = { 1, 2, { a = "b" } }
+    assert(eq(serialize(t, true), serialize(t, { minify = true })))
+    assert(eq(serialize(t), serialize(t, {})))
+    assert(not pcall(serialize, { { { {} } } }, { max_depth = 2 }))
+  end)
+
+  test("handles nesting near the default max depth", function ()
+    local t = {}
+    for i = 1, 190 do
+      t = { depth = i, child = t }
+    end
+    assert(teq(serialize.deserialize(serialize(t)), t))
+    assert(teq(serialize.deserialize(serialize(t, true)), t))
+  end)
+
+end)
+
+test("streaming", function ()
+
+  local function collect ()
+    local chunks = {}
+    return chunks, function (s)
+      chunks[#chunks + 1] = s
+    end
+  end
+
+  local t = {}
+  for i = 1, 1000 do
+    t[i] = { id = i, name = "name " .. i, long = string.rep("x", i % 100) }
+  end
+
+  test("streams text to a callback in fixed-size chunks", function ()
+    for _, minify in ipairs({ false, true }) do
+      local chunks, sink = collect()
+      local n = serialize(t, { minify = minify, sink = sink, chunk_size = 1000 })
+      local s = table.concat(chunks)
+      assert(eq(s, serialize(t, minify)))
+      assert(eq(n, #s))
+      for i = 1, #chunks - 1 do
+        assert(eq(#chunks[i], 1000))
+      end
+      assert(#chunks[#chunks] <= 1000)
+    end
+  end)
+
+  test("streams binary to a callback", function ()
+    local chunks, sink = collect()
+    serialize.serialize_binary(t, { sink = sink, chunk_size = 7 })
+    assert(teq(t, dbin(table.concat(chunks))))
+    for i = 1, #chunks - 1 do
+      assert(eq(#chunks[i], 7))
+    end
+  end)
+
+  test("streams to a file handle", function ()
+    local fh = io.tmpfile()
+    local n = serialize.serialize_binary(t, { sink = fh, chunk_size = 64 })
+    fh:seek("set")
+    local s = fh:read("*a")
+    fh:close()
+    assert(eq(n, #s))
+    assert(teq(t, dbin(s)))
+  end)
+
+  test("streams table contents", function ()
+    local chunks, sink = collect()
+    serialize.serialize_table_contents(t, { sink = sink, chunk_size = 3 })
+    assert(eq(table.concat(chunks), serialize.serialize_table_contents(t)))
+  end)
+
+  test("rejects invalid sinks", function ()
+    assert(not pcall(serialize, t, { sink = "nope" }))
+    assert(not pcall(serialize, t, { sink = print, chunk_size = 0 }))
+  end)
+
+end)
+
+test("deserialize", function ()
+
+  local des = serialize.deserialize
+
+  test("round-trips serialize output", function ()
+    local t = {
+      1, 2.5, -3, 1e300, 1 / 0, -1 / 0, "three", { 4, { 5 } }, false,
+      a = 1, b = "two\n\"\\\0\1\127\255", c = { d = { e = true } },
+      [1.5] = "x", [true] = false, [-3] = "neg", [""] = {},
+    }
+    for _, minify in ipairs({ false, true }) do
+      local s = serialize(t, minify)
+      assert(teq(t, des(s)))
+      assert(teq(t, des("return " .. s)))
+      assert(teq(des(s), loadstring("return " .. s)()))
+    end
+    local nan = des(serialize(0 / 0))
+    assert(nan ~= nan)
+  end)
+
+  test("round-trips doubles exactly", function ()
+    for _, n in ipairs({ math.pi, 1 / 3, 0.1 + 0.2, 2 ^ -1074, 1.7976931348623157e308, -2.5e-17 }) do
+      assert(eq(n, des(serialize(n))))
+      assert(eq(n, loadstring("return " .. serialize(n))()))
+    end
+    assert(eq(serialize(0.1), "0.1"))
+    assert(eq(serialize(-0.0), "-0"))
+    assert(eq(serialize(2 ^ 53), "9007199254740992"))
+  end)
+
+  test("parses scalars", function ()
+    assert(eq(nil, des("nil")))
+    assert(eq(true, des(" true ")))
+    assert(eq(false, des("false")))
+    assert(eq(-12.5, des("-12.5")))
+    assert(eq(1e-7, des("1e-07")))
+    assert(eq("a\tb", des("'a\\tb'")))
+    assert(eq("A", des("\"\\65\"")))
+  end)
+
+  test("accepts lua table constructor syntax", function ()
+    assert(teq({ 1, 2, a = 3, b = { 4 } }, des("{ 1; 2, a = 3, [\"b\"] = { 4, }, }")))
+    assert(teq({ nil, 2 }, des("{nil,2}")))
+  end)
+
+  test("does not execute code", function ()
+    assert(not pcall(des, "os.exit(1)"))
+    assert(not pcall(des, "{ a = print }"))
+    assert(not pcall(des, "(function () end)()"))
+    assert(not pcall(des, "{ 1 + 1 }"))
+  end)
+
+  test("rejects malformed input", function ()
+    assert(not pcall(des, "{ 1, 2"))
+    assert(not pcall(des, "{ 1 2 }"))
+    assert(not pcall(des, "\"abc"))
+    assert(not pcall(des, "\"\\999\""))
+    assert(not pcall(des, "{ [1] 2 }"))
+    assert(not pcall(des, "1 2"))
+    assert(not pcall(des, ""))
+  end)
+
+  test("respects max depth", function ()
+    assert(not pcall(des, "{{{}}}", 2))
+    assert(teq({ { {} } }, des("{{{}}}", 3)))
+  end)
+
+end)
+
+test("references", function ()
+
+  test("preserves shared tables", function ()
+    local shared = { x = 1 }
+    local t = { a = shared, b = shared, c = { shared } }
+    local r = dbin(sbin(t, { refs = true }))
+    assert(teq(t, r))
+    assert(r.a == r.b)
+    assert(r.c[1] == r.a)
+    local d = dbin(sbin(t))
+    assert(teq(t, d))
+    assert(d.a ~= d.b)
+  end)
+
+  test("preserves cycles", function ()
+    local t = { name = "root", children = {} }
+    t.self = t
+    t.children[1] = { parent = t }
+    t[t] = t.children
+    local r = dbin(sbin(t, { refs = true }))
+    assert(r.self == r)
+    assert(r.children[1].parent == r)
+    assert(r[r] == r.children)
+    assert(eq(r.name, "root"))
+  end)
+
+  test("shrinks output for shared data", function ()
+    local shared = {}
+    for i = 1, 100 do
+      shared[i] = "value " .. i
+    end
+    local t = {}
+    for i = 1, 100 do
+      t[i] = shared
+    end
+    assert(#sbin(t, { refs = true }) * 50 < #sbin(t))
+  end)
+
+  test("rejects bad references", function ()
+    local header = sbin(nil):sub(1, 5)
+    assert(not pcall(dbin, header .. "\7\8\5"))
+    assert(not pcall(dbin, header .. "\8\1"))
+  end)
+
+  test("honors the seen argument", function ()
+    local inner = { 1 }
+    assert(eq(serialize({ inner, 2 }, true, { [inner] = true }), "{nil,2}"))
+  end)
+
+end)
+
+test("canonical", function ()
+
+  local function build (keys)
+    local t = { 10, 20 }
+    for i = 1, #keys do
+      t[keys[i]] = { k = keys[i] }
+    end
+    return t
+  end
+
+  local fwd, rev = {}, {}
+  for i = 1, 200 do
+    fwd[#fwd + 1] = "key" .. i
+    fwd[#fwd + 1] = i * 7 + 100
+  end
+  fwd[#fwd + 1] = 1.5
+  fwd[#fwd + 1] = true
+  for i = #fwd, 1, -1 do
+    rev[#rev + 1] = fwd[i]
+  end
+
+  test("orders keys by type then value", function ()
+    local t = { "a", b = 1, a = 2, [false] = 3, [10] = 4, [-1.5] = 5, [true] = 6, ab = 7 }
+    assert(eq(serialize(t, { minify = true, canonical = true }),
+      "{\"a\",[false]=3,[true]=6,[-1.5]=5,[10]=4,[\"a\"]=2,[\"ab\"]=7,[\"b\"]=1}"))
+  end)
+
+  test("is stable across insertion order", function ()
+    local a, b = build(fwd), build(rev)
+    for i = 1, 300 do
+      b["tmp" .. i] = true
+    end
+    for i = 1, 300 do
+      b["tmp" .. i] = nil
+    end
+    assert(serialize(a, { canonical = true }) == serialize(b, { canonical = true }))
+    assert(sbin(a, { canonical = true }) == sbin(b, { canonical = true }))
+    assert(teq(dbin(sbin(a, { canonical = true })), a))
+    assert(eq(serialize.serialize_table_contents(a, { canonical = true }),
+      serialize.serialize_table_contents(b, { canonical = true })))
+  end)
+
+  test("rejects table keys", function ()
+    assert(not pcall(serialize, { [{}] = 1 }, { canonical = true }))
+    assert(not pcall(sbin, { [{}] = 1 }, { canonical = true }))
+  end)
+
+  test("digests values", function ()
+    local a, b = build(fwd), build(rev)
+    assert(eq(#serialize.digest(a), 32))
+    assert(eq(#serialize.digest(a, { bits = 64 }), 16))
+    assert(eq(serialize.digest(a), serialize.digest(b)))
+    assert(eq(serialize.digest(a, 64), serialize.digest(a):sub(17)))
+    b.extra = 1
+    assert(serialize.digest(a) ~= serialize.digest(b))
+    assert(serialize.digest(1) ~= serialize.digest(1.5))
+    assert(serialize.digest("") ~= serialize.digest(nil))
+    assert(serialize.digest({ 1 }) ~= serialize.digest({ [2] = 1 }))
+    assert(not pcall(serialize.digest, a, { bits = 32 }))
+  end)
+
+end)
+
+test("intern", function ()
+
+  local function records (n)
+    local t = {}
+    for i = 1, n do
+      t[i] = { level = i % 3 == 0 and "error" or "info", message = "request handled", id = i }
+    end
+    return t
+  end
+
+  test("round-trips interned strings", function ()
+    local t = records(50)
+    t.meta = { "info", "error", info = "error" }
+    assert(teq(dbin(sbin(t, { intern = true })), t))
+    assert(teq(dbin(sbin(t, { intern = true, refs = true })), t))
+    assert(eq(dbin(sbin("x", { intern = true })), "x"))
+  end)
+
+  test("shrinks repeated strings", function ()
+    local t = records(1000)
+    assert(#sbin(t, { intern = true }) * 2 < #sbin(t))
+  end)
+
+  test("rejects bad string references", function ()
+    local header = sbin(nil):sub(1, 5)
+    assert(not pcall(dbin, header .. "\9\10\1"))
+    assert(not pcall(dbin, header .. "\10\1"))
+    assert(teq(dbin(header .. "\9\6\2\0\5\1a\10\1"), { "a", "a" }))
+  end)
+
+end)
+
+test("columnar", function ()
+
+  local function records (n)
+    local t = {}
+    for i = 1, n do
+      t[i] = {
+        id = i,
+        score = i / 4,
+        ok = i % 3 == 0,
+        level = i % 5 == 0 and "warn" or "info",
+        tags = { "a", i } }
+    end
+    return t
+  end
+
+  test("round-trips record arrays", function ()
+    local t = records(100)
+    assert(teq(dbin(sbin(t, { columnar = true })), t))
+    assert(teq(dbin(sbin(t, { columnar = true, intern = true, canonical = true })), t))
+    local nested = { rows = records(9), other = { 1, 2, 3 } }
+    assert(teq(dbin(sbin(nested, { columnar = true })), nested))
+    local mixed = { { a = 1 }, { a = 1.5 }, { a = "x" }, { a = true } }
+    assert(teq(dbin(sbin(mixed, { columnar = true })), mixed))
+  end)
+
+  test("falls back for other shapes", function ()
+    local shapes = {
+      { { a = 1 }, { b = 1 } },
+      { { a = 1 }, { a = 1, b = 2 } },
+      { { a = 1 }, 2 },
+      { { [{}] = 1 }, { [{}] = 1 } },
+      { { a = 1 }, { a = 2 }, x = 1 },
+    }
+    for i = 1, #shapes do
+      local b = sbin(shapes[i], { columnar = true })
+      assert(eq(b, sbin(shapes[i])))
+    end
+    local t = { { a = 1 }, { a = 2 } }
+    t[1].a = t
+    assert(teq(dbin(sbin(t, { columnar = true })), dbin(sbin(t))))
+  end)
+
+  test("shrinks record arrays", function ()
+    local t = records(1000)
+    assert(#sbin(t, { columnar = true }) * 2 < #sbin(t))
+  end)
+
+  test("projects and transposes columns", function ()
+    local t = records(20)
+    local b = sbin(t, { columnar = true })
+    local p = dbin(b, { columns = { "id", "level" } })
+    assert(eq(#p, 20))
+    for i = 1, 20 do
+      assert(teq(p[i], { id = i, level = t[i].level }))
+    end
+    local c = dbin(b, { layout = "columns" })
+    for i = 1, 20 do
+      assert(eq(c.id[i], i))
+      assert(eq(c.score[i], i / 4))
+      assert(eq(c.ok[i], i % 3 == 0))
+      assert(teq(c.tags[i], t[i].tags))
+    end
+    local cp = dbin(b, { layout = "columns", columns = { "ok" } })
+    assert(teq(cp, { ok = c.ok }))
+    assert(not pcall(dbin, b, { layout = "diagonal" }))
+  end)
+
+  test("rejects malformed columns", function ()
+    local b = sbin({ { a = 1 }, { a = 2 } }, { columnar = true })
+    for i = 6, #b - 1 do
+      pcall(dbin, b:sub(1, i))
+    end
+    assert(not pcall(dbin, b:sub(1, #b - 1)))
+    assert(not pcall(dbin, sbin(nil):sub(1, 5) .. "\11\255\255\255\255\15\1"))
+  end)
+
+end)
+
+test("diff", function ()
+
+  local function snapshot ()
+    local t = { name = "state", counters = {}, items = {}, flags = { on = true } }
+    for i = 1, 100 do
+      t.counters["c" .. i] = i
+      t.items[i] = { id = i, tags = { "x", "y" } }
+    end
+    return t
+  end
+
+  test("patches changes in place", function ()
+    local a, b = snapshot(), snapshot()
+    b.counters.c5 = 500
+    b.counters.c6 = nil
+    b.counters.c101 = 101
+    b.items[7].tags[3] = "z"
+    b.flags = "off"
+    b.extra = { 1, 2, 3 }
+    b.name = nil
+    local p, n = serialize.diff(a, b)
+    assert(eq(n, 7))
+    assert(#p * 20 < #sbin(b))
+    local r = serialize.patch(a, p)
+    assert(r == a)
+    assert(teq(a, b))
+  end)
+
+  test("returns an empty patch for equal tables", function ()
+    local a, b = snapshot(), snapshot()
+    a.n = 0 / 0
+    b.n = 0 / 0
+    local p, n = serialize.diff(a, b)
+    assert(eq(n, 0))
+    assert(teq(serialize.patch(snapshot(), p), snapshot()))
+  end)
+
+  test("produces canonical patches", function ()
+    local a, b = snapshot(), snapshot()
+    for i = 1, 50 do
+      b["k" .. i] = i
+      a["d" .. i] = i
+    end
+    local c = snapshot()
+    for i = 50, 1, -1 do
+      c["k" .. i] = i
+    end
+    assert(eq(serialize.diff(a, b, { canonical = true }), serialize.diff(a, c, { canonical = true })))
+    assert(teq(serialize.patch(a, serialize.diff(a, b, { canonical = true })), b))
+  end)
+
+  test("rejects bad input", function ()
+    assert(not pcall(serialize.diff, { [{}] = 1 }, {}))
+    local t = {}
+    t.self = t
+    local u = {}
+    u.self = u
+    assert(not pcall(serialize.diff, t, u))
+    local p = serialize.diff({ a = { 1 } }, { a = { 2 } })
+    assert(not pcall(serialize.patch, { a = 1 }, p))
+    assert(not pcall(serialize.patch, {}, sbin({})))
+    assert(not pcall(serialize.patch, {}, p:sub(1, #p - 1)))
+  end)
+
+end)
+
+test("json", function ()
+
+  local sjson = serialize.serialize_json
+  local djson = serialize.deserialize_json
+
+  test("encodes values", function ()
+    assert(eq(sjson(nil), "null"))
+    assert(eq(sjson(true), "true"))
+    assert(eq(sjson(12), "12"))
+    assert(eq(sjson(-0.5), "-0.5"))
+    assert(eq(sjson(0.1), "0.1"))
+    assert(eq(sjson("a\"b\\c\n\1/é"), "\"a\\\"b\\\\c\\n\\u0001/é\""))
+    assert(eq(sjson({ 1, 2, "x" }), "[1,2,\"x\"]"))
+    assert(eq(sjson({ a = { b = false } }), "{\"a\":{\"b\":false}}"))
+    assert(eq(sjson({}), "{}"))
+    assert(eq(sjson({ 1, 2, x = 3 }, { canonical = true }), "{\"1\":1,\"2\":2,\"x\":3}"))
+    assert(eq(sjson({ [1] = 1, [3] = 3 }, { canonical = true }), "{\"1\":1,\"3\":3}"))
+    assert(eq(sjson({ 1, { a = 1 } }, true), "[\n  1,\n  {\n    \"a\": 1\n  }\n]"))
+    assert(eq(sjson(serialize.null), "null"))
+  end)
+
+  test("honors shape metatables and null sentinels", function ()
+    local null = {}
+    assert(eq(sjson(setmetatable({}, serialize.json_array)), "[]"))
+    assert(eq(sjson(setmetatable({ 1 }, serialize.json_object)), "{\"1\":1}"))
+    assert(eq(sjson({ 1, null, 3 }, { null = null }), "[1,null,3]"))
+    local t = djson("[1,null,{}]", { null = null, metatables = true })
+    assert(t[2] == null)
+    assert(getmetatable(t) == serialize.json_array)
+    assert(getmetatable(t[3]) == serialize.json_object)
+    assert(eq(sjson(t, { null = null }), "[1,null,{}]"))
+    assert(eq(sjson(djson("[[],{}]", { metatables = true })), "[[],{}]"))
+  end)
+
+  test("rejects unencodable values", function ()
+    assert(not pcall(sjson, 0 / 0))
+    assert(not pcall(sjson, 1 / 0))
+    assert(not pcall(sjson, { [true] = 1 }))
+    assert(not pcall(sjson, { [1] = "a", ["1"] = "b" }))
+    assert(not pcall(sjson, { "a", x = 1, ["1"] = "b" }))
+    assert(not pcall(sjson, { [2.5] = "a", ["2.5"] = "b" }, { canonical = true }))
+    assert(eq(sjson({ [1] = "a", ["01"] = "b" }, { canonical = true }), "{\"1\":\"a\",\"01\":\"b\"}"))
+    assert(not pcall(sjson, { f = print }))
+    local t = {}
+    t.self = t
+    assert(eq(sjson(t), "{\"self\":null}"))
+  end)
+
+  test("decodes values", function ()
+    assert(eq(djson("null"), nil))
+    assert(eq(djson(" true "), true))
+    assert(eq(djson("-12"), -12))
+    assert(eq(djson("1.5e3"), 1500))
+    assert(eq(djson("12345678901234567890"), 12345678901234567890))
+    assert(eq(1 / djson("-0"), -1 / 0))
+    assert(eq(djson("\"a\\u00e9\\ud83d\\ude00\\n\\/\""), "a\195\169\240\159\152\128\n/"))
+    assert(teq(djson("{\"a\":[1,2,{\"b\":null}],\"c\":\"d\"}"), { a = { 1, 2, {} }, c = "d" }))
+  end)
+
+  test("round-trips", function ()
+    local t = { name = "x", list = { 1, 2.5, "three", true }, nested = { deep = { value = -1e-7 } } }
+    assert(teq(djson(sjson(t)), t))
+    assert(teq(djson(sjson(t, true)), t))
+  end)
+
+  test("rejects malformed input", function ()
+    local bad = { "", "[", "[1,]", "{\"a\"}", "{a:1}", "01", "1.", "-", "1e", "tru", "\"a",
+      "\"\\x\"", "\"\1\"", "[1] 2", "{\"a\":1,}", "\"\\u12\"" }
+    for i = 1, #bad do
+      assert(not pcall(djson, bad[i]), bad[i])
+    end
+    assert(not pcall(djson, string.rep("[", 300) .. string.rep("]", 300)))
+    assert(pcall(djson, string.rep("[", 150) .. string.rep("]", 150)))
+  end)
+
+end)
+
+test("view", function ()
+
+  local data = {
+    "a", 2, 3.5, { x = 1 },
+    name = "root", [true] = "yes", [-7] = "neg", [2.5] = "half",
+    nested = { list = { 10, 20, 30 }, deep = { deeper = { value = "v" } } } }
+
+  test("round-trips indexed blobs", function ()
+    local blob = sbin(data, { indexed = true })
+    assert(teq(dbin(blob), data))
+    assert(eq(blob, sbin(data, { indexed = true })))
+    assert(eq(dbin(sbin(42, { indexed = true })), 42))
+    assert(not pcall(sbin, data, { indexed = true, refs = true }))
+    assert(not pcall(sbin, data, { indexed = true, columnar = true }))
+    assert(not pcall(sbin, data, { indexed = true, sink = function () end }))
+    assert(not pcall(sbin, { [{}] = 1 }, { indexed = true }))
+  end)
+
+  test("reads entries lazily", function ()
+    local v = serialize.view(sbin(data, { indexed = true }))
+    assert(eq(#v, 4))
+    assert(eq(v[1], "a"))
+    assert(eq(v[3], 3.5))
+    assert(eq(v[4].x, 1))
+    assert(eq(v[5], nil))
+    assert(eq(v.name, "root"))
+    assert(eq(v[true], "yes"))
+    assert(eq(v[false], nil))
+    assert(eq(v[-7], "neg"))
+    assert(eq(v[2.5], "half"))
+    assert(eq(v.missing, nil))
+    assert(eq(v[0 / 0], nil))
+    assert(eq(#v.nested.list, 3))
+    assert(eq(v.nested.list[2], 20))
+    assert(eq(v.nested.deep.deeper.value, "v"))
+    assert(not pcall(function () v.name = "x" end))
+  end)
+
+  test("iterates and materializes", function ()
+    local v = serialize.view(sbin(data, { indexed = true }))
+    local seen, n = {}, 0
+    for k, x in serialize.pairs(v) do
+      n = n + 1
+      seen[k] = type(x) == "userdata" and serialize.materialize(x) or x
+    end
+    assert(eq(n, 9))
+    assert(teq(seen, data))
+    assert(teq(serialize.materialize(v), data))
+    assert(teq(serialize.materialize(v.nested), data.nested))
+    local plain = {}
+    for k, x in serialize.pairs({ a = 1 }) do
+      plain[k] = x
+    end
+    assert(teq(plain, { a = 1 }))
+  end)
+
+  test("maps files", function ()
+    local big = {}
+    for i = 1, 1000 do
+      big["k" .. i] = { id = i, tags = { "t" .. i } }
+    end
+    local path = os.tmpname()
+    local fh = io.open(path, "wb")
+    fh:write(sbin(big, { indexed = true }))
+    fh:close()
+    local v = serialize.mmap(path)
+    assert(eq(v.k500.id, 500))
+    assert(eq(v.k999.tags[1], "t999"))
+    assert(eq(v.k1001, nil))
+    v = nil
+    collectgarbage()
+    os.remove(path)
+    assert(not pcall(serialize.mmap, path))
+  end)
+
+  test("rejects unsupported blobs", function ()
+    assert(not pcall(serialize.view, sbin(data, { refs = true })))
+    assert(not pcall(serialize.view, sbin(data, { intern = true })))
+    assert(not pcall(serialize.view, "nope"))
+    local blob = sbin(data, { indexed = true })
+    assert(not pcall(serialize.view, blob:sub(1, #blob - 1)))
+    assert(not pcall(dbin, blob:sub(1, #blob - 1)))
+    assert(teq(serialize.view(sbin(data)), data))
+  end)
+
+end)
+
+test("compression", function ()
+
+  local records = {}
+  for i = 1, 2000 do
+    records[i] = { id = i, name = "user" .. (i % 50), kind = "info", path = "/api/v1/items/" .. i }
+  end
+
+  test("round-trips strings", function ()
+    local inputs = { "", "a", "abcdefghijklm", string.rep("a", 100000), string.rep("hello world ", 5000) }
+    local noise = {}
+    for i = 1, 5000 do
+      noise[i] = string.char((i * 7919) % 251)
+    end
+    inputs[#inputs + 1] = table.concat(noise)
+    for i = 1, #inputs do
+      assert(eq(serialize.decompress(serialize.compress(inputs[i])), inputs[i]))
+    end
+    assert(#serialize.compress(string.rep("a", 100000)) < 1000)
+  end)
+
+  test("compresses serializer output", function ()
+    local bin = sbin(records, { compress = true })
+    assert(#bin * 3 < #sbin(records))
+    assert(teq(dbin(bin), records))
+    assert(teq(serialize.deserialize(serialize(records, { compress = true })), records))
+    assert(eq(serialize.serialize_json(records, { compress = true }), serialize.serialize_json(records)))
+    assert(not pcall(serialize.deserialize_json, serialize.compress(serialize.serialize_json(records))))
+    assert(eq(serialize.decompress(bin), sbin(records)))
+  end)
+
+  test("streams compressed blocks", function ()
+    local chunks = {}
+    local n = sbin(records, { compress = true, sink = function (c)
+      chunks[#chunks + 1] = c
+    end, chunk_size = 4096 })
+    local z = table.concat(chunks)
+    assert(eq(n, #z))
+    assert(teq(dbin(z), records))
+  end)
+
+  test("rejects malformed frames", function ()
+    local z = serialize.compress(string.rep("abc", 1000))
+    assert(not pcall(serialize.decompress, "plain"))
+    assert(not pcall(serialize.decompress, z:sub(1, #z - 1)))
+    assert(not pcall(serialize.decompress, z .. "x"))
+    assert(not pcall(serialize.view, sbin({ 1, 2 }, { compress = true, indexed = true })))
+  end)
+
+end)
+
+test("string escaping", function ()
+
+  test("escapes every byte at every vector offset", function ()
+    local bytes = {}
+    for c = 0, 255 do
+      bytes[#bytes + 1] = string.char(c)
+    end
+    bytes = table.concat(bytes)
+    for pad = 0, 33 do
+      local s = string.rep("x", pad) .. bytes .. string.rep("y", pad)
+      assert(eq(serialize.deserialize(serialize(s)), s))
+      assert(eq(serialize.deserialize_json(serialize.serialize_json(s)), s))
+    end
+    assert(eq(serialize("\0\1\127\128\255\a\"\\"), "\"\\000\\001\\127\\128\\255\\a\\\"\\\\\""))
+  end)
+
+end)
+
+test("decimal point locale", function ()
+
+  test("parses numbers whatever LC_NUMERIC is", function ()
+    local old = os.setlocale(nil, "numeric")
+    local loc
+    for _, l in ipairs({ "de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8", "ru_RU.UTF-8" }) do
+      loc = os.setlocale(l, "numeric")
+      if loc then
+        break
+      end
+    end
+    if not loc then
+      return
+    end
+    local ok, e = pcall(function ()
+      local t = { 1.5, -0.25, 1e300, 12345678901234567 }
+      assert(teq(serialize.deserialize(serialize(t)), t))
+      assert(teq(serialize.deserialize_json(serialize.serialize_json(t)), t))
+      assert(eq(serialize.deserialize_json("2.5e-3"), 2.5e-3))
+    end)
+    os.setlocale(old, "numeric")
+    assert(ok, e)
+  end)
+
+end)
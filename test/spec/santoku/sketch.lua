@@ -0,0 +1,96 @@
+local test = require("santoku.test")
+local sketch = require("santoku.sketch")
+local validate = require("santoku.validate")
+
+local eq = validate.isequal
+
+test("bloom", function ()
+  local b = sketch.bloom(10000, 0.01)
+  local fresh = 0
+  for i = 1, 10000 do
+    if b:add("k" .. i) then
+      fresh = fresh + 1
+    end
+  end
+  assert(fresh > 9900, fresh)
+  assert(not b:add("k1"))
+  for i = 1, 10000 do
+    assert(b:has("k" .. i))
+  end
+  local fp = 0
+  for i = 1, 100000 do
+    if b:has("x" .. i) then
+      fp = fp + 1
+    end
+  end
+  assert(fp < 1300, fp)
+  assert(b:bytes() < 20000)
+
+  b:add(1.5)
+  b:add(0)
+  assert(b:has(1.5) and b:has(-0.0))
+  assert(not pcall(b.add, b, {}))
+
+  local c = sketch.load(b:dump())
+  for i = 1, 10000 do
+    assert(c:has("k" .. i))
+  end
+  for i = 1, 1000 do
+    assert(eq(c:has("x" .. i), b:has("x" .. i)))
+  end
+
+  local m1, m2 = sketch.bloom(1000), sketch.bloom(1000)
+  m1:add("a")
+  m2:add("b")
+  m1:merge(m2)
+  assert(m1:has("a") and m1:has("b"))
+  assert(not pcall(m1.merge, m1, sketch.bloom(2000)))
+  assert(not pcall(m1.merge, m1, sketch.bloom(1000, 0.01, 1)))
+  m1:clear()
+  assert(not m1:has("a"))
+
+  assert(sketch.bloom(1000, 1e-12):bytes() <= 1000 * 64)
+  local ok, err = pcall(sketch.bloom, 1000, 1e-30)
+  assert(not ok and tostring(err):find("false positive rate too low"), err)
+  assert(not pcall(sketch.bloom, 1000, 1e-100))
+  assert(not pcall(sketch.bloom, 1, 1e-300))
+  assert(not pcall(sketch.bloom, 0 / 0))
+  assert(not pcall(sketch.bloom, 1 / 0))
+
+  local nb = sketch.bloom(100)
+  nb:add(0 / 0)
+  assert(nb:has(-(0 / 0)))
+end)
+
+test("hll", function ()
+  local h = sketch.hll()
+  assert(eq(h:count(), 0))
+  for _ = 1, 3 do
+    for i = 1, 50000 do
+      h:add("k" .. i)
+    end
+  end
+  assert(math.abs(h:count() - 50000) < 50000 * 0.03)
+  assert(eq(h:bytes(), 2 ^ 14))
+
+  local a, b = sketch.hll(12), sketch.hll(12)
+  for i = 1, 20000 do
+    a:add(i)
+  end
+  for i = 10001, 30000 do
+    b:add(i)
+  end
+  a:merge(b)
+  assert(math.abs(a:count() - 30000) < 30000 * 0.06)
+  assert(eq(sketch.load(a:dump()):count(), a:count()))
+  assert(not pcall(a.merge, a, sketch.hll(14)))
+  a:clear()
+  assert(eq(a:count(), 0))
+  a:add(0 / 0)
+  assert(not a:add(-(0 / 0)))
+  assert(eq(math.floor(a:count() + 0.5), 1))
+
+  assert(not pcall(sketch.hll, 3))
+  assert(not pcall(sketch.load, "nope"))
+  assert(not pcall(sketch.load, a:dump():sub(1, -2)))
+end)
@@ -143,6 +143,44 @@ test("equals", function ()
   assert(teq({ false }, { str.equals("one", "one two three", 3, 1) }));
 end)
 
+test("number", function ()
+  assert(eq(str.number("  12.5e1", 1), 125))
+  assert(eq(str.number("x-0.25", 2), -0.25))
+  assert(eq(str.number("0x10", 1), 16))
+  assert(eq(str.number("abc", 2), nil))
+  for _, s in ipairs({ "0.1", "1e22", "1e23", "123456789012345678901", "2.2250738585072014e-308",
+    "9007199254740993", "1.7976931348623157e308", "4.9e-324", "-0", "1e-400" }) do
+    assert(eq(str.number(s, 1), tonumber(s)), s)
+  end
+end)
+
+test("numbers", function ()
+  local t, n, pos = str.numbers("1, 2.5\t-3e2\n4\n")
+  assert(teq(t, { 1, 2.5, -300, 4 }))
+  assert(eq(n, 4))
+  assert(eq(pos, 15))
+  local out = { 9, 9, 9, 9 }
+  t, n, pos = str.numbers("1 2 3x 4", out)
+  assert(t == out)
+  assert(teq(out, { 1, 2, 9, 9 }))
+  assert(eq(n, 2))
+  assert(eq(pos, 5))
+  t, n, pos = str.numbers("5;6;7", nil, ";", 3, 3)
+  assert(teq(t, { 6 }))
+  assert(eq(pos, 4))
+  t, n, pos = str.numbers("1 2", nil, nil, 100)
+  assert(teq(t, {}))
+  assert(eq(n, 0))
+  assert(eq(pos, 4))
+  local b
+  b, n = str.numbers("1.5 -2 3", "f64")
+  assert(eq(n, 3))
+  assert(eq(#b, 24))
+  b, n = str.numbers("1.5 -2 3", "f32")
+  assert(eq(#b, 12))
+  assert(not pcall(str.numbers, "1", "i8"))
+end)
+
 test("to/from_hex", function ()
   local s = "this is an easy test"
   assert(eq(s, str.from_hex(str.to_hex(s))))
@@ -152,6 +190,27 @@ test("to/from_hex", function ()
   assert(eq("1234567890", str.from_hex(str.to_hex("1234567890")))) -- Numeric string
   assert(eq("\xFF\xFE\xFD", str.from_hex(str.to_hex("\xFF\xFE\xFD")))) -- Non-printable bytes
   assert(eq("\x00\x01\x02\x03", str.from_hex(str.to_hex("\x00\x01\x02\x03")))) -- Leading zeros
+  local bytes = {}
+  for i = 1, 200 do
+    bytes[i] = string.char((i * 53) % 256)
+  end
+  bytes = table.concat(bytes)
+  for n = 0, #bytes, 7 do
+    local b = bytes:sub(1, n)
+    local h = str.to_hex(b)
+    assert(eq(b, str.from_hex(h)))
+    assert(eq(b, str.from_hex(h:lower())))
+    assert(str.hex_equals(h, b))
+    assert(str.hex_equals(h:lower(), b))
+    if n > 0 then
+      assert(not pcall(str.from_hex, h:sub(1, n - 1) .. "g" .. h:sub(n + 1)))
+      assert(not str.hex_equals(h:sub(1, n - 1) .. "g" .. h:sub(n + 1), b))
+      assert(not str.hex_equals(h, b:sub(1, n - 1) .. "\0"))
+      assert(not str.hex_equals(h:sub(2), b))
+    end
+  end
+  assert(not pcall(str.from_hex, "abc"))
+
 end)
 
 test("to/from_base64", function ()
@@ -165,6 +224,26 @@ test("to/from_base64", function ()
   assert(eq("\xFF\xFE\xFD", str.from_base64(str.to_base64("\xFF\xFE\xFD")))) -- Non-printable bytes
   assert(eq("Man", str.from_base64("TWFu"))) -- Valid base64 for "Man"
   assert(eq("Man", str.from_base64("TWFu=="))) -- Base64 with padding
+  assert(eq("Ma", str.from_base64("TWE"))) -- Missing padding
+  assert(eq("Man", str.from_base64("TWFu\nTWFu"))) -- Stops at the first invalid character
+  assert(eq("", str.from_base64("T"))) -- Lone character
+  -- Lengths around the vector widths, with a stray character at each offset
+  local bytes = {}
+  for i = 1, 200 do
+    bytes[i] = string.char((i * 37) % 256)
+  end
+  bytes = table.concat(bytes)
+  for n = 0, #bytes do
+    local b = bytes:sub(1, n)
+    local e = str.to_base64(b)
+    assert(eq(b, str.from_base64(e)))
+    assert(eq(#e, math.ceil(n * 4 / 3)))
+    if n % 3 == 0 and n > 0 then
+      local k = (n * 7) % #e + 1
+      k = k - (k - 1) % 4
+      assert(eq(str.from_base64(e:sub(1, k - 1) .. "*" .. e:sub(k + 1)), b:sub(1, (k - 1) / 4 * 3)))
+    end
+  end
 end)
 
 test("to/from_base64_url", function ()
@@ -194,6 +273,246 @@ test("to/from_url", function ()
     str.from_url(str.to_url("A simple test with   spaces")))) -- URL encoding spaces
 end)
 
+test("codec scratch buffer", function ()
+  -- Outputs past the 1MB scratch size that is always kept, reused across
+  -- calls and released on collection
+  local big = string.rep("\0\255ab", 2 ^ 18)
+  local hex = str.to_hex(big)
+  assert(eq(#hex, 2 ^ 21))
+  assert(eq(str.to_hex(big), hex))
+  assert(eq(str.from_hex(hex), big))
+  assert(eq(str.to_hex("ab"), "6162"))
+  assert(eq(str.to_base64(big), str.to_base64(big)))
+  collectgarbage()
+  assert(eq(str.to_hex("ab"), "6162"))
+  assert(eq(str.from_hex(str.to_hex(big)), big))
+  collectgarbage()
+  collectgarbage()
+  assert(eq(str.from_base64(str.to_base64(big)), big))
+  -- Failed calls release the buffer too. Seen through resident memory, with
+  -- buffers past glibc's largest mmap threshold, and only where a successful
+  -- call's buffer shows as released.
+  local function rss ()
+    local f = io.open("/proc/self/statm")
+    if not f then
+      return
+    end
+    f:read("*n")
+    local pages = f:read("*n")
+    f:close()
+    return pages and pages * 4096
+  end
+  local function released (fn)
+    collectgarbage()
+    fn()
+    local before = rss()
+    collectgarbage()
+    local after = rss()
+    return before and after and before - after > 32 * 2 ^ 20
+  end
+  local hexbig = string.rep("ab", 2 ^ 25 + 2 ^ 20)
+  if released(function () assert(#str.from_hex(hexbig) == 2 ^ 25 + 2 ^ 20) end) then
+    local bad = hexbig .. "zz"
+    hexbig = nil -- luacheck: ignore
+    assert(released(function () assert(not pcall(str.from_hex, bad)) end))
+  end
+  hexbig = nil -- luacheck: ignore
+  -- A collection in the middle of a codec leaves its buffer in place
+  local params = {}
+  for i = 1, 5000 do
+    params["key" .. i] = i + 0.5
+  end
+  local pause = collectgarbage("setpause", 0)
+  local stepmul = collectgarbage("setstepmul", 1000)
+  local ok, e = pcall(function ()
+    assert(eq(str.to_url(big), str.to_url(big)))
+    assert(teq(str.from_query(str.to_query(params)), params))
+  end)
+  collectgarbage("setpause", pause)
+  collectgarbage("setstepmul", stepmul)
+  assert(ok, e)
+end)
+
+test("encoder/decoder", function ()
+
+  local bytes = {}
+  for i = 1, 300 do
+    bytes[i] = string.char((i * 131) % 256)
+  end
+  bytes = table.concat(bytes)
+
+  -- Feeds s in chunks of every size from 1 to 7 and returns the joined output
+  local function stream (codec, s, step)
+    local out = {}
+    local i = 1
+    while i <= #s do
+      out[#out + 1] = codec:update(s:sub(i, i + step - 1))
+      i = i + step
+    end
+    out[#out + 1] = codec:finish()
+    return table.concat(out)
+  end
+
+  local cases = {
+    { "hex", str.to_hex, str.from_hex },
+    { "base64", function (s) return str.to_base64(s, false, true) end, str.from_base64 },
+    { "base64_url", function (s) return str.to_base64_url(s) end, str.from_base64_url },
+    { "url", str.to_url, str.from_url },
+  }
+
+  for _, c in ipairs(cases) do
+    local enc, dec = str.encoder(c[1]), str.decoder(c[1])
+    for n = 0, #bytes, 37 do
+      local b = bytes:sub(1, n)
+      local e = c[2](b)
+      for step = 1, 7 do
+        assert(eq(stream(enc, b, step), e), c[1])
+        assert(eq(stream(dec, e, step), b), c[1])
+      end
+    end
+  end
+
+  -- base64 decoding stops at the first invalid character, across chunks
+  local e = str.to_base64(bytes, false, true)
+  for k = 1, #e, 13 do
+    local bad = e:sub(1, k - 1) .. "*" .. e:sub(k + 1)
+    for step = 1, 7 do
+      assert(eq(stream(str.decoder("base64"), bad, step), str.from_base64(bad)))
+    end
+  end
+
+  assert(eq(stream(str.encoder("base64", false), "ab", 1), "YWI"))
+  assert(not pcall(stream, str.decoder("hex"), "abc", 1))
+  assert(not pcall(stream, str.decoder("hex"), "zz", 1))
+  assert(not pcall(stream, str.decoder("url"), "a%4", 1))
+  assert(not pcall(str.encoder, "rot13"))
+
+end)
+
+test("parsed_url", function ()
+
+  local fields = { "scheme", "userinfo", "host", "port", "fragment", "pathname", "search" }
+
+  local function same (u, url)
+    local t = str.parse_url(url)
+    for _, k in ipairs(fields) do
+      assert(eq(u[k], t[k]), k)
+    end
+    assert(teq(u.path, t.path), "path")
+    assert(teq(u.params, t.params), "params")
+  end
+
+  local urls = {
+    "HTTPS://user:pw@example.com:8443/a//b/c/?x=1&y=true&z=false&w=hi%20there#frag",
+    "http://[::1]:8080/v1?q",
+    "mailto:someone@example.com",
+    "/relative/path?a=1.5",
+    "//host.only",
+    "",
+  }
+
+  local u = str.parsed_url()
+  same(u, nil)
+  for _, url in ipairs(urls) do
+    same(str.parsed_url(url), url)
+    -- Refilled in place, with path and params reused
+    local path, params = u.path, u.params
+    assert(str.parse_url_into(u, url) == u)
+    same(u, url)
+    assert(u.path == path and u.params == params)
+  end
+
+  u = str.parsed_url(urls[1])
+  assert(eq(u.scheme, "https"))
+  assert(eq(u.port, 8443))
+  assert(teq(u.path, { "a", "b", "c" }))
+  assert(teq(u.params, { x = 1, y = true, z = false, w = "hi there" }))
+  assert(not pcall(function () u.host = "x" end))
+
+end)
+
+test("csv", function ()
+
+  local csv = require("santoku.string.csv")
+
+  local function rows (src, opts)
+    local out = {}
+    csv.reader(src, opts):each(function (row, n)
+      local r = {}
+      for i = 1, n do
+        r[i] = row[i]
+      end
+      out[#out + 1] = r
+    end)
+    return out
+  end
+
+  local function from_file (s, opts)
+    local fh = io.tmpfile()
+    fh:write(s)
+    fh:seek("set")
+    local r = rows(fh, opts)
+    fh:close()
+    return r
+  end
+
+  local text = table.concat({
+    "a,b,c",
+    "1,,3",
+    "\"quoted, with comma\",\"with \"\"quotes\"\"\",x",
+    "\"multi\nline\",y\r",
+    "",
+    "\"\",\"tail\"after,",
+  }, "\n")
+
+  local expected = {
+    { "a", "b", "c" },
+    { "1", "", "3" },
+    { "quoted, with comma", "with \"quotes\"", "x" },
+    { "multi\nline", "y" },
+    {},
+    { "", "tailafter", "" },
+  }
+
+  assert(teq(rows(text), expected))
+  assert(teq(rows(text .. "\n"), expected))
+  for block = 1, 9 do
+    assert(teq(from_file(text, { block_size = block }), expected))
+  end
+
+  assert(teq(rows("a\tb\n\"c\td\"", { delim = "\t" }), { { "a", "b" }, { "c\td" } }))
+  assert(teq(rows("\"a\",b", { quote = false }), { { "\"a\"", "b" } }))
+  assert(teq(rows("\"open,end"), { { "open,end" } }))
+  assert(not pcall(csv.reader, "a\"b,c\n\"x\"", { delim = "\"" }))
+  assert(not pcall(csv.reader, "a", { delim = "\n" }))
+  assert(not pcall(csv.reader, "a", { quote = "\r" }))
+  assert(teq(rows("a\"b", { delim = "\"", quote = false }), { { "a", "b" } }))
+  assert(teq(rows(""), {}))
+
+  -- A final line without a newline drops its \r, quoted or not
+  assert(teq(rows("a,b\r"), { { "a", "b" } }))
+  assert(teq(rows("\"a\",b\r"), { { "a", "b" } }))
+  assert(teq(rows("a,\"b\"\r"), { { "a", "b" } }))
+  assert(teq(rows("\"a\",\"b\r\""), { { "a", "b\r" } }))
+  for block = 1, 4 do
+    assert(teq(from_file("\"a\",b\r", { block_size = block }), { { "a", "b" } }))
+  end
+
+  -- One table is reused and cleared past the current row
+  local r = csv.reader("a,b,c\nd\n")
+  local t, n = r:read()
+  assert(teq(t, { "a", "b", "c" }) and n == 3)
+  local t2, n2 = r:read()
+  assert(t2 == t and n2 == 1)
+  assert(teq(t, { "d" }))
+  assert(r:read() == nil)
+
+  assert(eq(csv.reader("1\n2\n3\n"):each(function (row) return row[1] ~= "2" end), 2))
+  assert(not pcall(csv.reader, {}))
+  assert(not pcall(csv.reader, "", { delim = ",," }))
+
+end)
+
 test("to/from_query", function ()
   local params = {
     a = "",
@@ -204,6 +523,17 @@ test("to/from_query", function ()
     e = true,
   }
   assert(teq(params, str.from_query(str.to_query(params))))
+  assert(teq(str.from_query("?a=1&b=x%20y&c=true&d=false&e=&f&=g&h=0x10&i+j=1e2"),
+    { a = 1, b = "x y", c = true, e = "", h = 16, ["i+j"] = 100 }))
+  local out = { x = 1 }
+  assert(str.from_query("a=b", out) == out)
+  assert(teq(out, { x = 1, a = "b" }))
+  assert(not pcall(str.from_query, "a=%4"))
+  assert(eq(str.to_query({}), ""))
+  assert(eq(str.to_query({ a = "x y" }), "?a=x%20y"))
+  assert(eq(str.to_query({ [1.5] = {}, b = print }), ""))
+  assert(teq(str.to_query({ a = 1 }, { "p" }), { "p", "?", "a", "=", "1" }))
+  assert(str.to_query(nil) == nil)
 end)
 
 test("format_number", function ()
@@ -212,6 +542,8 @@ test("format_number", function ()
   assert(eq(str.format_number(-678), "-678"))
   assert(eq(str.format_number(-1678), "-1,678"))
   assert(eq(str.format_number(78), "78"))
+  assert(eq(str.format_number(1234.5), "1,234.5"))
+  assert(eq(str.format_number(1234567.0625), "1,234,567.0625"))
 end)
 
 test("escape", function ()
@@ -292,3 +624,16 @@ test("encode_url", function ()
   assert(eq(str.encode_url({ host = "example.com", params = { x = 1 } }), "//example.com?x=1"))
   assert(eq(str.encode_url({ host = "example.com", fragment = "top" }), "//example.com#top"))
 end)
+
+test("dtoa", function ()
+  assert(eq(str.dtoa(0.1), "0.1"))
+  assert(eq(str.dtoa(0.1 + 0.2), "0.30000000000000004"))
+  assert(eq(str.dtoa(-1.5), "-1.5"))
+  assert(eq(str.dtoa(100), "100"))
+  assert(eq(str.dtoa(1e300), "1e+300"))
+  assert(eq(str.dtoa(5e-324), "5e-324"))
+  assert(eq(str.dtoa(-0.0), "-0"))
+  for _, n in ipairs({ math.pi, 1 / 3, 2 ^ 0.5, 123456.789, 1.7976931348623157e308, 2.5e-17 }) do
+    assert(eq(tonumber(str.dtoa(n)), n))
+  end
+end)